@@ -0,0 +1,328 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+namespace ngbtools
+{
+    /// <summary>
+    /// BLAKE3 (https://github.com/BLAKE3-team/BLAKE3-specs), 256-bit output, unkeyed. This is a portable
+    /// implementation of the reference design: the input is split into 1 KB chunks whose chaining values
+    /// are merged into a binary tree, so the result is the same as with any other BLAKE3 implementation.
+    ///
+    /// usage: update() as often as needed, then finalize() once
+    /// </summary>
+    class blake3 final
+    {
+    public:
+        static constexpr size_t DIGEST_SIZE = 32;
+        static constexpr size_t CHUNK_SIZE = 1024;
+
+        blake3()
+        {
+            reset();
+        }
+
+        void reset()
+        {
+            m_stack_size = 0;
+            m_chunk.reset(IV, 0);
+        }
+
+        void update(const unsigned char* data, size_t size)
+        {
+            while (size)
+            {
+                // a chunk is only closed once we know more input follows: the last chunk needs other flags
+                if (m_chunk.length() == CHUNK_SIZE)
+                {
+                    uint32_t chaining_value[8];
+                    m_chunk.output().chaining_value(chaining_value);
+                    const auto total_chunks{ m_chunk.chunk_counter + 1 };
+                    add_chunk_chaining_value(chaining_value, total_chunks);
+                    m_chunk.reset(IV, total_chunks);
+                }
+                const auto bytes_to_take{ std::min(size, CHUNK_SIZE - m_chunk.length()) };
+                m_chunk.update(data, bytes_to_take);
+                data += bytes_to_take;
+                size -= bytes_to_take;
+            }
+        }
+
+        void finalize(unsigned char result[DIGEST_SIZE]) const
+        {
+            auto node{ m_chunk.output() };
+            for (size_t index = m_stack_size; index > 0; --index)
+            {
+                uint32_t chaining_value[8];
+                node.chaining_value(chaining_value);
+                node = parent_output(m_stack[index - 1], chaining_value);
+            }
+            node.root_bytes(result);
+        }
+
+        /// <summary>
+        /// Calculate the chaining value of a complete subtree, independent of any hasher: this is what lets
+        /// several threads hash different parts of the same input. The subtree must not contain the last
+        /// chunk of the input, because that chunk is finalized differently.
+        /// </summary>
+        /// <param name="data">input of the subtree</param>
+        /// <param name="size">a power of two times CHUNK_SIZE</param>
+        /// <param name="first_chunk">index of the first chunk of the subtree in the input, a multiple of size / CHUNK_SIZE</param>
+        /// <param name="result">receives the chaining value, to pass to add_subtree()</param>
+        static void subtree_chaining_value(const unsigned char* data, size_t size, uint64_t first_chunk, uint32_t result[8])
+        {
+            const auto number_of_chunks{ size / CHUNK_SIZE };
+            assert((size % CHUNK_SIZE == 0) && number_of_chunks && !(number_of_chunks & (number_of_chunks - 1)));
+            assert(first_chunk % number_of_chunks == 0);
+
+            uint32_t stack[54][8];
+            size_t stack_size = 0;
+            for (uint64_t index = 0; index < number_of_chunks; ++index)
+            {
+                chunk_state chunk;
+                chunk.reset(IV, first_chunk + index);
+                chunk.update(data + index * CHUNK_SIZE, CHUNK_SIZE);
+
+                uint32_t chaining_value[8];
+                chunk.output().chaining_value(chaining_value);
+                for (auto total_chunks = index + 1; !(total_chunks & 1); total_chunks >>= 1)
+                {
+                    parent_output(stack[--stack_size], chaining_value).chaining_value(chaining_value);
+                }
+                memcpy(stack[stack_size++], chaining_value, 8 * sizeof(uint32_t));
+            }
+            assert(stack_size == 1);
+            memcpy(result, stack[0], 8 * sizeof(uint32_t));
+        }
+
+        /// <summary>
+        /// Continue the input with a subtree whose chaining value was calculated by subtree_chaining_value().
+        /// The input so far must end on a chunk boundary that is a multiple of the subtree size.
+        /// </summary>
+        void add_subtree(const uint32_t chaining_value[8], size_t size)
+        {
+            const auto number_of_chunks{ size / CHUNK_SIZE };
+
+            // a full chunk is only closed once we know more input follows, which is now
+            if (m_chunk.length() == CHUNK_SIZE)
+            {
+                uint32_t chunk_chaining_value[8];
+                m_chunk.output().chaining_value(chunk_chaining_value);
+                const auto total_chunks{ m_chunk.chunk_counter + 1 };
+                add_chunk_chaining_value(chunk_chaining_value, total_chunks);
+                m_chunk.reset(IV, total_chunks);
+            }
+            assert(m_chunk.length() == 0);
+            assert(m_chunk.chunk_counter % number_of_chunks == 0);
+
+            // the same merging as for a single chunk, only some levels up the tree
+            const auto total_chunks{ m_chunk.chunk_counter + number_of_chunks };
+            uint32_t merged[8];
+            memcpy(merged, chaining_value, sizeof(merged));
+            for (auto total_subtrees = total_chunks / number_of_chunks; !(total_subtrees & 1); total_subtrees >>= 1)
+            {
+                parent_output(m_stack[--m_stack_size], merged).chaining_value(merged);
+            }
+            memcpy(m_stack[m_stack_size++], merged, sizeof(merged));
+            m_chunk.reset(IV, total_chunks);
+        }
+
+    private:
+        static constexpr size_t BLOCK_SIZE = 64;
+
+        enum : uint32_t
+        {
+            CHUNK_START = 1 << 0,
+            CHUNK_END = 1 << 1,
+            PARENT = 1 << 2,
+            ROOT = 1 << 3,
+        };
+
+        static constexpr uint32_t IV[8] = {
+            0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+        };
+
+        static uint32_t rotate_right(uint32_t x, int n)
+        {
+            return (x >> n) | (x << (32 - n));
+        }
+
+        static void g(uint32_t* state, int a, int b, int c, int d, uint32_t mx, uint32_t my)
+        {
+            state[a] = state[a] + state[b] + mx;
+            state[d] = rotate_right(state[d] ^ state[a], 16);
+            state[c] = state[c] + state[d];
+            state[b] = rotate_right(state[b] ^ state[c], 12);
+            state[a] = state[a] + state[b] + my;
+            state[d] = rotate_right(state[d] ^ state[a], 8);
+            state[c] = state[c] + state[d];
+            state[b] = rotate_right(state[b] ^ state[c], 7);
+        }
+
+        static void compress(const uint32_t chaining_value[8], const uint32_t block[16], uint64_t counter, uint32_t block_length, uint32_t flags, uint32_t result[16])
+        {
+            static constexpr uint8_t PERMUTATION[16] = { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+
+            uint32_t state[16] = {
+                chaining_value[0], chaining_value[1], chaining_value[2], chaining_value[3],
+                chaining_value[4], chaining_value[5], chaining_value[6], chaining_value[7],
+                IV[0], IV[1], IV[2], IV[3],
+                (uint32_t)counter, (uint32_t)(counter >> 32), block_length, flags
+            };
+            uint32_t m[16];
+            memcpy(m, block, sizeof(m));
+
+            for (int round = 0; round < 7; ++round)
+            {
+                g(state, 0, 4, 8, 12, m[0], m[1]);
+                g(state, 1, 5, 9, 13, m[2], m[3]);
+                g(state, 2, 6, 10, 14, m[4], m[5]);
+                g(state, 3, 7, 11, 15, m[6], m[7]);
+                g(state, 0, 5, 10, 15, m[8], m[9]);
+                g(state, 1, 6, 11, 12, m[10], m[11]);
+                g(state, 2, 7, 8, 13, m[12], m[13]);
+                g(state, 3, 4, 9, 14, m[14], m[15]);
+
+                uint32_t permuted[16];
+                for (int i = 0; i < 16; ++i)
+                    permuted[i] = m[PERMUTATION[i]];
+                memcpy(m, permuted, sizeof(m));
+            }
+            for (int i = 0; i < 8; ++i)
+            {
+                result[i] = state[i] ^ state[i + 8];
+                result[i + 8] = state[i + 8] ^ chaining_value[i];
+            }
+        }
+
+        static void words_from_bytes(const unsigned char* bytes, uint32_t* words, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i, bytes += 4)
+                words[i] = ((uint32_t)bytes[0]) | (((uint32_t)bytes[1]) << 8) | (((uint32_t)bytes[2]) << 16) | (((uint32_t)bytes[3]) << 24);
+        }
+
+        // everything needed to compress a node, which we may do as a chaining value or as the root
+        struct output
+        {
+            uint32_t input_chaining_value[8];
+            uint32_t block[16];
+            uint64_t counter;
+            uint32_t block_length;
+            uint32_t flags;
+
+            void chaining_value(uint32_t result[8]) const
+            {
+                uint32_t words[16];
+                compress(input_chaining_value, block, counter, block_length, flags, words);
+                memcpy(result, words, 8 * sizeof(uint32_t));
+            }
+
+            void root_bytes(unsigned char result[DIGEST_SIZE]) const
+            {
+                uint32_t words[16];
+                compress(input_chaining_value, block, 0, block_length, flags | ROOT, words);
+                for (size_t i = 0; i < DIGEST_SIZE / 4; ++i)
+                {
+                    result[i * 4] = (unsigned char)words[i];
+                    result[i * 4 + 1] = (unsigned char)(words[i] >> 8);
+                    result[i * 4 + 2] = (unsigned char)(words[i] >> 16);
+                    result[i * 4 + 3] = (unsigned char)(words[i] >> 24);
+                }
+            }
+        };
+
+        struct chunk_state
+        {
+            uint32_t chaining_value[8];
+            uint64_t chunk_counter;
+            unsigned char block[BLOCK_SIZE];
+            size_t block_length;
+            size_t blocks_compressed;
+
+            void reset(const uint32_t key[8], uint64_t counter)
+            {
+                memcpy(chaining_value, key, sizeof(chaining_value));
+                chunk_counter = counter;
+                memset(block, 0, sizeof(block));
+                block_length = 0;
+                blocks_compressed = 0;
+            }
+
+            size_t length() const
+            {
+                return blocks_compressed * BLOCK_SIZE + block_length;
+            }
+
+            uint32_t start_flag() const
+            {
+                return blocks_compressed ? 0 : CHUNK_START;
+            }
+
+            void update(const unsigned char* data, size_t size)
+            {
+                while (size)
+                {
+                    if (block_length == BLOCK_SIZE)
+                    {
+                        uint32_t words[16], result[16];
+                        words_from_bytes(block, words, 16);
+                        compress(chaining_value, words, chunk_counter, BLOCK_SIZE, start_flag(), result);
+                        memcpy(chaining_value, result, sizeof(chaining_value));
+                        ++blocks_compressed;
+                        memset(block, 0, sizeof(block));
+                        block_length = 0;
+                    }
+                    const auto bytes_to_take{ std::min(size, BLOCK_SIZE - block_length) };
+                    memcpy(block + block_length, data, bytes_to_take);
+                    block_length += bytes_to_take;
+                    data += bytes_to_take;
+                    size -= bytes_to_take;
+                }
+            }
+
+            blake3::output output() const
+            {
+                blake3::output result{};
+                memcpy(result.input_chaining_value, chaining_value, sizeof(chaining_value));
+                words_from_bytes(block, result.block, 16);
+                result.counter = chunk_counter;
+                result.block_length = (uint32_t)block_length;
+                result.flags = start_flag() | CHUNK_END;
+                return result;
+            }
+        };
+
+        static output parent_output(const uint32_t left[8], const uint32_t right[8])
+        {
+            output result{};
+            memcpy(result.input_chaining_value, IV, sizeof(IV));
+            memcpy(result.block, left, 8 * sizeof(uint32_t));
+            memcpy(result.block + 8, right, 8 * sizeof(uint32_t));
+            result.counter = 0;
+            result.block_length = BLOCK_SIZE;
+            result.flags = PARENT;
+            return result;
+        }
+
+        // merges completed subtrees: the number of trailing zero bits of total_chunks is the number of merges
+        void add_chunk_chaining_value(uint32_t chaining_value[8], uint64_t total_chunks)
+        {
+            while (!(total_chunks & 1))
+            {
+                parent_output(m_stack[--m_stack_size], chaining_value).chaining_value(chaining_value);
+                total_chunks >>= 1;
+            }
+            memcpy(m_stack[m_stack_size++], chaining_value, 8 * sizeof(uint32_t));
+        }
+
+    private:
+        chunk_state m_chunk;
+
+        // one chaining value per level of the tree: 54 levels are enough for 2^64 bytes
+        uint32_t m_stack[54][8];
+        size_t m_stack_size;
+    };
+}
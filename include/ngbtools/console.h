@@ -1,5 +1,10 @@
 #pragma once
 
+#include <mutex>
+
+#include <ngbtools/string.h>
+#include <ngbtools/string_writer.h>
+#include <ngbtools/unicode.h>
 
 namespace ngbtools
 {
@@ -89,6 +94,8 @@ namespace ngbtools
             bool has_retrieved_old_color_attrs;
             bool write_output_has_failed_once;
 
+            // serializes output from multiple threads, so that lines (and their color codes) don't get mixed up
+            std::recursive_mutex output_lock;
         };
 
         console_context& get_context()
@@ -117,6 +124,10 @@ namespace ngbtools
             if (!unicode_string || !wide_len)
                 return std::string();
 
+            // a console switched to UTF-8 (chcp 65001) needs no code page conversion
+            if (output_cp == CP_UTF8)
+                return unicode::encode_as_utf8(text);
+
             // we try the stack first (because that is of an order of magnitudes faster)
             // only if this fails we revert back to allocating the data on the stack
             const size_t size_of_stack_buffer = 1024;
@@ -213,6 +224,7 @@ namespace ngbtools
         inline bool write_unicode_output(std::wstring_view utf16_encoded_string)
         {
             auto& cc{ get_context() };
+            std::lock_guard<std::recursive_mutex> lock{ cc.output_lock };
 
             if (utf16_encoded_string.empty())
                 return true;
@@ -260,6 +272,7 @@ namespace ngbtools
         inline bool write_output_as_unicode(std::string_view utf8_encoded_string)
         {
             auto& cc{ get_context() };
+            std::lock_guard<std::recursive_mutex> lock{ cc.output_lock };
 
             if (utf8_encoded_string.empty())
                 return true;
@@ -271,12 +284,13 @@ namespace ngbtools
             return do_write_output_as_unicode(utf8_encoded_string);
 #else
             const char* p = utf8_encoded_string.data();
+            const char* end = p + utf8_encoded_string.size();
             while (true)
             {
-                const char* q = strchr(p, '\x1b');
+                const char* q = (const char*)memchr(p, '\x1b', end - p);
                 if (!q)
                 {
-                    return do_write_output_as_unicode(p);
+                    return do_write_output_as_unicode(std::string_view{ p, (size_t)(end - p) });
                 }
                 if (!cc.has_retrieved_old_color_attrs)
                 {
@@ -286,8 +300,10 @@ namespace ngbtools
                     cc.has_retrieved_old_color_attrs = true;
                 }
 
-                const std::string substring{ p, (size_t)(q - p) };
-                do_write_output_as_unicode(substring);
+                do_write_output_as_unicode(std::string_view{ p, (size_t)(q - p) });
+                if (end - q < 2)
+                    return true;
+
                 if (q[1] == '\xFF')
                 {
                     SetConsoleTextAttribute(cc.hConsoleOutput, cc.wOldColorAttrs);
@@ -319,7 +335,12 @@ namespace ngbtools
 
         template <typename... Args> bool formatline(const std::string_view text, Args&&... args)
         {
-            return writeline(std::vformat(text, std::make_format_args(std::forward<Args>(args)...)));
+            // short lines fit into the writer's builtin buffer, so usually nothing is allocated
+            string::writer output;
+            if (!output.append_formatted(text, args...) || !output.newline())
+                return false;
+
+            return write(output.as_string_view());
         }
     };
 }
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <intrin.h>
+#include <immintrin.h>
+
+namespace ngbtools
+{
+    namespace cpu
+    {
+        /// <summary>
+        /// The instruction set extensions we have specialized code paths for. A feature is only reported if both
+        /// the CPU and the operating system support it (the OS must save the wider registers on context switches).
+        /// </summary>
+        struct features final
+        {
+            bool sse2;
+            bool avx2;
+            bool avx512f;
+        };
+
+        namespace detail
+        {
+            inline features detect_features()
+            {
+                features result{ false, false, false };
+
+#if defined(_M_X64) || defined(_M_IX86)
+                int info[4]{};
+                __cpuid(info, 0);
+                const int max_leaf{ info[0] };
+
+                __cpuid(info, 1);
+                result.sse2 = (info[3] & (1 << 26)) != 0;
+
+                const bool has_osxsave{ (info[2] & (1 << 27)) != 0 };
+                const bool has_avx{ (info[2] & (1 << 28)) != 0 };
+                if (!has_osxsave || !has_avx || (max_leaf < 7))
+                    return result;
+
+                // XCR0: bits 1+2 are SSE and AVX state, bits 5-7 the AVX-512 opmask and ZMM state
+                const auto xcr0{ _xgetbv(0) };
+                const bool os_saves_ymm{ (xcr0 & 0x06) == 0x06 };
+                const bool os_saves_zmm{ (xcr0 & 0xE6) == 0xE6 };
+
+                __cpuidex(info, 7, 0);
+                result.avx2 = os_saves_ymm && ((info[1] & (1 << 5)) != 0);
+                result.avx512f = os_saves_zmm && ((info[1] & (1 << 16)) != 0);
+#endif
+                return result;
+            }
+        }
+
+        /// <summary>
+        /// Features of the CPU we are running on. They are detected once, on first use.
+        /// </summary>
+        inline const features& get_features()
+        {
+            static const features result{ detail::detect_features() };
+            return result;
+        }
+    }
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include <ngbtools/string.h>
+
+namespace ngbtools
+{
+    /// <summary>
+    /// The raw bytes of a message digest of up to 256 bits, as a plain value: trivially copyable, comparable and
+    /// hashable, so it can be used directly as the key of an unordered_map. Unlike a string of hex digits, it
+    /// never allocates.
+    /// </summary>
+    class digest final
+    {
+    public:
+        static constexpr size_t MAXIMUM_SIZE = 32;
+
+        digest()
+            :
+            m_size{ 0 },
+            m_bytes{ }
+        {
+        }
+
+        digest(const unsigned char* bytes, size_t size)
+            :
+            m_size{ (uint8_t)size },
+            m_bytes{ }
+        {
+            assert(size <= MAXIMUM_SIZE);
+            memcpy(m_bytes, bytes, size);
+        }
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        bool empty() const
+        {
+            return m_size == 0;
+        }
+
+        const unsigned char* data() const
+        {
+            return m_bytes;
+        }
+
+        bool operator==(const digest& other) const
+        {
+            return (m_size == other.m_size) && !memcmp(m_bytes, other.m_bytes, m_size);
+        }
+
+        /// <summary>
+        /// The bytes of a digest are already evenly distributed, so the first 8 of them are a perfectly good hash
+        /// </summary>
+        size_t hash() const
+        {
+            uint64_t result;
+            memcpy(&result, m_bytes, sizeof(result));
+            return (size_t)result;
+        }
+
+        /// <summary>
+        /// Write the digest as 2 * size() uppercase hex digits. No terminating zero is written.
+        /// </summary>
+        void to_hex(char* result) const
+        {
+            string::to_hex(m_bytes, m_size, result);
+        }
+
+        std::string to_hex() const
+        {
+            std::string result;
+            result.resize(m_size * 2);
+            to_hex(&result[0]);
+            return result;
+        }
+
+        /// <summary>
+        /// Parse a digest written by to_hex()
+        /// </summary>
+        /// <param name="text">hex digits, upper- or lowercase</param>
+        /// <param name="result">receives the digest</param>
+        /// <returns>true if text is a valid digest, or false otherwise</returns>
+        template <typename CHAR> static bool from_hex(std::basic_string_view<CHAR> text, digest& result)
+        {
+            if (text.size() > MAXIMUM_SIZE * 2)
+                return false;
+
+            digest parsed;
+            if (!string::from_hex(text, parsed.m_bytes))
+                return false;
+
+            parsed.m_size = (uint8_t)(text.size() / 2);
+            result = parsed;
+            return true;
+        }
+
+    private:
+        uint8_t m_size;
+        unsigned char m_bytes[MAXIMUM_SIZE];
+    };
+}
+
+template <> struct std::hash<ngbtools::digest>
+{
+    size_t operator()(const ngbtools::digest& value) const noexcept
+    {
+        return value.hash();
+    }
+};
@@ -61,22 +61,24 @@ namespace ngbtools
 
         public:
 
+            /// <summary>
+            /// Expand all %VARIABLE% references in svinput. Only the characters of the view are looked at: it
+            /// need not be terminated, so it can be part of a longer string, like an element of PATH.
+            /// </summary>
             std::string expand(std::string_view svinput) const
             {
-                const char* text = svinput.data();
-
-                if (string::is_empty(text))
-                    return text;
+                if (svinput.empty())
+                    return std::string{};
 
                 auto recording_pattern{ RECORDING_PATTERN::PLAINTEXT };
                 bool isFirstCharAfterStartOfPattern = false;
                 string::writer output;
                 string::writer pattern;
-                const char* copyOfOriginalTextParameter = text;
 
-                for (; text;)
+                for (size_t index = 0; ; ++index)
                 {
-                    const char c{ *(text++) };
+                    // the end of the view counts as the end of the text, just like a terminating zero
+                    const char c{ (index < svinput.size()) ? svinput[index] : '\0' };
 
                     if (!c)
                     {
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#include <ngbtools/cpu_features.h>
+
+namespace ngbtools
+{
+    /// <summary>
+    /// A fast 128-bit non-cryptographic hash for large amounts of data. It follows the structure of XXH3: eight
+    /// 64-bit accumulators consume 64-byte stripes with a 32x32->64 bit multiply each, which maps directly onto
+    /// SSE2/AVX2 (picked at runtime), and are scrambled after every 1 KB block. It is NOT compatible with XXH3:
+    /// its secret is generated with splitmix64, and short inputs take the same path as long ones.
+    ///
+    /// usage: update() as often as needed, then finalize() once
+    /// </summary>
+    class fast_hash128 final
+    {
+    public:
+        static constexpr size_t DIGEST_SIZE = 16;
+
+        fast_hash128()
+            :
+            m_kernel{ select_kernel() }
+        {
+            reset();
+        }
+
+        void reset()
+        {
+            m_accumulators = { PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1 };
+            m_buffered = 0;
+            m_total_size = 0;
+        }
+
+        void update(const unsigned char* data, size_t size)
+        {
+            m_total_size += size;
+            if (m_buffered)
+            {
+                const auto bytes_to_copy{ std::min(size, BLOCK_SIZE - m_buffered) };
+                memcpy(m_buffer + m_buffered, data, bytes_to_copy);
+                m_buffered += bytes_to_copy;
+                data += bytes_to_copy;
+                size -= bytes_to_copy;
+                if (m_buffered < BLOCK_SIZE)
+                    return;
+
+                process_block(m_buffer);
+                m_buffered = 0;
+            }
+
+            // whole blocks are consumed straight from the input
+            for (; size >= BLOCK_SIZE; data += BLOCK_SIZE, size -= BLOCK_SIZE)
+            {
+                process_block(data);
+            }
+            if (size)
+            {
+                memcpy(m_buffer, data, size);
+                m_buffered = size;
+            }
+        }
+
+        /// <summary>
+        /// Writes the 16 byte digest, high 64 bits first, both big-endian
+        /// </summary>
+        void finalize(unsigned char result[DIGEST_SIZE])
+        {
+            // the remaining full stripes, then the last partial stripe padded with zeros. The length goes into the final mix.
+            size_t stripe = 0;
+            for (; (stripe + 1) * STRIPE_SIZE <= m_buffered; ++stripe)
+            {
+                accumulate_stripe_scalar(m_accumulators.data(), m_buffer + stripe * STRIPE_SIZE, secret().data() + stripe);
+            }
+            const auto remainder{ m_buffered - stripe * STRIPE_SIZE };
+            if (remainder)
+            {
+                unsigned char last[STRIPE_SIZE]{};
+                memcpy(last, m_buffer + stripe * STRIPE_SIZE, remainder);
+                accumulate_stripe_scalar(m_accumulators.data(), last, secret().data() + stripe);
+            }
+
+            const auto low{ merge(secret().data() + 32, m_total_size * PRIME64_1) };
+            const auto high{ merge(secret().data() + 40, ~(m_total_size * PRIME64_2)) };
+            for (int i = 0; i < 8; ++i)
+            {
+                result[i] = (unsigned char)(high >> (56 - i * 8));
+                result[8 + i] = (unsigned char)(low >> (56 - i * 8));
+            }
+        }
+
+        enum class kernel
+        {
+            SCALAR,
+            SSE2,
+            AVX2,
+        };
+
+        /// <summary>
+        /// Force a specific kernel; all kernels produce the same digests
+        /// </summary>
+        void set_kernel(kernel k)
+        {
+            m_kernel = k;
+        }
+
+    private:
+        static constexpr uint64_t PRIME32_1 = 0x9E3779B1U;
+        static constexpr uint64_t PRIME32_2 = 0x85EBCA77U;
+        static constexpr uint64_t PRIME32_3 = 0xC2B2AE3DU;
+        static constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+        static constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+        static constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+        static constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+        static constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+        static constexpr size_t STRIPE_SIZE = 64;
+        static constexpr size_t STRIPES_PER_BLOCK = 16;
+        static constexpr size_t BLOCK_SIZE = STRIPE_SIZE * STRIPES_PER_BLOCK;
+
+        // stripe n of a block uses keys n..n+7, the scrambler keys 24..31, the final merge keys 32..47
+        static constexpr size_t SECRET_SIZE = 48;
+        typedef std::array<uint64_t, SECRET_SIZE> secret_type;
+
+        static constexpr secret_type generate_secret()
+        {
+            secret_type result{};
+            uint64_t state{ 0x6E67622D68617368ULL };
+            for (auto& key : result)
+            {
+                // splitmix64
+                state += 0x9E3779B97F4A7C15ULL;
+                uint64_t z{ state };
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                key = z ^ (z >> 31);
+            }
+            return result;
+        }
+
+        static const secret_type& secret()
+        {
+            static constexpr secret_type result{ generate_secret() };
+            return result;
+        }
+
+        static kernel select_kernel()
+        {
+#if defined(_M_X64) || defined(_M_IX86)
+            const auto& features{ cpu::get_features() };
+            if (features.avx2)
+                return kernel::AVX2;
+            if (features.sse2)
+                return kernel::SSE2;
+#endif
+            return kernel::SCALAR;
+        }
+
+        static uint64_t read_le64(const unsigned char* p)
+        {
+            uint64_t result;
+            memcpy(&result, p, sizeof(result));
+            return result;
+        }
+
+        static void accumulate_stripe_scalar(uint64_t* accumulators, const unsigned char* data, const uint64_t* keys)
+        {
+            for (size_t lane = 0; lane < 8; ++lane)
+            {
+                const auto value{ read_le64(data + lane * 8) };
+                const auto keyed{ value ^ keys[lane] };
+                accumulators[lane ^ 1] += value;
+                accumulators[lane] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+            }
+        }
+
+        static void scramble_scalar(uint64_t* accumulators, const uint64_t* keys)
+        {
+            for (size_t lane = 0; lane < 8; ++lane)
+            {
+                auto accumulator{ accumulators[lane] };
+                accumulator ^= accumulator >> 47;
+                accumulator ^= keys[lane];
+                accumulators[lane] = accumulator * PRIME32_1;
+            }
+        }
+
+#if defined(_M_X64) || defined(_M_IX86)
+        static void process_block_sse2(uint64_t* accumulators, const unsigned char* data)
+        {
+            __m128i acc[4];
+            for (int i = 0; i < 4; ++i)
+                acc[i] = _mm_loadu_si128((const __m128i*) (accumulators + i * 2));
+
+            for (size_t stripe = 0; stripe < STRIPES_PER_BLOCK; ++stripe)
+            {
+                const auto keys{ secret().data() + stripe };
+                for (int i = 0; i < 4; ++i)
+                {
+                    const auto value{ _mm_loadu_si128((const __m128i*) (data + stripe * STRIPE_SIZE + i * 16)) };
+                    const auto keyed{ _mm_xor_si128(value, _mm_loadu_si128((const __m128i*) (keys + i * 2))) };
+                    const auto product{ _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1))) };
+                    const auto swapped{ _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2)) };
+                    acc[i] = _mm_add_epi64(acc[i], _mm_add_epi64(product, swapped));
+                }
+            }
+
+            const auto prime{ _mm_set1_epi32((int)PRIME32_1) };
+            const auto keys{ secret().data() + 24 };
+            for (int i = 0; i < 4; ++i)
+            {
+                auto a{ _mm_xor_si128(acc[i], _mm_srli_epi64(acc[i], 47)) };
+                a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*) (keys + i * 2)));
+                const auto low{ _mm_mul_epu32(a, prime) };
+                const auto high{ _mm_mul_epu32(_mm_srli_epi64(a, 32), prime) };
+                _mm_storeu_si128((__m128i*) (accumulators + i * 2), _mm_add_epi64(low, _mm_slli_epi64(high, 32)));
+            }
+        }
+
+        static void process_block_avx2(uint64_t* accumulators, const unsigned char* data)
+        {
+            __m256i acc[2];
+            for (int i = 0; i < 2; ++i)
+                acc[i] = _mm256_loadu_si256((const __m256i*) (accumulators + i * 4));
+
+            for (size_t stripe = 0; stripe < STRIPES_PER_BLOCK; ++stripe)
+            {
+                const auto keys{ secret().data() + stripe };
+                for (int i = 0; i < 2; ++i)
+                {
+                    const auto value{ _mm256_loadu_si256((const __m256i*) (data + stripe * STRIPE_SIZE + i * 32)) };
+                    const auto keyed{ _mm256_xor_si256(value, _mm256_loadu_si256((const __m256i*) (keys + i * 4))) };
+                    const auto product{ _mm256_mul_epu32(keyed, _mm256_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1))) };
+                    const auto swapped{ _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2)) };
+                    acc[i] = _mm256_add_epi64(acc[i], _mm256_add_epi64(product, swapped));
+                }
+            }
+
+            const auto prime{ _mm256_set1_epi32((int)PRIME32_1) };
+            const auto keys{ secret().data() + 24 };
+            for (int i = 0; i < 2; ++i)
+            {
+                auto a{ _mm256_xor_si256(acc[i], _mm256_srli_epi64(acc[i], 47)) };
+                a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*) (keys + i * 4)));
+                const auto low{ _mm256_mul_epu32(a, prime) };
+                const auto high{ _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime) };
+                _mm256_storeu_si256((__m256i*) (accumulators + i * 4), _mm256_add_epi64(low, _mm256_slli_epi64(high, 32)));
+            }
+        }
+#endif
+
+        void process_block(const unsigned char* data)
+        {
+            switch (m_kernel)
+            {
+#if defined(_M_X64) || defined(_M_IX86)
+            case kernel::AVX2:
+                process_block_avx2(m_accumulators.data(), data);
+                return;
+            case kernel::SSE2:
+                process_block_sse2(m_accumulators.data(), data);
+                return;
+#endif
+            default:
+                for (size_t stripe = 0; stripe < STRIPES_PER_BLOCK; ++stripe)
+                {
+                    accumulate_stripe_scalar(m_accumulators.data(), data + stripe * STRIPE_SIZE, secret().data() + stripe);
+                }
+                scramble_scalar(m_accumulators.data(), secret().data() + 24);
+                return;
+            }
+        }
+
+        // the full 64x64->128 bit product, folded to 64 bits. Written out by hand because 32-bit builds have no _umul128
+        static uint64_t multiply_fold64(uint64_t a, uint64_t b)
+        {
+            const uint64_t a_low{ a & 0xFFFFFFFF }, a_high{ a >> 32 };
+            const uint64_t b_low{ b & 0xFFFFFFFF }, b_high{ b >> 32 };
+            const uint64_t low_low{ a_low * b_low };
+            const uint64_t high_low{ a_high * b_low };
+            const uint64_t low_high{ a_low * b_high };
+            const uint64_t high_high{ a_high * b_high };
+            const uint64_t cross{ (low_low >> 32) + (high_low & 0xFFFFFFFF) + low_high };
+            const uint64_t upper{ (high_low >> 32) + (cross >> 32) + high_high };
+            const uint64_t lower{ (cross << 32) | (low_low & 0xFFFFFFFF) };
+            return lower ^ upper;
+        }
+
+        static uint64_t avalanche(uint64_t h)
+        {
+            h ^= h >> 37;
+            h *= 0x165667919E3779F9ULL;
+            h ^= h >> 32;
+            return h;
+        }
+
+        uint64_t merge(const uint64_t* keys, uint64_t start) const
+        {
+            uint64_t result{ start };
+            for (size_t i = 0; i < 8; i += 2)
+            {
+                result += multiply_fold64(m_accumulators[i] ^ keys[i], m_accumulators[i + 1] ^ keys[i + 1]);
+            }
+            return avalanche(result);
+        }
+
+    private:
+        kernel m_kernel;
+        std::array<uint64_t, 8> m_accumulators;
+        unsigned char m_buffer[BLOCK_SIZE];
+        size_t m_buffered;
+        uint64_t m_total_size;
+    };
+}
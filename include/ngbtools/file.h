@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <string>
 #include "Windows.h"
 
@@ -55,6 +56,54 @@ namespace ngbtools
             return false;
         }
 
+        /// <summary>
+        /// The things about a file we need to tell whether it has changed since we last looked at it
+        /// </summary>
+        struct information
+        {
+            uint64_t size;
+            uint64_t last_write_time;
+            uint64_t file_id;
+            uint32_t volume_serial_number;
+            uint32_t number_of_links;
+        };
+
+        /// <summary>
+        /// Read size, modification time and file id of a file without opening it for reading
+        /// </summary>
+        /// <param name="pathname">file to query</param>
+        /// <param name="result">receives the information</param>
+        /// <returns>true if the information could be read, or false otherwise</returns>
+        inline bool get_information(std::string_view pathname, information& result)
+        {
+            const auto wpathname{ string::encode_as_utf16(pathname) };
+            const auto hFile{ ::CreateFileW(wpathname.c_str(), FILE_READ_ATTRIBUTES,
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0) };
+            if (hFile == INVALID_HANDLE_VALUE)
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("CreateFileW({}) failed", pathname));
+                return false;
+            }
+
+            BY_HANDLE_FILE_INFORMATION info{};
+            if (!::GetFileInformationByHandle(hFile, &info))
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("GetFileInformationByHandle({}) failed", pathname));
+                ::CloseHandle(hFile);
+                return false;
+            }
+            ::CloseHandle(hFile);
+
+            result.size = (((uint64_t)info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+            result.last_write_time = (((uint64_t)info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime;
+            result.file_id = (((uint64_t)info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+            result.volume_serial_number = info.dwVolumeSerialNumber;
+            result.number_of_links = info.nNumberOfLinks;
+            return true;
+        }
+
         /// <summary>
         /// Delete this file
         /// </summary>
@@ -72,5 +121,150 @@ namespace ngbtools
             return true;
         }
 
+        /// <summary>
+        /// Create a hard link: a second name for an existing file, on the same volume
+        /// </summary>
+        /// <param name="pathname">name of the new link</param>
+        /// <param name="existing_pathname">file to link to</param>
+        /// <returns>true if the link was created, or false otherwise</returns>
+        inline bool create_hard_link(std::string_view pathname, std::string_view existing_pathname)
+        {
+            const auto wpathname{ string::encode_as_utf16(pathname) };
+            const auto wexisting_pathname{ string::encode_as_utf16(existing_pathname) };
+            if (!::CreateHardLinkW(wpathname.c_str(), wexisting_pathname.c_str(), nullptr))
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("CreateHardLinkW({}, {}) failed", pathname, existing_pathname));
+                return false;
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Check if the volume of a file can share data blocks between files (like ReFS does), see clone()
+        /// </summary>
+        /// <param name="pathname">any file on the volume</param>
+        /// <returns>true if the volume supports block cloning, or false otherwise</returns>
+        inline bool supports_block_cloning(std::string_view pathname)
+        {
+            const auto wpathname{ string::encode_as_utf16(pathname) };
+            const auto hFile{ ::CreateFileW(wpathname.c_str(), FILE_READ_ATTRIBUTES,
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0) };
+            if (hFile == INVALID_HANDLE_VALUE)
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("CreateFileW({}) failed", pathname));
+                return false;
+            }
+
+            DWORD flags = 0;
+            const auto succeeded{ ::GetVolumeInformationByHandleW(hFile, nullptr, 0, nullptr, nullptr, &flags, nullptr, 0) };
+            if (!succeeded)
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("GetVolumeInformationByHandleW({}) failed", pathname));
+            }
+            ::CloseHandle(hFile);
+            return succeeded && (flags & FILE_SUPPORTS_BLOCK_REFCOUNTING);
+        }
+
+        /// <summary>
+        /// Create a copy of a file that shares the data blocks of the original, so it takes no extra space until
+        /// one of them is modified. This is the Windows equivalent of a reflink, and only works on volumes where
+        /// supports_block_cloning() is true.
+        /// </summary>
+        /// <param name="source_pathname">file to clone</param>
+        /// <param name="pathname">name of the clone, which must not exist yet</param>
+        /// <returns>true if the clone was created, or false otherwise</returns>
+        inline bool clone(std::string_view source_pathname, std::string_view pathname)
+        {
+            const auto wsource_pathname{ string::encode_as_utf16(source_pathname) };
+            const auto hSource{ ::CreateFileW(wsource_pathname.c_str(), GENERIC_READ,
+                FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, 0) };
+            if (hSource == INVALID_HANDLE_VALUE)
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("CreateFileW({}) failed", source_pathname));
+                return false;
+            }
+
+            const auto wpathname{ string::encode_as_utf16(pathname) };
+            const auto hFile{ ::CreateFileW(wpathname.c_str(), GENERIC_READ | GENERIC_WRITE | DELETE,
+                0, nullptr, CREATE_NEW, 0, 0) };
+            if (hFile == INVALID_HANDLE_VALUE)
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("CreateFileW({}) failed", pathname));
+                ::CloseHandle(hSource);
+                return false;
+            }
+
+            // the clone must have the same size, sparseness and integrity settings as the source,
+            // and blocks can only be shared in whole clusters
+            LARGE_INTEGER size{};
+            FILE_BASIC_INFO basic_info{};
+            FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity{};
+            DWORD bytes_returned = 0;
+            bool succeeded = ::GetFileSizeEx(hSource, &size) &&
+                ::GetFileInformationByHandleEx(hSource, FileBasicInfo, &basic_info, sizeof(basic_info)) &&
+                ::DeviceIoControl(hSource, FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0, &integrity, sizeof(integrity), &bytes_returned, nullptr);
+            if (succeeded && (basic_info.FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE))
+            {
+                succeeded = ::DeviceIoControl(hFile, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytes_returned, nullptr);
+            }
+            if (succeeded)
+            {
+                FSCTL_SET_INTEGRITY_INFORMATION_BUFFER set_integrity{ integrity.ChecksumAlgorithm, integrity.Reserved, integrity.Flags };
+                FILE_END_OF_FILE_INFO end_of_file{ size };
+                succeeded = ::DeviceIoControl(hFile, FSCTL_SET_INTEGRITY_INFORMATION, &set_integrity, sizeof(set_integrity), nullptr, 0, &bytes_returned, nullptr) &&
+                    ::SetFileInformationByHandle(hFile, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file));
+            }
+
+            // a single request must stay below 4 GB
+            const uint64_t cluster_size{ integrity.ClusterSizeInBytes ? integrity.ClusterSizeInBytes : 4096 };
+            const uint64_t total_size{ ((uint64_t)size.QuadPart + cluster_size - 1) & ~(cluster_size - 1) };
+            for (uint64_t offset = 0; succeeded && (offset < total_size); )
+            {
+                DUPLICATE_EXTENTS_DATA extents{};
+                extents.FileHandle = hSource;
+                extents.SourceFileOffset.QuadPart = (LONGLONG)offset;
+                extents.TargetFileOffset.QuadPart = (LONGLONG)offset;
+                extents.ByteCount.QuadPart = (LONGLONG)std::min<uint64_t>(total_size - offset, 1024 * 1024 * 1024);
+                succeeded = ::DeviceIoControl(hFile, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents), nullptr, 0, &bytes_returned, nullptr);
+                offset += (uint64_t)extents.ByteCount.QuadPart;
+            }
+            if (!succeeded)
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("Unable to clone {} as {}", source_pathname, pathname));
+
+                // don't leave a half-made clone behind
+                FILE_DISPOSITION_INFO disposition{ TRUE };
+                ::SetFileInformationByHandle(hFile, FileDispositionInfo, &disposition, sizeof(disposition));
+            }
+            ::CloseHandle(hFile);
+            ::CloseHandle(hSource);
+            return succeeded;
+        }
+
+        /// <summary>
+        /// Rename a file, replacing any existing file of that name in a single step: at any time, pathname is
+        /// either the old file or the new one.
+        /// </summary>
+        /// <param name="source_pathname">file to rename</param>
+        /// <param name="pathname">new name</param>
+        /// <returns>true if the file was renamed, or false otherwise</returns>
+        inline bool replace(std::string_view source_pathname, std::string_view pathname)
+        {
+            const auto wsource_pathname{ string::encode_as_utf16(source_pathname) };
+            const auto wpathname{ string::encode_as_utf16(pathname) };
+            if (!::MoveFileExW(wsource_pathname.c_str(), wpathname.c_str(), MOVEFILE_REPLACE_EXISTING))
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("MoveFileExW({}, {}) failed", source_pathname, pathname));
+                return false;
+            }
+            return true;
+        }
     }
 }
\ No newline at end of file
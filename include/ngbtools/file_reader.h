@@ -0,0 +1,539 @@
+#pragma once
+
+#include <cassert>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include "Windows.h"
+
+#include <ngbtools/string.h>
+#include <ngbtools/logging.h>
+#include <ngbtools/windows_errors.h>
+
+namespace ngbtools
+{
+    /// <summary>
+    /// The different strategies for reading a file from start to end
+    /// </summary>
+    enum class read_method
+    {
+        /// <summary>ReadFile() into a buffer, going through the system file cache</summary>
+        BUFFERED,
+
+        /// <summary>map the file into memory in large views: no copy into a user-space buffer</summary>
+        MAPPED,
+
+        /// <summary>FILE_FLAG_NO_BUFFERING reads into aligned buffers: doesn't pollute the system file cache</summary>
+        UNBUFFERED,
+
+        /// <summary>like UNBUFFERED, but with several overlapped reads in flight while the caller consumes data</summary>
+        OVERLAPPED,
+    };
+
+    /// <summary>
+    /// Reads files sequentially and hands the content to a callback, one chunk at a time. Objects of
+    /// this class are not thread-safe, but they are meant to be reused for many files: use one per thread.
+    /// </summary>
+    class file_reader
+    {
+    public:
+        typedef std::function<void(const unsigned char* data, size_t size)> consumer;
+
+        virtual ~file_reader() = default;
+
+        /// <summary>
+        /// How long the last call to read() took to open the file. Opening a file on a network share can take
+        /// longer than reading it, so this is worth knowing.
+        /// </summary>
+        std::chrono::steady_clock::duration last_open_duration() const
+        {
+            return m_last_open_duration;
+        }
+
+        /// <summary>
+        /// Read a whole file. The file must still have the size it had when it was listed: if it has changed
+        /// since, it is not read at all, because a checksum of part of it would make it look like a different file.
+        /// </summary>
+        /// <param name="pathname">file to read</param>
+        /// <param name="size">size of the file when it was listed</param>
+        /// <param name="consume">called for every chunk of data, in order</param>
+        /// <returns>true if all bytes were read, or false otherwise</returns>
+        virtual bool read(std::string_view pathname, uint64_t size, const consumer& consume) = 0;
+
+        static std::unique_ptr<file_reader> create(read_method method, size_t buffer_size);
+
+        /// <summary>
+        /// Check that an open file still has the size it had when it was listed. Directory listings - and a
+        /// scan_manifest even more so - can be older than the file: appending to a file doesn't change its directory.
+        /// </summary>
+        /// <returns>true if the size is unchanged, or false otherwise (which has been reported)</returns>
+        static bool has_expected_size(HANDLE hFile, std::string_view pathname, uint64_t size)
+        {
+            LARGE_INTEGER actual_size{};
+            if (!::GetFileSizeEx(hFile, &actual_size))
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("GetFileSizeEx({}) failed", pathname));
+                return false;
+            }
+            if ((uint64_t)actual_size.QuadPart != size)
+            {
+                logging::report_windows_error(ERROR_FILE_INVALID, FUNCTION_CONTEXT,
+                    fmt::format("{} has changed since it was listed: it has {} bytes instead of {}", pathname, (uint64_t)actual_size.QuadPart, size));
+                return false;
+            }
+            return true;
+        }
+
+        static const char* name(read_method method)
+        {
+            switch (method)
+            {
+            case read_method::MAPPED:
+                return "MAPPED";
+            case read_method::UNBUFFERED:
+                return "UNBUFFERED";
+            case read_method::OVERLAPPED:
+                return "OVERLAPPED";
+            default:
+                return "BUFFERED";
+            }
+        }
+
+        static bool parse_method(std::string_view name, read_method& result)
+        {
+            for (const auto method : { read_method::BUFFERED, read_method::MAPPED, read_method::UNBUFFERED, read_method::OVERLAPPED })
+            {
+                if (string::equals_nocase(name, file_reader::name(method)))
+                {
+                    result = method;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    protected:
+        file_reader()
+            :
+            m_last_open_duration{ std::chrono::steady_clock::duration::zero() }
+        {
+        }
+
+        HANDLE open_for_reading(std::string_view pathname, uint64_t size, DWORD flags)
+        {
+            const auto start{ std::chrono::steady_clock::now() };
+            const auto wpathname{ string::encode_as_utf16(pathname) };
+            HANDLE hFile = ::CreateFileW(wpathname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, flags, 0);
+            m_last_open_duration = std::chrono::steady_clock::now() - start;
+            if (hFile == INVALID_HANDLE_VALUE)
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("CreateFileW({}) failed", pathname));
+                return hFile;
+            }
+            if (!has_expected_size(hFile, pathname, size))
+            {
+                ::CloseHandle(hFile);
+                return INVALID_HANDLE_VALUE;
+            }
+            return hFile;
+        }
+
+        static bool report_unexpected_end_of_file(std::string_view pathname)
+        {
+            logging::report_windows_error(ERROR_HANDLE_EOF, FUNCTION_CONTEXT,
+                fmt::format("{} is shorter than expected", pathname));
+            return false;
+        }
+
+    private:
+        std::chrono::steady_clock::duration m_last_open_duration;
+    };
+
+    /// <summary>
+    /// Plain ReadFile() calls into a reusable buffer. FILE_FLAG_SEQUENTIAL_SCAN tells the cache manager to read ahead aggressively.
+    /// </summary>
+    class buffered_file_reader final : public file_reader
+    {
+    public:
+        explicit buffered_file_reader(size_t buffer_size)
+        {
+            m_buffer.resize(buffer_size);
+        }
+
+        bool read(std::string_view pathname, uint64_t size, const consumer& consume) override
+        {
+            HANDLE hFile = open_for_reading(pathname, size, FILE_FLAG_SEQUENTIAL_SCAN);
+            if (hFile == INVALID_HANDLE_VALUE)
+                return false;
+
+            while (size)
+            {
+                DWORD bytes_to_read = (DWORD)std::min<uint64_t>(size, m_buffer.size());
+                DWORD bytes_read = 0;
+                if (!::ReadFile(hFile, &m_buffer[0], bytes_to_read, &bytes_read, nullptr))
+                {
+                    logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                        fmt::format("ReadFile({}) failed", pathname));
+                    ::CloseHandle(hFile);
+                    return false;
+                }
+                if (!bytes_read)
+                {
+                    ::CloseHandle(hFile);
+                    return report_unexpected_end_of_file(pathname);
+                }
+                consume((const unsigned char*)&m_buffer[0], bytes_read);
+                size -= bytes_read;
+            }
+            ::CloseHandle(hFile);
+            return true;
+        }
+
+    private:
+        std::vector<char> m_buffer;
+    };
+
+    /// <summary>
+    /// Maps the file in views of (at most) the buffer size, so that even huge files fit into a 32-bit address space.
+    /// Each view is prefetched as a whole, which is what madvise(MADV_SEQUENTIAL|MADV_WILLNEED) would do on other systems.
+    /// </summary>
+    class mapped_file_reader final : public file_reader
+    {
+    public:
+        explicit mapped_file_reader(size_t view_size)
+        {
+            SYSTEM_INFO si{};
+            ::GetSystemInfo(&si);
+
+            // views must start at a multiple of the allocation granularity
+            const size_t granularity{ si.dwAllocationGranularity ? si.dwAllocationGranularity : 64 * 1024 };
+            m_view_size = std::max<size_t>(granularity, view_size - (view_size % granularity));
+        }
+
+        bool read(std::string_view pathname, uint64_t size, const consumer& consume) override
+        {
+            if (!size)
+                return true;
+
+            HANDLE hFile = open_for_reading(pathname, size, FILE_FLAG_SEQUENTIAL_SCAN);
+            if (hFile == INVALID_HANDLE_VALUE)
+                return false;
+
+            HANDLE hMapping = ::CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!hMapping)
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("CreateFileMappingW({}) failed", pathname));
+                ::CloseHandle(hFile);
+                return false;
+            }
+
+            bool succeeded = true;
+            for (uint64_t offset = 0; offset < size; offset += m_view_size)
+            {
+                const size_t bytes_in_view{ (size_t)std::min<uint64_t>(size - offset, m_view_size) };
+                const auto view{ (const unsigned char*) ::MapViewOfFile(hMapping, FILE_MAP_READ,
+                    (DWORD)(offset >> 32), (DWORD)(offset & 0xFFFFFFFF), bytes_in_view) };
+                if (!view)
+                {
+                    logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                        fmt::format("MapViewOfFile({}) failed", pathname));
+                    succeeded = false;
+                    break;
+                }
+
+                WIN32_MEMORY_RANGE_ENTRY range{ (PVOID)view, bytes_in_view };
+                ::PrefetchVirtualMemory(::GetCurrentProcess(), 1, &range, 0);
+
+                succeeded = consume_view(consume, view, bytes_in_view);
+                ::UnmapViewOfFile(view);
+                if (!succeeded)
+                {
+                    logging::report_windows_error(ERROR_READ_FAULT, FUNCTION_CONTEXT,
+                        fmt::format("Unable to read mapped view of {}", pathname));
+                    break;
+                }
+            }
+            ::CloseHandle(hMapping);
+            ::CloseHandle(hFile);
+            return succeeded;
+        }
+
+    private:
+        // an I/O error on a mapped file is raised as an SEH exception, not reported as an error code.
+        // This function must not have any objects with destructors, otherwise we cannot use __try here.
+        static bool consume_view(const consumer& consume, const unsigned char* view, size_t size)
+        {
+            __try
+            {
+                consume(view, size);
+            }
+            __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+            {
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        size_t m_view_size;
+    };
+
+    /// <summary>
+    /// Reads with FILE_FLAG_NO_BUFFERING, bypassing the system file cache. Buffer address and read sizes must be
+    /// multiples of the sector size, so the buffer comes from VirtualAlloc (page-aligned) and has a size that is a
+    /// multiple of 64k. The final read may return fewer bytes than requested, which is fine.
+    /// </summary>
+    class unbuffered_file_reader final : public file_reader
+    {
+    public:
+        explicit unbuffered_file_reader(size_t buffer_size)
+            :
+            m_buffer_size{ std::max<size_t>(ALIGNMENT, buffer_size - (buffer_size % ALIGNMENT)) }
+        {
+            m_buffer = (unsigned char*) ::VirtualAlloc(nullptr, m_buffer_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        }
+
+        ~unbuffered_file_reader()
+        {
+            if (m_buffer)
+            {
+                ::VirtualFree(m_buffer, 0, MEM_RELEASE);
+            }
+        }
+
+        bool read(std::string_view pathname, uint64_t size, const consumer& consume) override
+        {
+            if (!m_buffer)
+            {
+                logging::report_windows_error(ERROR_NOT_ENOUGH_MEMORY, FUNCTION_CONTEXT,
+                    fmt::format("VirtualAlloc({}) failed", m_buffer_size));
+                return false;
+            }
+
+            HANDLE hFile = open_for_reading(pathname, size, FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN);
+            if (hFile == INVALID_HANDLE_VALUE)
+                return false;
+
+            while (size)
+            {
+                DWORD bytes_read = 0;
+                if (!::ReadFile(hFile, m_buffer, (DWORD)m_buffer_size, &bytes_read, nullptr))
+                {
+                    logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                        fmt::format("ReadFile({}) failed", pathname));
+                    ::CloseHandle(hFile);
+                    return false;
+                }
+                if (!bytes_read)
+                {
+                    ::CloseHandle(hFile);
+                    return report_unexpected_end_of_file(pathname);
+                }
+                const auto bytes_to_consume{ (size_t)std::min<uint64_t>(size, bytes_read) };
+                consume(m_buffer, bytes_to_consume);
+                size -= bytes_to_consume;
+            }
+            ::CloseHandle(hFile);
+            return true;
+        }
+
+    private:
+        unbuffered_file_reader(const unbuffered_file_reader&) = delete;
+        unbuffered_file_reader& operator=(const unbuffered_file_reader&) = delete;
+        unbuffered_file_reader(unbuffered_file_reader&&) = delete;
+        unbuffered_file_reader& operator=(unbuffered_file_reader&&) = delete;
+
+        static constexpr size_t ALIGNMENT = 64 * 1024;
+
+        const size_t m_buffer_size;
+        unsigned char* m_buffer;
+    };
+
+    /// <summary>
+    /// Splits the buffer into several aligned slots and keeps an overlapped read pending on each of them. While the
+    /// caller consumes slot k, the disk is already filling slots k+1 and onwards, so neither the disk nor the CPU
+    /// has to wait for the other on large files.
+    /// </summary>
+    class overlapped_file_reader final : public file_reader
+    {
+    public:
+        explicit overlapped_file_reader(size_t buffer_size)
+            :
+            m_slot_size{ std::max<size_t>(ALIGNMENT, (buffer_size / NUMBER_OF_SLOTS) - ((buffer_size / NUMBER_OF_SLOTS) % ALIGNMENT)) },
+            m_buffer{ nullptr },
+            m_slots{ }
+        {
+            m_buffer = (unsigned char*) ::VirtualAlloc(nullptr, m_slot_size * NUMBER_OF_SLOTS, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+            for (size_t index = 0; index < NUMBER_OF_SLOTS; ++index)
+            {
+                m_slots[index].buffer = m_buffer ? m_buffer + (index * m_slot_size) : nullptr;
+                m_slots[index].overlapped.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+            }
+        }
+
+        ~overlapped_file_reader()
+        {
+            for (auto& slot : m_slots)
+            {
+                if (slot.overlapped.hEvent)
+                {
+                    ::CloseHandle(slot.overlapped.hEvent);
+                }
+            }
+            if (m_buffer)
+            {
+                ::VirtualFree(m_buffer, 0, MEM_RELEASE);
+            }
+        }
+
+        bool read(std::string_view pathname, uint64_t size, const consumer& consume) override
+        {
+            if (!m_buffer)
+            {
+                logging::report_windows_error(ERROR_NOT_ENOUGH_MEMORY, FUNCTION_CONTEXT,
+                    fmt::format("VirtualAlloc({}) failed", m_slot_size * NUMBER_OF_SLOTS));
+                return false;
+            }
+            for (const auto& slot : m_slots)
+            {
+                if (!slot.overlapped.hEvent)
+                {
+                    logging::report_windows_error(ERROR_NOT_ENOUGH_MEMORY, FUNCTION_CONTEXT, "CreateEventW() failed");
+                    return false;
+                }
+            }
+
+            HANDLE hFile = open_for_reading(pathname, size, FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN);
+            if (hFile == INVALID_HANDLE_VALUE)
+                return false;
+
+            const uint64_t end_offset{ size };
+            uint64_t next_offset = 0;
+            bool succeeded = true;
+            for (auto& slot : m_slots)
+            {
+                if (!start_read(hFile, pathname, slot, end_offset, next_offset))
+                {
+                    succeeded = false;
+                    break;
+                }
+            }
+
+            // slots complete in the order they were started, so consuming them round-robin keeps the data in order
+            for (size_t index = 0; succeeded && size; index = (index + 1) % NUMBER_OF_SLOTS)
+            {
+                auto& slot{ m_slots[index] };
+                assert(slot.is_pending);
+
+                DWORD bytes_read = 0;
+                slot.is_pending = false;
+                if (!::GetOverlappedResult(hFile, &slot.overlapped, &bytes_read, TRUE))
+                {
+                    const auto error{ GetLastError() };
+                    if (error == ERROR_HANDLE_EOF)
+                    {
+                        succeeded = report_unexpected_end_of_file(pathname);
+                    }
+                    else
+                    {
+                        logging::report_windows_error(error, FUNCTION_CONTEXT,
+                            fmt::format("ReadFile({}) failed", pathname));
+                        succeeded = false;
+                    }
+                    break;
+                }
+                if (!bytes_read)
+                {
+                    succeeded = report_unexpected_end_of_file(pathname);
+                    break;
+                }
+                const auto bytes_to_consume{ (size_t)std::min<uint64_t>(size, bytes_read) };
+                consume(slot.buffer, bytes_to_consume);
+                size -= bytes_to_consume;
+
+                succeeded = start_read(hFile, pathname, slot, end_offset, next_offset);
+            }
+
+            // the buffers must not be reused while the kernel may still write into them
+            if (!succeeded)
+            {
+                ::CancelIoEx(hFile, nullptr);
+            }
+            for (auto& slot : m_slots)
+            {
+                if (slot.is_pending)
+                {
+                    DWORD bytes_read = 0;
+                    ::GetOverlappedResult(hFile, &slot.overlapped, &bytes_read, TRUE);
+                    slot.is_pending = false;
+                }
+            }
+            ::CloseHandle(hFile);
+            return succeeded;
+        }
+
+    private:
+        overlapped_file_reader(const overlapped_file_reader&) = delete;
+        overlapped_file_reader& operator=(const overlapped_file_reader&) = delete;
+        overlapped_file_reader(overlapped_file_reader&&) = delete;
+        overlapped_file_reader& operator=(overlapped_file_reader&&) = delete;
+
+        struct slot
+        {
+            OVERLAPPED overlapped;
+            unsigned char* buffer;
+            bool is_pending;
+        };
+
+        bool start_read(HANDLE hFile, std::string_view pathname, slot& s, uint64_t end_offset, uint64_t& next_offset)
+        {
+            if (next_offset >= end_offset)
+                return true;
+
+            s.overlapped.Offset = (DWORD)(next_offset & 0xFFFFFFFF);
+            s.overlapped.OffsetHigh = (DWORD)(next_offset >> 32);
+            if (!::ReadFile(hFile, s.buffer, (DWORD)m_slot_size, nullptr, &s.overlapped))
+            {
+                const auto error{ GetLastError() };
+                if (error == ERROR_HANDLE_EOF)
+                    return report_unexpected_end_of_file(pathname);
+
+                if (error != ERROR_IO_PENDING)
+                {
+                    logging::report_windows_error(error, FUNCTION_CONTEXT,
+                        fmt::format("ReadFile({}) failed", pathname));
+                    return false;
+                }
+            }
+            s.is_pending = true;
+            next_offset += m_slot_size;
+            return true;
+        }
+
+        static constexpr size_t NUMBER_OF_SLOTS = 4;
+        static constexpr size_t ALIGNMENT = 64 * 1024;
+
+        const size_t m_slot_size;
+        unsigned char* m_buffer;
+        slot m_slots[NUMBER_OF_SLOTS];
+    };
+
+    inline std::unique_ptr<file_reader> file_reader::create(read_method method, size_t buffer_size)
+    {
+        switch (method)
+        {
+        case read_method::MAPPED:
+            return std::make_unique<mapped_file_reader>(buffer_size);
+        case read_method::UNBUFFERED:
+            return std::make_unique<unbuffered_file_reader>(buffer_size);
+        case read_method::OVERLAPPED:
+            return std::make_unique<overlapped_file_reader>(buffer_size);
+        default:
+            return std::make_unique<buffered_file_reader>(buffer_size);
+        }
+    }
+}
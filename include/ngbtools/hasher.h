@@ -0,0 +1,211 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <ngbtools/string.h>
+#include <ngbtools/digest.h>
+#include <ngbtools/md5hash.h>
+#include <ngbtools/fast_hash128.h>
+#include <ngbtools/blake3.h>
+
+namespace ngbtools
+{
+    /// <summary>
+    /// The digest algorithms a hasher can use. The values are stored in files, so don't change them.
+    /// </summary>
+    enum class hash_algorithm : uint16_t
+    {
+        /// <summary>what ddupe always used: not fast, but compatible with every other MD5 out there</summary>
+        MD5 = 1,
+
+        /// <summary>fast 128-bit non-cryptographic hash, see fast_hash128.h</summary>
+        FAST128 = 2,
+
+        /// <summary>256-bit cryptographic hash, for when a deliberately crafted collision is a concern</summary>
+        BLAKE3 = 3,
+    };
+
+    /// <summary>
+    /// Common interface of all digest algorithms: feed data with update(), then call finalize() once.
+    /// A hasher can be reused for another message after calling reset().
+    /// </summary>
+    class hasher
+    {
+    public:
+        static constexpr size_t MAXIMUM_DIGEST_SIZE = digest::MAXIMUM_SIZE;
+
+        virtual ~hasher() = default;
+
+        virtual hash_algorithm algorithm() const = 0;
+        virtual void reset() = 0;
+        virtual void update(const unsigned char* data, size_t size) = 0;
+
+        /// <summary>
+        /// Write the raw digest
+        /// </summary>
+        /// <param name="result">receives digest_size(algorithm()) bytes</param>
+        virtual void finalize(unsigned char* result) = 0;
+
+        /// <summary>
+        /// Finalize and return the digest as a value
+        /// </summary>
+        ngbtools::digest finalize_as_digest()
+        {
+            unsigned char result[MAXIMUM_DIGEST_SIZE];
+            finalize(result);
+            return ngbtools::digest{ result, digest_size(algorithm()) };
+        }
+
+        /// <summary>
+        /// Finalize and return the digest as a string of uppercase hex digits
+        /// </summary>
+        std::string finalize_as_string()
+        {
+            return finalize_as_digest().to_hex();
+        }
+
+        static std::unique_ptr<hasher> create(hash_algorithm algorithm);
+
+        static size_t digest_size(hash_algorithm algorithm)
+        {
+            switch (algorithm)
+            {
+            case hash_algorithm::BLAKE3:
+                return blake3::DIGEST_SIZE;
+            case hash_algorithm::FAST128:
+                return fast_hash128::DIGEST_SIZE;
+            default:
+                return 16;
+            }
+        }
+
+        static const char* name(hash_algorithm algorithm)
+        {
+            switch (algorithm)
+            {
+            case hash_algorithm::BLAKE3:
+                return "BLAKE3";
+            case hash_algorithm::FAST128:
+                return "FAST128";
+            default:
+                return "MD5";
+            }
+        }
+
+        static bool parse_algorithm(std::string_view name, hash_algorithm& result)
+        {
+            for (const auto algorithm : { hash_algorithm::MD5, hash_algorithm::FAST128, hash_algorithm::BLAKE3 })
+            {
+                if (string::equals_nocase(name, hasher::name(algorithm)))
+                {
+                    result = algorithm;
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    class md5_hasher final : public hasher
+    {
+    public:
+        hash_algorithm algorithm() const override
+        {
+            return hash_algorithm::MD5;
+        }
+
+        void reset() override
+        {
+            m_md5 = MD5{};
+        }
+
+        void update(const unsigned char* data, size_t size) override
+        {
+            // class MD5 only takes 32-bit sizes
+            while (size)
+            {
+                const auto chunk_size{ (MD5::size_type)std::min<size_t>(size, 1024 * 1024 * 1024) };
+                m_md5.update(data, chunk_size);
+                data += chunk_size;
+                size -= chunk_size;
+            }
+        }
+
+        void finalize(unsigned char* result) override
+        {
+            m_md5.finalize();
+            memcpy(result, m_md5.rawdigest().data(), 16);
+        }
+
+    private:
+        MD5 m_md5;
+    };
+
+    class fast_hash128_hasher final : public hasher
+    {
+    public:
+        hash_algorithm algorithm() const override
+        {
+            return hash_algorithm::FAST128;
+        }
+
+        void reset() override
+        {
+            m_hash.reset();
+        }
+
+        void update(const unsigned char* data, size_t size) override
+        {
+            m_hash.update(data, size);
+        }
+
+        void finalize(unsigned char* result) override
+        {
+            m_hash.finalize(result);
+        }
+
+    private:
+        fast_hash128 m_hash;
+    };
+
+    class blake3_hasher final : public hasher
+    {
+    public:
+        hash_algorithm algorithm() const override
+        {
+            return hash_algorithm::BLAKE3;
+        }
+
+        void reset() override
+        {
+            m_hash.reset();
+        }
+
+        void update(const unsigned char* data, size_t size) override
+        {
+            m_hash.update(data, size);
+        }
+
+        void finalize(unsigned char* result) override
+        {
+            m_hash.finalize(result);
+        }
+
+    private:
+        blake3 m_hash;
+    };
+
+    inline std::unique_ptr<hasher> hasher::create(hash_algorithm algorithm)
+    {
+        switch (algorithm)
+        {
+        case hash_algorithm::BLAKE3:
+            return std::make_unique<blake3_hasher>();
+        case hash_algorithm::FAST128:
+            return std::make_unique<fast_hash128_hasher>();
+        default:
+            return std::make_unique<md5_hasher>();
+        }
+    }
+}
@@ -0,0 +1,527 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+#include <ngbtools/cpu_features.h>
+
+namespace ngbtools
+{
+    /// <summary>
+    /// Calculates the MD5 of many independent messages at once: each SIMD lane runs its own MD5 on a different
+    /// message, in lock-step with the others. MD5 itself is a long chain of dependent operations, so this is the
+    /// only way to make it use the full width of the vector units. The kernel (4 lanes with SSE2, 8 with AVX2 or
+    /// 16 with AVX-512) is picked at runtime. The digests are bit-identical to the ones calculated by class MD5.
+    /// </summary>
+    class md5_multibuffer final
+    {
+    public:
+        typedef std::array<unsigned char, 16> digest;
+
+        enum class kernel
+        {
+            SCALAR,
+            SSE2,
+            AVX2,
+            AVX512,
+        };
+
+        md5_multibuffer()
+            :
+            m_kernel{ best_kernel() }
+        {
+        }
+
+        explicit md5_multibuffer(kernel k)
+            :
+            m_kernel{ k }
+        {
+        }
+
+        ~md5_multibuffer() = default;
+
+        /// <summary>
+        /// The widest kernel this machine supports
+        /// </summary>
+        static kernel best_kernel()
+        {
+#if defined(_M_X64) || defined(_M_IX86)
+            const auto& features{ cpu::get_features() };
+            if (features.avx512f)
+                return kernel::AVX512;
+            if (features.avx2)
+                return kernel::AVX2;
+            if (features.sse2)
+                return kernel::SSE2;
+#endif
+            return kernel::SCALAR;
+        }
+
+        kernel get_kernel() const
+        {
+            return m_kernel;
+        }
+
+        /// <summary>
+        /// Number of messages hashed in parallel. Callers should pass at least this many messages to hash()
+        /// </summary>
+        size_t lanes() const
+        {
+            switch (m_kernel)
+            {
+            case kernel::AVX512:
+                return 16;
+            case kernel::AVX2:
+                return 8;
+            case kernel::SSE2:
+                return 4;
+            default:
+                return 1;
+            }
+        }
+
+        /// <summary>
+        /// Calculate the MD5 digests of count complete messages. Messages may have different sizes:
+        /// whenever a lane finishes its message, it picks up the next one.
+        /// </summary>
+        void hash(const unsigned char* const messages[], const uint64_t sizes[], size_t count, digest results[]) const
+        {
+            switch (m_kernel)
+            {
+#if defined(_M_X64) || defined(_M_IX86)
+            case kernel::AVX512:
+                hash_messages<avx512_lanes>(messages, sizes, count, results);
+                break;
+            case kernel::AVX2:
+                hash_messages<avx2_lanes>(messages, sizes, count, results);
+                break;
+            case kernel::SSE2:
+                hash_messages<sse2_lanes>(messages, sizes, count, results);
+                break;
+#endif
+            default:
+                hash_messages<scalar_lanes>(messages, sizes, count, results);
+                break;
+            }
+        }
+
+    private:
+        md5_multibuffer(const md5_multibuffer&) = delete;
+        md5_multibuffer& operator=(const md5_multibuffer&) = delete;
+        md5_multibuffer(md5_multibuffer&&) = delete;
+        md5_multibuffer& operator=(md5_multibuffer&&) = delete;
+
+        static uint32_t read_le32(const unsigned char* p)
+        {
+            return ((uint32_t)p[0]) | (((uint32_t)p[1]) << 8) | (((uint32_t)p[2]) << 16) | (((uint32_t)p[3]) << 24);
+        }
+
+        // the vector operations each kernel needs. The round structure is shared, see md5_rounds below.
+        struct scalar_lanes
+        {
+            typedef uint32_t vector;
+            static constexpr size_t LANES = 1;
+
+            static vector load(const uint32_t* p) { return *p; }
+            static void store(uint32_t* p, vector v) { *p = v; }
+            static vector set1(uint32_t v) { return v; }
+            static vector add(vector a, vector b) { return a + b; }
+            static vector F(vector x, vector y, vector z) { return z ^ (x & (y ^ z)); }
+            static vector G(vector x, vector y, vector z) { return (x & z) | (y & ~z); }
+            static vector H(vector x, vector y, vector z) { return x ^ y ^ z; }
+            static vector I(vector x, vector y, vector z) { return y ^ (x | ~z); }
+            template<int S> static vector rotl(vector x) { return (x << S) | (x >> (32 - S)); }
+
+            static void load_block(const unsigned char* const data[], vector x[16])
+            {
+                for (int i = 0; i < 16; ++i)
+                    x[i] = read_le32(data[0] + i * 4);
+            }
+        };
+
+#if defined(_M_X64) || defined(_M_IX86)
+        struct sse2_lanes
+        {
+            typedef __m128i vector;
+            static constexpr size_t LANES = 4;
+
+            static vector load(const uint32_t* p) { return _mm_load_si128((const __m128i*) p); }
+            static void store(uint32_t* p, vector v) { _mm_store_si128((__m128i*) p, v); }
+            static vector set1(uint32_t v) { return _mm_set1_epi32((int)v); }
+            static vector add(vector a, vector b) { return _mm_add_epi32(a, b); }
+            static vector F(vector x, vector y, vector z) { return _mm_xor_si128(z, _mm_and_si128(x, _mm_xor_si128(y, z))); }
+            static vector G(vector x, vector y, vector z) { return _mm_or_si128(_mm_and_si128(x, z), _mm_andnot_si128(z, y)); }
+            static vector H(vector x, vector y, vector z) { return _mm_xor_si128(_mm_xor_si128(x, y), z); }
+            static vector I(vector x, vector y, vector z) { return _mm_xor_si128(y, _mm_or_si128(x, _mm_xor_si128(z, _mm_set1_epi32(-1)))); }
+            template<int S> static vector rotl(vector x) { return _mm_or_si128(_mm_slli_epi32(x, S), _mm_srli_epi32(x, 32 - S)); }
+
+            // 4 words from each of the 4 lanes, transposed so that vector i holds word i of every lane
+            static void transpose(const unsigned char* const data[], int offset, vector* x)
+            {
+                const auto r0{ _mm_loadu_si128((const __m128i*) (data[0] + offset)) };
+                const auto r1{ _mm_loadu_si128((const __m128i*) (data[1] + offset)) };
+                const auto r2{ _mm_loadu_si128((const __m128i*) (data[2] + offset)) };
+                const auto r3{ _mm_loadu_si128((const __m128i*) (data[3] + offset)) };
+                const auto t0{ _mm_unpacklo_epi32(r0, r1) };
+                const auto t1{ _mm_unpacklo_epi32(r2, r3) };
+                const auto t2{ _mm_unpackhi_epi32(r0, r1) };
+                const auto t3{ _mm_unpackhi_epi32(r2, r3) };
+                x[0] = _mm_unpacklo_epi64(t0, t1);
+                x[1] = _mm_unpackhi_epi64(t0, t1);
+                x[2] = _mm_unpacklo_epi64(t2, t3);
+                x[3] = _mm_unpackhi_epi64(t2, t3);
+            }
+
+            static void load_block(const unsigned char* const data[], vector x[16])
+            {
+                for (int i = 0; i < 16; i += 4)
+                    transpose(data, i * 4, &x[i]);
+            }
+        };
+
+        struct avx2_lanes
+        {
+            typedef __m256i vector;
+            static constexpr size_t LANES = 8;
+
+            static vector load(const uint32_t* p) { return _mm256_load_si256((const __m256i*) p); }
+            static void store(uint32_t* p, vector v) { _mm256_store_si256((__m256i*) p, v); }
+            static vector set1(uint32_t v) { return _mm256_set1_epi32((int)v); }
+            static vector add(vector a, vector b) { return _mm256_add_epi32(a, b); }
+            static vector F(vector x, vector y, vector z) { return _mm256_xor_si256(z, _mm256_and_si256(x, _mm256_xor_si256(y, z))); }
+            static vector G(vector x, vector y, vector z) { return _mm256_or_si256(_mm256_and_si256(x, z), _mm256_andnot_si256(z, y)); }
+            static vector H(vector x, vector y, vector z) { return _mm256_xor_si256(_mm256_xor_si256(x, y), z); }
+            static vector I(vector x, vector y, vector z) { return _mm256_xor_si256(y, _mm256_or_si256(x, _mm256_xor_si256(z, _mm256_set1_epi32(-1)))); }
+            template<int S> static vector rotl(vector x) { return _mm256_or_si256(_mm256_slli_epi32(x, S), _mm256_srli_epi32(x, 32 - S)); }
+
+            // 8 words from each of 8 lanes, transposed so that vector i holds word i of every lane
+            static void transpose(const unsigned char* const data[], int offset, vector* x)
+            {
+                vector r[8];
+                for (int lane = 0; lane < 8; ++lane)
+                    r[lane] = _mm256_loadu_si256((const __m256i*) (data[lane] + offset));
+
+                const auto t0{ _mm256_unpacklo_epi32(r[0], r[1]) };
+                const auto t1{ _mm256_unpackhi_epi32(r[0], r[1]) };
+                const auto t2{ _mm256_unpacklo_epi32(r[2], r[3]) };
+                const auto t3{ _mm256_unpackhi_epi32(r[2], r[3]) };
+                const auto t4{ _mm256_unpacklo_epi32(r[4], r[5]) };
+                const auto t5{ _mm256_unpackhi_epi32(r[4], r[5]) };
+                const auto t6{ _mm256_unpacklo_epi32(r[6], r[7]) };
+                const auto t7{ _mm256_unpackhi_epi32(r[6], r[7]) };
+
+                const auto u0{ _mm256_unpacklo_epi64(t0, t2) };
+                const auto u1{ _mm256_unpackhi_epi64(t0, t2) };
+                const auto u2{ _mm256_unpacklo_epi64(t1, t3) };
+                const auto u3{ _mm256_unpackhi_epi64(t1, t3) };
+                const auto u4{ _mm256_unpacklo_epi64(t4, t6) };
+                const auto u5{ _mm256_unpackhi_epi64(t4, t6) };
+                const auto u6{ _mm256_unpacklo_epi64(t5, t7) };
+                const auto u7{ _mm256_unpackhi_epi64(t5, t7) };
+
+                x[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+                x[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+                x[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+                x[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+                x[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+                x[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+                x[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+                x[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+            }
+
+            static void load_block(const unsigned char* const data[], vector x[16])
+            {
+                transpose(data, 0, &x[0]);
+                transpose(data, 32, &x[8]);
+            }
+        };
+
+        struct avx512_lanes
+        {
+            typedef __m512i vector;
+            static constexpr size_t LANES = 16;
+
+            static vector load(const uint32_t* p) { return _mm512_load_si512((const void*) p); }
+            static void store(uint32_t* p, vector v) { _mm512_store_si512((void*) p, v); }
+            static vector set1(uint32_t v) { return _mm512_set1_epi32((int)v); }
+            static vector add(vector a, vector b) { return _mm512_add_epi32(a, b); }
+
+            // the immediates are the truth tables of the MD5 functions for (x, y, z) = (0xF0, 0xCC, 0xAA)
+            static vector F(vector x, vector y, vector z) { return _mm512_ternarylogic_epi32(x, y, z, 0xCA); }
+            static vector G(vector x, vector y, vector z) { return _mm512_ternarylogic_epi32(x, y, z, 0xE4); }
+            static vector H(vector x, vector y, vector z) { return _mm512_ternarylogic_epi32(x, y, z, 0x96); }
+            static vector I(vector x, vector y, vector z) { return _mm512_ternarylogic_epi32(x, y, z, 0x39); }
+            template<int S> static vector rotl(vector x) { return _mm512_rol_epi32(x, S); }
+
+            // lanes 0-7 and 8-15 are transposed separately and then glued together
+            static void load_block(const unsigned char* const data[], vector x[16])
+            {
+                avx2_lanes::vector lower[16], upper[16];
+                avx2_lanes::load_block(data, lower);
+                avx2_lanes::load_block(data + 8, upper);
+                for (int i = 0; i < 16; ++i)
+                    x[i] = _mm512_inserti64x4(_mm512_castsi256_si512(lower[i]), upper[i], 1);
+            }
+        };
+#endif
+
+        template<typename T> struct md5_rounds
+        {
+            typedef typename T::vector vector;
+
+            template<int S> static void FF(vector& a, vector b, vector c, vector d, vector x, uint32_t ac)
+            {
+                a = T::add(T::template rotl<S>(T::add(T::add(a, T::F(b, c, d)), T::add(x, T::set1(ac)))), b);
+            }
+
+            template<int S> static void GG(vector& a, vector b, vector c, vector d, vector x, uint32_t ac)
+            {
+                a = T::add(T::template rotl<S>(T::add(T::add(a, T::G(b, c, d)), T::add(x, T::set1(ac)))), b);
+            }
+
+            template<int S> static void HH(vector& a, vector b, vector c, vector d, vector x, uint32_t ac)
+            {
+                a = T::add(T::template rotl<S>(T::add(T::add(a, T::H(b, c, d)), T::add(x, T::set1(ac)))), b);
+            }
+
+            template<int S> static void II(vector& a, vector b, vector c, vector d, vector x, uint32_t ac)
+            {
+                a = T::add(T::template rotl<S>(T::add(T::add(a, T::I(b, c, d)), T::add(x, T::set1(ac)))), b);
+            }
+
+            // state holds word i of lane n at state[i * LANES + n]. All lane pointers advance by one block per block.
+            static void transform(uint32_t* state, const unsigned char* data[], uint64_t blocks)
+            {
+                vector a{ T::load(state) };
+                vector b{ T::load(state + T::LANES) };
+                vector c{ T::load(state + 2 * T::LANES) };
+                vector d{ T::load(state + 3 * T::LANES) };
+
+                for (; blocks; --blocks)
+                {
+                    vector x[16];
+                    T::load_block(data, x);
+                    for (size_t lane = 0; lane < T::LANES; ++lane)
+                        data[lane] += 64;
+
+                    const vector aa{ a }, bb{ b }, cc{ c }, dd{ d };
+
+                    FF<7>(a, b, c, d, x[0], 0xd76aa478);
+                    FF<12>(d, a, b, c, x[1], 0xe8c7b756);
+                    FF<17>(c, d, a, b, x[2], 0x242070db);
+                    FF<22>(b, c, d, a, x[3], 0xc1bdceee);
+                    FF<7>(a, b, c, d, x[4], 0xf57c0faf);
+                    FF<12>(d, a, b, c, x[5], 0x4787c62a);
+                    FF<17>(c, d, a, b, x[6], 0xa8304613);
+                    FF<22>(b, c, d, a, x[7], 0xfd469501);
+                    FF<7>(a, b, c, d, x[8], 0x698098d8);
+                    FF<12>(d, a, b, c, x[9], 0x8b44f7af);
+                    FF<17>(c, d, a, b, x[10], 0xffff5bb1);
+                    FF<22>(b, c, d, a, x[11], 0x895cd7be);
+                    FF<7>(a, b, c, d, x[12], 0x6b901122);
+                    FF<12>(d, a, b, c, x[13], 0xfd987193);
+                    FF<17>(c, d, a, b, x[14], 0xa679438e);
+                    FF<22>(b, c, d, a, x[15], 0x49b40821);
+
+                    GG<5>(a, b, c, d, x[1], 0xf61e2562);
+                    GG<9>(d, a, b, c, x[6], 0xc040b340);
+                    GG<14>(c, d, a, b, x[11], 0x265e5a51);
+                    GG<20>(b, c, d, a, x[0], 0xe9b6c7aa);
+                    GG<5>(a, b, c, d, x[5], 0xd62f105d);
+                    GG<9>(d, a, b, c, x[10], 0x02441453);
+                    GG<14>(c, d, a, b, x[15], 0xd8a1e681);
+                    GG<20>(b, c, d, a, x[4], 0xe7d3fbc8);
+                    GG<5>(a, b, c, d, x[9], 0x21e1cde6);
+                    GG<9>(d, a, b, c, x[14], 0xc33707d6);
+                    GG<14>(c, d, a, b, x[3], 0xf4d50d87);
+                    GG<20>(b, c, d, a, x[8], 0x455a14ed);
+                    GG<5>(a, b, c, d, x[13], 0xa9e3e905);
+                    GG<9>(d, a, b, c, x[2], 0xfcefa3f8);
+                    GG<14>(c, d, a, b, x[7], 0x676f02d9);
+                    GG<20>(b, c, d, a, x[12], 0x8d2a4c8a);
+
+                    HH<4>(a, b, c, d, x[5], 0xfffa3942);
+                    HH<11>(d, a, b, c, x[8], 0x8771f681);
+                    HH<16>(c, d, a, b, x[11], 0x6d9d6122);
+                    HH<23>(b, c, d, a, x[14], 0xfde5380c);
+                    HH<4>(a, b, c, d, x[1], 0xa4beea44);
+                    HH<11>(d, a, b, c, x[4], 0x4bdecfa9);
+                    HH<16>(c, d, a, b, x[7], 0xf6bb4b60);
+                    HH<23>(b, c, d, a, x[10], 0xbebfbc70);
+                    HH<4>(a, b, c, d, x[13], 0x289b7ec6);
+                    HH<11>(d, a, b, c, x[0], 0xeaa127fa);
+                    HH<16>(c, d, a, b, x[3], 0xd4ef3085);
+                    HH<23>(b, c, d, a, x[6], 0x04881d05);
+                    HH<4>(a, b, c, d, x[9], 0xd9d4d039);
+                    HH<11>(d, a, b, c, x[12], 0xe6db99e5);
+                    HH<16>(c, d, a, b, x[15], 0x1fa27cf8);
+                    HH<23>(b, c, d, a, x[2], 0xc4ac5665);
+
+                    II<6>(a, b, c, d, x[0], 0xf4292244);
+                    II<10>(d, a, b, c, x[7], 0x432aff97);
+                    II<15>(c, d, a, b, x[14], 0xab9423a7);
+                    II<21>(b, c, d, a, x[5], 0xfc93a039);
+                    II<6>(a, b, c, d, x[12], 0x655b59c3);
+                    II<10>(d, a, b, c, x[3], 0x8f0ccc92);
+                    II<15>(c, d, a, b, x[10], 0xffeff47d);
+                    II<21>(b, c, d, a, x[1], 0x85845dd1);
+                    II<6>(a, b, c, d, x[8], 0x6fa87e4f);
+                    II<10>(d, a, b, c, x[15], 0xfe2ce6e0);
+                    II<15>(c, d, a, b, x[6], 0xa3014314);
+                    II<21>(b, c, d, a, x[13], 0x4e0811a1);
+                    II<6>(a, b, c, d, x[4], 0xf7537e82);
+                    II<10>(d, a, b, c, x[11], 0xbd3af235);
+                    II<15>(c, d, a, b, x[2], 0x2ad7d2bb);
+                    II<21>(b, c, d, a, x[9], 0xeb86d391);
+
+                    a = T::add(a, aa);
+                    b = T::add(b, bb);
+                    c = T::add(c, cc);
+                    d = T::add(d, dd);
+                }
+
+                T::store(state, a);
+                T::store(state + T::LANES, b);
+                T::store(state + 2 * T::LANES, c);
+                T::store(state + 3 * T::LANES, d);
+            }
+        };
+
+        // the final one or two blocks of a message: the last partial block, the 0x80 marker and the length in bits
+        struct message_tail
+        {
+            unsigned char data[128];
+            uint64_t blocks;
+        };
+
+        static void prepare_tail(const unsigned char* message, uint64_t size, message_tail& tail)
+        {
+            const auto remainder{ (size_t)(size % 64) };
+            memset(tail.data, 0, sizeof(tail.data));
+            if (remainder)
+            {
+                memcpy(tail.data, message + (size - remainder), remainder);
+            }
+            tail.data[remainder] = 0x80;
+            tail.blocks = (remainder < 56) ? 1 : 2;
+
+            const uint64_t bits{ size * 8 };
+            for (int i = 0; i < 8; ++i)
+            {
+                tail.data[tail.blocks * 64 - 8 + i] = (unsigned char)(bits >> (i * 8));
+            }
+        }
+
+        template<typename T> static void hash_messages(const unsigned char* const messages[], const uint64_t sizes[], size_t count, digest results[])
+        {
+            constexpr size_t LANES{ T::LANES };
+            constexpr size_t IDLE{ SIZE_MAX };
+
+            struct lane
+            {
+                size_t message;
+                uint64_t blocks_left;
+                bool is_in_tail;
+                message_tail tail;
+            };
+
+            alignas(64) uint32_t state[4 * LANES];
+            const unsigned char* data[LANES];
+            lane lanes[LANES];
+            size_t next_message = 0;
+
+            const auto start_next_message = [&](size_t index)
+            {
+                auto& l{ lanes[index] };
+                if (next_message == count)
+                {
+                    l.message = IDLE;
+                    return;
+                }
+                l.message = next_message++;
+                prepare_tail(messages[l.message], sizes[l.message], l.tail);
+                l.blocks_left = sizes[l.message] / 64;
+                l.is_in_tail = !l.blocks_left;
+                if (l.is_in_tail)
+                {
+                    l.blocks_left = l.tail.blocks;
+                    data[index] = l.tail.data;
+                }
+                else
+                {
+                    data[index] = messages[l.message];
+                }
+                state[index] = 0x67452301;
+                state[LANES + index] = 0xefcdab89;
+                state[2 * LANES + index] = 0x98badcfe;
+                state[3 * LANES + index] = 0x10325476;
+            };
+
+            for (size_t index = 0; index < LANES; ++index)
+            {
+                start_next_message(index);
+            }
+
+            for (;;)
+            {
+                // run all lanes for as many blocks as the shortest one has left. Idle lanes simply hash
+                // whatever a busy lane hashes; their state is never looked at again.
+                uint64_t blocks = UINT64_MAX;
+                size_t busy_lane = IDLE;
+                for (size_t index = 0; index < LANES; ++index)
+                {
+                    if (lanes[index].message != IDLE)
+                    {
+                        blocks = std::min(blocks, lanes[index].blocks_left);
+                        busy_lane = index;
+                    }
+                }
+                if (busy_lane == IDLE)
+                    break;
+
+                for (size_t index = 0; index < LANES; ++index)
+                {
+                    if (lanes[index].message == IDLE)
+                        data[index] = data[busy_lane];
+                }
+                md5_rounds<T>::transform(state, data, blocks);
+
+                for (size_t index = 0; index < LANES; ++index)
+                {
+                    auto& l{ lanes[index] };
+                    if (l.message == IDLE)
+                        continue;
+
+                    l.blocks_left -= blocks;
+                    if (l.blocks_left)
+                        continue;
+
+                    if (!l.is_in_tail)
+                    {
+                        l.is_in_tail = true;
+                        l.blocks_left = l.tail.blocks;
+                        data[index] = l.tail.data;
+                        continue;
+                    }
+
+                    auto& result{ results[l.message] };
+                    for (size_t word = 0; word < 4; ++word)
+                    {
+                        const auto value{ state[word * LANES + index] };
+                        result[word * 4] = (unsigned char)value;
+                        result[word * 4 + 1] = (unsigned char)(value >> 8);
+                        result[word * 4 + 2] = (unsigned char)(value >> 16);
+                        result[word * 4 + 3] = (unsigned char)(value >> 24);
+                    }
+                    start_next_message(index);
+                }
+            }
+        }
+
+    private:
+        const kernel m_kernel;
+    };
+}
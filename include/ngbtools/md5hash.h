@@ -1,5 +1,7 @@
 #pragma once
 
+#include <ngbtools/digest.h>
+
 // adopted from http ://www.zedwood.com/article/cpp-md5-function
 
 /* MD5
@@ -39,7 +41,7 @@ documentation and/or software.
 //
 // usage: 1) feed it blocks of uchars with update()
 //      2) finalize()
-//      3) get hexdigest() string
+//      3) get rawdigest() value or hexdigest() string
 //      or
 //      MD5(std::string).hexdigest()
 //
@@ -133,12 +135,13 @@ public:
         if (!finalized)
             return "";
 
-        char buf[33];
-        for (int i = 0; i < 16; i++)
-            sprintf(buf + i * 2, "%02X", digest[i]);
-        buf[32] = 0;
+        return rawdigest().to_hex();
+    }
 
-        return std::string(buf);
+    // the 16 raw bytes of the digest, or an empty digest if not finalized yet
+    ngbtools::digest rawdigest() const
+    {
+        return finalized ? ngbtools::digest{ digest, 16 } : ngbtools::digest{};
     }
 
 
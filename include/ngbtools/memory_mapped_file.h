@@ -0,0 +1,133 @@
+#pragma once
+
+#include <string>
+#include "Windows.h"
+
+#include <ngbtools/string.h>
+#include <ngbtools/logging.h>
+#include <ngbtools/windows_errors.h>
+
+namespace ngbtools
+{
+    /// <summary>
+    /// A read-only view of a whole file. Empty files can be opened, too: they simply have no data.
+    /// </summary>
+    class memory_mapped_file final
+    {
+    public:
+        memory_mapped_file()
+            :
+            m_hFile{ INVALID_HANDLE_VALUE },
+            m_hMapping{ nullptr },
+            m_data{ nullptr },
+            m_size{ 0 }
+        {
+        }
+
+        ~memory_mapped_file()
+        {
+            close();
+        }
+
+    private:
+        memory_mapped_file(const memory_mapped_file&) = delete;
+        memory_mapped_file& operator=(const memory_mapped_file&) = delete;
+        memory_mapped_file(memory_mapped_file&&) = delete;
+        memory_mapped_file& operator=(memory_mapped_file&&) = delete;
+
+    public:
+        /// <summary>
+        /// Map an existing file into memory
+        /// </summary>
+        /// <param name="pathname">file to map</param>
+        /// <param name="flags">additional CreateFileW flags, e.g. FILE_FLAG_SEQUENTIAL_SCAN</param>
+        /// <returns>true if the file could be mapped, or false otherwise</returns>
+        bool open(std::string_view pathname, DWORD flags = FILE_ATTRIBUTE_NORMAL)
+        {
+            close();
+
+            const auto wpathname{ string::encode_as_utf16(pathname) };
+            m_hFile = ::CreateFileW(wpathname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, flags, 0);
+            if (m_hFile == INVALID_HANDLE_VALUE)
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("CreateFileW({}) failed", pathname));
+                return false;
+            }
+
+            LARGE_INTEGER size{};
+            if (!::GetFileSizeEx(m_hFile, &size))
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("GetFileSizeEx({}) failed", pathname));
+                close();
+                return false;
+            }
+
+            // you cannot map an empty file, but there is nothing to read anyway
+            m_size = (uint64_t)size.QuadPart;
+            if (!m_size)
+                return true;
+
+            m_hMapping = ::CreateFileMappingW(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!m_hMapping)
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("CreateFileMappingW({}) failed", pathname));
+                close();
+                return false;
+            }
+
+            m_data = (const unsigned char*) ::MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+            if (!m_data)
+            {
+                logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+                    fmt::format("MapViewOfFile({}) failed", pathname));
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        void close()
+        {
+            if (m_data)
+            {
+                ::UnmapViewOfFile(m_data);
+                m_data = nullptr;
+            }
+            if (m_hMapping)
+            {
+                ::CloseHandle(m_hMapping);
+                m_hMapping = nullptr;
+            }
+            if (m_hFile != INVALID_HANDLE_VALUE)
+            {
+                ::CloseHandle(m_hFile);
+                m_hFile = INVALID_HANDLE_VALUE;
+            }
+            m_size = 0;
+        }
+
+        bool is_open() const
+        {
+            return m_hFile != INVALID_HANDLE_VALUE;
+        }
+
+        const unsigned char* data() const
+        {
+            return m_data;
+        }
+
+        uint64_t size() const
+        {
+            return m_size;
+        }
+
+    private:
+        HANDLE m_hFile;
+        HANDLE m_hMapping;
+        const unsigned char* m_data;
+        uint64_t m_size;
+    };
+}
@@ -42,9 +42,9 @@ namespace ngbtools
             void push_component(std::string_view component)
             {
                 const auto normalized_component{ path::normalize(component) };
-                for (auto subcomponent : string::split(normalized_component, path::separator_string()))
+                for (const auto subcomponent : string::tokenize(normalized_component, path::separator_string()))
                 {
-                    if (string::equals(subcomponent, ".."))
+                    if (subcomponent == "..")
                     {
                         if (!m_components.empty())
                         {
@@ -53,7 +53,7 @@ namespace ngbtools
                     }
                     else
                     {
-                        m_components.push_back(subcomponent);
+                        m_components.emplace_back(subcomponent);
                     }
                 }
             }
@@ -123,7 +123,7 @@ namespace ngbtools
 
             std::string pathext{ ".EXE;.BAT;.CMD" };
             environment_variables::get("PATHEXT", pathext);
-            for (const auto possible_extension : string::split(pathext, ";"))
+            for (const auto possible_extension : string::tokenize(pathext, ";"))
             {
                 const auto temp{ change_extension(name, possible_extension) };
                 if (file::exists(temp))
@@ -174,7 +174,7 @@ namespace ngbtools
                 return false;
             }
 
-            for (const auto path_element : string::split(path, ";"))
+            for (const auto path_element : string::tokenize(path, ";"))
             {
                 if (locate_in_directory(path_element, name, result, is_executable))
                     return true;
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <format>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Windows.h"
+#include <ngbtools/string.h>
+#include <ngbtools/string_writer.h>
+
+namespace ngbtools
+{
+    namespace string
+    {
+        /// <summary>
+        /// A writer for large outputs. Unlike writer, which doubles one buffer and copies everything written so far
+        /// every time it does, this one keeps a chain of fixed size segments: once written, bytes never move.
+        /// The segments come from the allocator, and clear() keeps them for the next round.
+        ///
+        /// The output is meant to go to a file with write_to() - or segment by segment to anywhere else with
+        /// for_each_segment() - rather than to be turned into a string.
+        /// </summary>
+        template <typename ALLOCATOR = std::allocator<char>> class basic_segmented_writer final
+        {
+        public:
+            static constexpr size_t DEFAULT_SEGMENT_SIZE = 1024 * 256;
+
+            explicit basic_segmented_writer(size_t segment_size = DEFAULT_SEGMENT_SIZE, const ALLOCATOR& allocator = ALLOCATOR())
+                :
+                m_allocator{ allocator },
+                m_segment_size{ segment_size },
+                m_current{ 0 },
+                m_size{ 0 }
+            {
+                assert(segment_size > 0);
+            }
+
+            ~basic_segmented_writer()
+            {
+                for (const auto& item : m_segments)
+                {
+                    std::allocator_traits<ALLOCATOR>::deallocate(m_allocator, item.data, m_segment_size);
+                }
+            }
+
+        private:
+            basic_segmented_writer(const basic_segmented_writer&) = delete;
+            basic_segmented_writer& operator=(const basic_segmented_writer&) = delete;
+            basic_segmented_writer(basic_segmented_writer&&) = delete;
+            basic_segmented_writer& operator=(basic_segmented_writer&&) = delete;
+
+        public:
+            bool empty() const
+            {
+                return m_size == 0;
+            }
+
+            size_t size() const
+            {
+                return m_size;
+            }
+
+            bool append(char c)
+            {
+                auto current{ free_segment() };
+                if (!current)
+                    return false;
+
+                current->data[current->used++] = c;
+                ++m_size;
+                return true;
+            }
+
+            bool append(std::string_view text)
+            {
+                auto p{ text.data() };
+                auto remaining{ text.size() };
+                while (remaining)
+                {
+                    auto current{ free_segment() };
+                    if (!current)
+                        return false;
+
+                    const auto bytes_to_copy{ std::min(remaining, m_segment_size - current->used) };
+                    memcpy(current->data + current->used, p, bytes_to_copy);
+                    current->used += bytes_to_copy;
+                    m_size += bytes_to_copy;
+                    p += bytes_to_copy;
+                    remaining -= bytes_to_copy;
+                }
+                return true;
+            }
+
+            bool append(const char* text)
+            {
+                if (!text)
+                    return true;
+
+                return append(std::string_view{ text });
+            }
+
+            bool append_repeated(char c, size_t number_of_times)
+            {
+                while (number_of_times)
+                {
+                    auto current{ free_segment() };
+                    if (!current)
+                        return false;
+
+                    const auto bytes_to_set{ std::min(number_of_times, m_segment_size - current->used) };
+                    memset(current->data + current->used, c, bytes_to_set);
+                    current->used += bytes_to_set;
+                    m_size += bytes_to_set;
+                    number_of_times -= bytes_to_set;
+                }
+                return true;
+            }
+
+            /// <summary>
+            /// Format straight into the free space of the current segment. Only text that runs past the end of the
+            /// segment is formatted a second time, into a string, and the rest of it copied to the next segments.
+            /// </summary>
+            bool append_vformatted(const std::string_view text, std::format_args args)
+            {
+                auto current{ free_segment() };
+                if (!current)
+                    return false;
+
+                const auto space{ m_segment_size - current->used };
+                const auto size{ std::vformat_to(bounded_output_iterator{ current->data + current->used, space }, text, args).count() };
+                const auto bytes_written{ std::min(size, space) };
+                current->used += bytes_written;
+                m_size += bytes_written;
+                if (size == bytes_written)
+                    return true;
+
+                return append(std::string_view{ std::vformat(text, args) }.substr(bytes_written));
+            }
+
+            template <typename... Args> bool append_formatted(const std::string_view text, Args&&... args)
+            {
+                return append_vformatted(text, std::make_format_args(args...));
+            }
+
+            /// <summary>
+            /// Call function(data, size) for every segment that has data, in order
+            /// </summary>
+            template <typename FUNCTION> bool for_each_segment(FUNCTION function) const
+            {
+                for (const auto& item : m_segments)
+                {
+                    if (!item.used)
+                        break;
+
+                    if (!function((const char*)item.data, item.used))
+                        return false;
+                }
+                return true;
+            }
+
+            /// <summary>
+            /// Write everything to a file, segment by segment, without copying it first
+            /// </summary>
+            /// <returns>true if everything was written, or false otherwise (and GetLastError() tells why)</returns>
+            bool write_to(HANDLE hFile) const
+            {
+                return for_each_segment([hFile](const char* p, size_t size)
+                    {
+                        while (size)
+                        {
+                            DWORD bytes_written = 0;
+                            if (!::WriteFile(hFile, p, (DWORD)std::min<size_t>(size, 1024 * 1024 * 16), &bytes_written, nullptr))
+                                return false;
+
+                            p += bytes_written;
+                            size -= bytes_written;
+                        }
+                        return true;
+                    });
+            }
+
+            std::string as_string() const
+            {
+                std::string result;
+                result.reserve(m_size);
+                for_each_segment([&result](const char* p, size_t size)
+                    {
+                        result.append(p, size);
+                        return true;
+                    });
+                return result;
+            }
+
+            /// <summary>
+            /// Forget what was written, but keep the segments, so that writing on needs no new memory
+            /// </summary>
+            void clear()
+            {
+                for (auto& item : m_segments)
+                {
+                    item.used = 0;
+                }
+                m_current = 0;
+                m_size = 0;
+            }
+
+        private:
+            struct segment
+            {
+                char* data;
+                size_t used;
+            };
+
+            // the segment to write to, with at least one free byte
+            segment* free_segment()
+            {
+                if ((m_current < m_segments.size()) && (m_segments[m_current].used == m_segment_size))
+                {
+                    ++m_current;
+                }
+                if (m_current == m_segments.size())
+                {
+                    char* data{ nullptr };
+                    try
+                    {
+                        data = std::allocator_traits<ALLOCATOR>::allocate(m_allocator, m_segment_size);
+                        m_segments.push_back({ data, 0 });
+                    }
+                    catch (const std::bad_alloc&)
+                    {
+                        if (data)
+                        {
+                            std::allocator_traits<ALLOCATOR>::deallocate(m_allocator, data, m_segment_size);
+                        }
+                        return nullptr;
+                    }
+                }
+                return &m_segments[m_current];
+            }
+
+        private:
+            ALLOCATOR m_allocator;
+            const size_t m_segment_size;
+            std::vector<segment> m_segments;
+
+            // the segment written to; all before it are full, all after it are unused
+            size_t m_current;
+            size_t m_size;
+        };
+
+        using segmented_writer = basic_segmented_writer<>;
+    }
+}
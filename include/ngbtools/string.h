@@ -1,6 +1,18 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
 #include <string>
+#include <vector>
+
+#include <ngbtools/unicode.h>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <intrin.h>
+#include <emmintrin.h>
+#endif
 
 namespace ngbtools
 {
@@ -47,6 +59,80 @@ namespace ngbtools
             return (c & 0x0F);
         }
 
+        /// <summary>
+        /// Write size bytes as 2 * size uppercase hex digits. No terminating zero is written.
+        /// </summary>
+        /// <param name="data">bytes to convert</param>
+        /// <param name="size">number of bytes</param>
+        /// <param name="result">buffer receiving the hex digits</param>
+        inline void to_hex(const unsigned char* data, size_t size, char* result)
+        {
+            // both digits of a byte with a single lookup
+            static constexpr auto digit_pairs{ []()
+                {
+                    std::array<char, 512> table{};
+                    for (size_t index = 0; index < 256; ++index)
+                    {
+                        table[index * 2] = "0123456789ABCDEF"[index >> 4];
+                        table[index * 2 + 1] = "0123456789ABCDEF"[index & 0x0F];
+                    }
+                    return table;
+                }() };
+
+            for (size_t index = 0; index < size; ++index)
+            {
+                memcpy(result + index * 2, &digit_pairs[data[index] * 2], 2);
+            }
+        }
+
+        /// <summary>
+        /// Get the value of a hex digit
+        /// </summary>
+        /// <param name="c">character, may be a UTF-16 or UTF-32 code unit</param>
+        /// <returns>0..15, or 0xFF if c is not a hex digit</returns>
+        inline uint8_t hex_value(uint32_t c)
+        {
+            static constexpr auto values{ []()
+                {
+                    std::array<uint8_t, 256> table{};
+                    for (auto& value : table)
+                        value = 0xFF;
+                    for (uint8_t index = 0; index < 10; ++index)
+                        table['0' + index] = index;
+                    for (uint8_t index = 0; index < 6; ++index)
+                    {
+                        table['A' + index] = 10 + index;
+                        table['a' + index] = 10 + index;
+                    }
+                    return table;
+                }() };
+
+            return (c < values.size()) ? values[c] : 0xFF;
+        }
+
+        /// <summary>
+        /// Convert hex digits (upper- or lowercase) back to bytes
+        /// </summary>
+        /// <param name="text">an even number of hex digits</param>
+        /// <param name="result">buffer receiving text.size() / 2 bytes</param>
+        /// <returns>true if text is valid, or false otherwise (in which case result is undefined)</returns>
+        template <typename CHAR> bool from_hex(std::basic_string_view<CHAR> text, unsigned char* result)
+        {
+            if (text.size() % 2)
+                return false;
+
+            for (size_t index = 0; index < text.size(); index += 2)
+            {
+                const auto upper{ hex_value((uint32_t)text[index]) };
+                const auto lower{ hex_value((uint32_t)text[index + 1]) };
+                if ((upper | lower) & 0xF0)
+                    return false;
+
+                result[index / 2] = (unsigned char)((upper << 4) | lower);
+            }
+            return true;
+        }
+
         inline size_t length(const char* text)
         {
             return text ? strlen(text) : 0;
@@ -89,13 +175,7 @@ namespace ngbtools
 
         inline bool equals(std::wstring_view a, std::wstring_view b)
         {
-            if (a.empty())
-                return b.empty();
-
-            if (b.empty())
-                return false;
-
-            return wcscmp(a.data(), b.data()) == 0;
+            return a == b;
         }
 
         inline bool equals_nocase(std::wstring_view a, std::wstring_view b)
@@ -103,21 +183,15 @@ namespace ngbtools
             if (a.empty())
                 return b.empty();
 
-            if (b.empty())
+            if (a.size() != b.size())
                 return false;
 
-            return _wcsicmp(a.data(), b.data()) == 0;
+            return _wcsnicmp(a.data(), b.data(), a.size()) == 0;
         }
 
         inline bool equals(std::string_view a, std::string_view b)
         {
-            if (a.empty())
-                return b.empty();
-
-            if (b.empty())
-                return false;
-
-            return strcmp(a.data(), b.data()) == 0;
+            return a == b;
         }
 
         inline bool equals_nocase(std::string_view a, std::string_view b)
@@ -125,10 +199,10 @@ namespace ngbtools
             if (a.empty())
                 return b.empty();
 
-            if (b.empty())
+            if (a.size() != b.size())
                 return false;
 
-            return _stricmp(a.data(), b.data()) == 0;
+            return _strnicmp(a.data(), b.data(), a.size()) == 0;
         }
 
 
@@ -163,113 +237,274 @@ namespace ngbtools
             return result;
         }
 
-        inline std::vector<std::string> split(std::string_view svtext, std::string_view svseparators, bool handle_quotation_marks = false)
+        /// <summary>
+        /// Splits a text into tokens without copying it: the tokens are views into the text, so it must outlive the
+        /// tokenizer. Tokens are found one at a time while iterating, the text is never read past its length.
+        ///
+        /// Every separator ends a token, so two separators in a row give an empty token; a last token is only returned
+        /// if it is not empty. With handle_quotation_marks, text in quotation marks is a token of its own (without the
+        /// quotation marks), separators inside it are part of the token.
+        /// </summary>
+        class tokenizer final
         {
-            std::vector<std::string> result;
+        public:
+            tokenizer(std::string_view text, std::string_view separators, bool handle_quotation_marks = false)
+                :
+                m_text{ text },
+                m_handle_quotation_marks{ handle_quotation_marks },
+                m_is_separator{},
+                m_special{},
+                m_number_of_special{ 0 }
+            {
+                for (const auto c : separators)
+                {
+                    add_special(c);
+                }
+                if (handle_quotation_marks)
+                {
+                    add_special('"');
+                }
+            }
 
-            bool is_recording_quoted_string = false;
-            auto text = svtext.data();
-            if (text)
+            class iterator final
             {
-                auto start = text;
-                for (;;)
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = std::string_view;
+                using difference_type = std::ptrdiff_t;
+                using pointer = const std::string_view*;
+                using reference = const std::string_view&;
+
+                iterator()
+                    :
+                    m_owner{ nullptr },
+                    m_start{ nullptr },
+                    m_end{ nullptr },
+                    m_is_recording_quoted_string{ false },
+                    m_is_finished{ true }
+                {
+                }
+
+                iterator(const tokenizer& owner)
+                    :
+                    m_owner{ &owner },
+                    m_start{ owner.m_text.data() },
+                    m_end{ owner.m_text.data() + owner.m_text.size() },
+                    m_is_recording_quoted_string{ false },
+                    m_is_finished{ false }
+                {
+                    advance();
+                }
+
+                reference operator*() const
+                {
+                    return m_token;
+                }
+
+                pointer operator->() const
+                {
+                    return &m_token;
+                }
+
+                iterator& operator++()
+                {
+                    advance();
+                    return *this;
+                }
+
+                iterator operator++(int)
                 {
-                    char c = *(text++);
-                    if (!c)
+                    auto result{ *this };
+                    advance();
+                    return result;
+                }
+
+                bool operator==(const iterator& other) const
+                {
+                    if (m_is_finished || other.m_is_finished)
+                        return m_is_finished == other.m_is_finished;
+
+                    return (m_start == other.m_start) && (m_token.data() == other.m_token.data());
+                }
+
+                bool operator!=(const iterator& other) const
+                {
+                    return !(*this == other);
+                }
+
+            private:
+                void advance()
+                {
+                    if (m_is_finished)
+                        return;
+
+                    for (;;)
                     {
-                        if (*start)
+                        if (m_is_recording_quoted_string)
                         {
-                            result.push_back(start);
+                            const auto quote{ static_cast<const char*>(std::memchr(m_start, '"', m_end - m_start)) };
+                            m_is_recording_quoted_string = false;
+                            if (quote)
+                            {
+                                take_token(quote);
+                                return;
+                            }
+
+                            // an unterminated quoted string runs to the end of the text
+                            if (m_start == m_end)
+                            {
+                                m_is_finished = true;
+                                m_token = {};
+                                return;
+                            }
+                            take_token(m_end);
+                            return;
                         }
-                        break;
-                    }
-                    if (is_recording_quoted_string)
-                    {
-                        if (c == '"')
+
+                        const auto next{ m_owner->find_special(m_start, m_end) };
+                        if (next == m_end)
                         {
-                            assert(text - start >= 1);
-                            result.push_back(std::string{ start, (size_t)(text - start - 1) });
-                            start = text;
-                            is_recording_quoted_string = false;
+                            if (m_start == m_end)
+                            {
+                                m_is_finished = true;
+                                m_token = {};
+                                return;
+                            }
+                            take_token(m_end);
+                            return;
                         }
-                        continue;
-                    }
-                    else if (handle_quotation_marks and (c == '"'))
-                    {
-                        assert(text - start >= 1);
-                        if (text - start > 1)
+
+                        if (m_owner->m_handle_quotation_marks && (*next == '"'))
                         {
-                            result.push_back(std::string{ start, (size_t)(text - start - 1) });
+                            m_is_recording_quoted_string = true;
+                            if (next == m_start)
+                            {
+                                ++m_start;
+                                continue;
+                            }
+                            take_token(next);
+                            return;
                         }
-                        start = text;
-                        is_recording_quoted_string = true;
-                        continue;
+                        take_token(next);
+                        return;
                     }
+                }
 
-                    if (std::strchr(svseparators.data(), c))
-                    {
-                        assert(text - start >= 1);
-                        result.push_back(std::string{ start, (size_t)(text - start - 1) });
-                        start = text;
-                    }
+                // the token ends at stop, the next one starts after it
+                void take_token(const char* stop)
+                {
+                    m_token = std::string_view{ m_start, static_cast<size_t>(stop - m_start) };
+                    m_start = (stop == m_end) ? m_end : stop + 1;
                 }
+
+            private:
+                const tokenizer* m_owner;
+                const char* m_start;
+                const char* m_end;
+                std::string_view m_token;
+                bool m_is_recording_quoted_string;
+                bool m_is_finished;
+            };
+
+            iterator begin() const
+            {
+                return iterator{ *this };
             }
-            return result;
-        }
 
-		inline std::wstring encode_as_utf16(std::string_view utf8_encoded_text)
-		{
-            const auto utf8_len = utf8_encoded_text.size();
-            const auto utf8_encoded_string = utf8_encoded_text.data();
-			
-            // handle nullptr gracefully
-			if (!utf8_encoded_string || !utf8_len)
-				return {};
-
-            // we try the stack first (because that is of an order of magnitudes faster)
-            // only if this fails we revert back to allocating the data on the stack
-            const size_t size_of_stack_buffer = 1024;
-            if (utf8_len < size_of_stack_buffer)
+            iterator end() const
+            {
+                return iterator{};
+            }
+
+        private:
+            void add_special(char c)
             {
-                wchar_t buffer_on_the_stack[size_of_stack_buffer];
-                int rc = MultiByteToWideChar(CP_UTF8, 0, utf8_encoded_string, (int)utf8_len,
-                    buffer_on_the_stack, size_of_stack_buffer - 1);
-                if (rc > 0)
+                const auto byte{ static_cast<unsigned char>(c) };
+                if (is_special(byte))
+                    return;
+
+                m_is_separator[byte / 64] |= uint64_t{ 1 } << (byte % 64);
+                if (m_number_of_special < m_special.size())
                 {
-                    assert(rc < sizeof(buffer_on_the_stack));
-                    buffer_on_the_stack[rc] = 0;
-                    return std::wstring(buffer_on_the_stack);
+                    m_special[m_number_of_special] = c;
                 }
-                rc = GetLastError();
-
-                // we don't expect these
-                assert(rc != ERROR_INVALID_FLAGS);
-                assert(rc != ERROR_INVALID_PARAMETER);
-                assert(rc != ERROR_NO_UNICODE_TRANSLATION);
+                ++m_number_of_special;
+            }
 
-                // we do expect this
-                assert(rc == ERROR_INSUFFICIENT_BUFFER);
+            bool is_special(unsigned char byte) const
+            {
+                return (m_is_separator[byte / 64] & (uint64_t{ 1 } << (byte % 64))) != 0;
             }
-            size_t size_to_allocate = utf8_len + 16;
-            size_t max_size_to_allocate = 64 * size_to_allocate;
-            while (max_size_to_allocate)
+
+            // returns the first separator (or quotation mark) in [start, end), or end if there is none
+            const char* find_special(const char* start, const char* end) const
             {
-                std::vector<wchar_t> buffer_on_the_heap;
-                buffer_on_the_heap.resize(size_to_allocate + 1);
+#if defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+                // SSE2 compares 16 bytes against each separator at once; with many separators the bitmap is faster
+                if (m_number_of_special <= m_special.size())
+                {
+                    __m128i patterns[MAXIMUM_VECTORIZED_SEPARATORS];
+                    for (size_t i = 0; i < m_number_of_special; ++i)
+                    {
+                        patterns[i] = _mm_set1_epi8(m_special[i]);
+                    }
 
-                int rc = MultiByteToWideChar(CP_UTF8, 0, utf8_encoded_string, (int)utf8_len,
-                    &buffer_on_the_heap[0], (int)size_to_allocate);
+                    while (end - start >= 16)
+                    {
+                        const auto block{ _mm_loadu_si128(reinterpret_cast<const __m128i*>(start)) };
+                        auto matches{ _mm_setzero_si128() };
+                        for (size_t i = 0; i < m_number_of_special; ++i)
+                        {
+                            matches = _mm_or_si128(matches, _mm_cmpeq_epi8(block, patterns[i]));
+                        }
+                        const auto mask{ static_cast<unsigned long>(_mm_movemask_epi8(matches)) };
+                        unsigned long index;
+                        if (_BitScanForward(&index, mask))
+                            return start + index;
 
-                if (rc > 0)
+                        start += 16;
+                    }
+                }
+#endif
+                for (; start != end; ++start)
                 {
-                    assert(size_t(rc) < size_to_allocate);
-                    buffer_on_the_heap[rc] = 0;
-                    return std::wstring{ &buffer_on_the_heap[0], size_t(rc) };
+                    if (is_special(static_cast<unsigned char>(*start)))
+                        return start;
                 }
-                size_to_allocate *= 2;
+                return end;
+            }
+
+        private:
+            static constexpr size_t MAXIMUM_VECTORIZED_SEPARATORS = 4;
+
+            const std::string_view m_text;
+            const bool m_handle_quotation_marks;
+            uint64_t m_is_separator[4];
+            std::array<char, MAXIMUM_VECTORIZED_SEPARATORS> m_special;
+            size_t m_number_of_special;
+        };
+
+        inline tokenizer tokenize(std::string_view text, std::string_view separators, bool handle_quotation_marks = false)
+        {
+            return tokenizer{ text, separators, handle_quotation_marks };
+        }
+
+        /// <summary>
+        /// Like tokenize, but copies the tokens. Prefer tokenize unless the tokens must outlive the text.
+        /// </summary>
+        inline std::vector<std::string> split(std::string_view svtext, std::string_view svseparators, bool handle_quotation_marks = false)
+        {
+            std::vector<std::string> result;
+            for (const auto token : tokenize(svtext, svseparators, handle_quotation_marks))
+            {
+                result.emplace_back(token);
             }
-            assert(false);
-			return {};
+            return result;
+        }
+
+		inline std::wstring encode_as_utf16(std::string_view utf8_encoded_text)
+		{
+            return unicode::encode_as_utf16(utf8_encoded_text);
 		}
 
 	}
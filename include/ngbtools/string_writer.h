@@ -3,11 +3,78 @@
 
 #include <string>
 #include <cassert>
+#include <format>
+#include <iterator>
 
 namespace ngbtools
 {
     namespace string
     {
+        /// <summary>
+        /// Output iterator for std::vformat_to that fills a buffer of a fixed size, the way std::format_to_n does for
+        /// format strings known at compile time: whatever doesn't fit is only counted, so the caller can make room
+        /// and format again. The writers use it to format straight into their free space.
+        /// </summary>
+        class bounded_output_iterator final
+        {
+        public:
+            using iterator_category = std::output_iterator_tag;
+            using value_type = void;
+            using difference_type = std::ptrdiff_t;
+            using pointer = void;
+            using reference = void;
+
+            bounded_output_iterator(char* buffer, size_t size)
+                :
+                m_buffer{ buffer },
+                m_size{ size },
+                m_count{ 0 }
+            {
+            }
+
+            // unlike with a back_insert_iterator, the position is part of the iterator, so only incrementing moves it:
+            // that way both *it++ = c and *it = c, ++it write to the right place
+            bounded_output_iterator& operator=(char c)
+            {
+                if (m_count < m_size)
+                {
+                    m_buffer[m_count] = c;
+                }
+                return *this;
+            }
+
+            bounded_output_iterator& operator*()
+            {
+                return *this;
+            }
+
+            bounded_output_iterator& operator++()
+            {
+                ++m_count;
+                return *this;
+            }
+
+            bounded_output_iterator operator++(int)
+            {
+                auto result{ *this };
+                ++m_count;
+                return result;
+            }
+
+            /// <summary>
+            /// Number of characters formatted, including those that didn't fit
+            /// </summary>
+            size_t count() const
+            {
+                return m_count;
+            }
+
+        private:
+            char* m_buffer;
+            size_t m_size;
+            size_t m_count;
+        };
+
         class writer final
         {
         public:
@@ -91,12 +158,17 @@ namespace ngbtools
                 return (m_writepos == 0);
             }
 
+            /// <summary>
+            /// The text written so far, valid until the next change to the writer
+            /// </summary>
+            std::string_view as_string_view() const
+            {
+                return std::string_view{ m_dynamic_buffer ? m_dynamic_buffer : m_builtin_buffer, m_writepos };
+            }
+
             std::string as_string() const
             {
-                // this is needed to ensure that the string is zero-terminated
-                const_cast<writer*>(this)->append('\0');
-                --m_writepos;
-                return m_dynamic_buffer ? m_dynamic_buffer : m_builtin_buffer;
+                return std::string{ as_string_view() };
             }
             
             void hexdump(const unsigned char* address, size_t size)
@@ -156,7 +228,7 @@ namespace ngbtools
 
             bool newline()
             {
-                return append(string::newline());
+                return append(std::string_view{ string::newline(), 2 });
             }
 
             bool append(char c)
@@ -202,19 +274,29 @@ namespace ngbtools
                 if (!ps || !*ps)
                     return true;
 
-                size_t len = strlen(ps);
-                char* wp = ensure_free_space(len);
+                return append(std::string_view{ ps });
+            }
+
+            /// <summary>
+            /// Append exactly text.size() bytes, including any embedded zeros
+            /// </summary>
+            bool append(std::string_view text)
+            {
+                if (text.empty())
+                    return true;
+
+                char* wp = ensure_free_space(text.size());
                 if (!wp)
                     return false;
 
-                memcpy(wp, ps, len);
-                m_writepos += len;
+                memcpy(wp, text.data(), text.size());
+                m_writepos += text.size();
                 return true;
             }
 
             bool append(const std::string& s)
             {
-                return append(s.c_str());
+                return append(std::string_view{ s });
             }
 
             bool append_repeated(char c, size_t number_of_times)
@@ -254,14 +336,18 @@ namespace ngbtools
                 return true;
             }
 
+            /// <summary>
+            /// Append a string of at most len bytes that ends early if it has a terminating zero, like a fixed size
+            /// field of a Win32 structure. Nothing beyond len bytes is read.
+            /// </summary>
             bool append_sized_string(const char* ps, size_t len)
             {
                 if (!ps || !*ps or !len)
                     return true;
 
-                size_t actual_len = strlen(ps);
-                if (len > actual_len)
-                    len = actual_len;
+                const auto terminator = (const char*)memchr(ps, 0, len);
+                if (terminator)
+                    len = terminator - ps;
 
                 char* wp = ensure_free_space(len);
                 if (!wp)
@@ -272,9 +358,29 @@ namespace ngbtools
                 return true;
             }
 
+            /// <summary>
+            /// Format straight into the free space of the buffer. Only if the result doesn't fit is the buffer grown
+            /// and the text formatted again, so most of the time nothing is allocated or copied.
+            /// </summary>
+            bool append_vformatted(const std::string_view text, std::format_args args)
+            {
+                const auto space{ free_space() };
+                const auto size{ std::vformat_to(bounded_output_iterator{ write_position(), space }, text, args).count() };
+                if (size > space)
+                {
+                    char* wp = ensure_free_space(size);
+                    if (!wp)
+                        return false;
+
+                    std::vformat_to(bounded_output_iterator{ wp, size }, text, args);
+                }
+                m_writepos += size;
+                return true;
+            }
+
             template <typename... Args> bool append_formatted(const std::string_view text, Args&&... args)
             {
-                return append(std::vformat(text, std::make_format_args(std::forward<Args>(args)...)));
+                return append_vformatted(text, std::make_format_args(args...));
             }
 
             /** \brief   Clears this object to its blank/initial state. */
@@ -290,6 +396,17 @@ namespace ngbtools
             }
 
         private:
+            char* write_position()
+            {
+                return (m_dynamic_buffer ? m_dynamic_buffer : m_builtin_buffer) + m_writepos;
+            }
+
+            size_t free_space() const
+            {
+                const size_t capacity{ m_dynamic_buffer ? m_dynamic_size : std::size(m_builtin_buffer) };
+                assert(m_writepos <= capacity);
+                return capacity - m_writepos;
+            }
 
             void correct(int bytes_written)
             {
@@ -414,7 +531,7 @@ namespace ngbtools
 
         private:
             /** \brief   The current write position */
-            mutable size_t m_writepos;
+            size_t m_writepos;
 
             /** \brief   Size of the dynamic memory (if any) */
             size_t m_dynamic_size;
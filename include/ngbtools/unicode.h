@@ -0,0 +1,407 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <string>
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)) || defined(__SSE2__)
+#define NGBTOOLS_UNICODE_SSE2
+#include <emmintrin.h>
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define NGBTOOLS_UNICODE_NEON
+#include <arm_neon.h>
+#endif
+
+namespace ngbtools
+{
+    /// <summary>
+    /// Conversion between UTF-8 and UTF-16 without the Win32 API, so it works on any platform. The output length
+    /// is calculated exactly before anything is written, so a conversion needs a single allocation - or none, if the
+    /// caller provides the buffer. Runs of ASCII, which is what most paths consist of, are converted 16 at a time.
+    ///
+    /// Like MultiByteToWideChar and WideCharToMultiByte, invalid input does not fail the conversion: every invalid
+    /// UTF-8 sequence and every unpaired surrogate becomes U+FFFD. On platforms where wchar_t has 32 bits the
+    /// wide strings still hold UTF-16 code units.
+    /// </summary>
+    namespace unicode
+    {
+        constexpr char32_t REPLACEMENT_CHARACTER = 0xFFFD;
+
+        namespace detail
+        {
+            constexpr size_t ASCII_BLOCK_SIZE = 16;
+
+            inline bool is_ascii_block(const unsigned char* input)
+            {
+#if defined(NGBTOOLS_UNICODE_SSE2)
+                return _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(input))) == 0;
+#elif defined(NGBTOOLS_UNICODE_NEON)
+                return vmaxvq_u8(vld1q_u8(input)) < 0x80;
+#else
+                unsigned char combined{ 0 };
+                for (size_t i = 0; i < ASCII_BLOCK_SIZE; ++i)
+                {
+                    combined |= input[i];
+                }
+                return combined < 0x80;
+#endif
+            }
+
+            inline bool is_ascii_block(const wchar_t* input)
+            {
+                if constexpr (sizeof(wchar_t) == 2)
+                {
+#if defined(NGBTOOLS_UNICODE_SSE2)
+                    const auto low{ _mm_loadu_si128(reinterpret_cast<const __m128i*>(input)) };
+                    const auto high{ _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + 8)) };
+                    const auto non_ascii_bits{ _mm_and_si128(_mm_or_si128(low, high), _mm_set1_epi16(static_cast<short>(0xFF80))) };
+                    return _mm_movemask_epi8(_mm_cmpeq_epi16(non_ascii_bits, _mm_setzero_si128())) == 0xFFFF;
+#elif defined(NGBTOOLS_UNICODE_NEON)
+                    const auto low{ vld1q_u16(reinterpret_cast<const uint16_t*>(input)) };
+                    const auto high{ vld1q_u16(reinterpret_cast<const uint16_t*>(input + 8)) };
+                    return vmaxvq_u16(vorrq_u16(low, high)) < 0x80;
+#endif
+                }
+                uint32_t combined{ 0 };
+                for (size_t i = 0; i < ASCII_BLOCK_SIZE; ++i)
+                {
+                    combined |= static_cast<uint32_t>(input[i]);
+                }
+                return combined < 0x80;
+            }
+
+            // converts a block of 16 bytes if they are all ASCII
+            inline bool widen_ascii_block(const unsigned char* input, wchar_t* output)
+            {
+                if constexpr (sizeof(wchar_t) == 2)
+                {
+#if defined(NGBTOOLS_UNICODE_SSE2)
+                    const auto block{ _mm_loadu_si128(reinterpret_cast<const __m128i*>(input)) };
+                    if (_mm_movemask_epi8(block))
+                        return false;
+
+                    const auto zero{ _mm_setzero_si128() };
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(output), _mm_unpacklo_epi8(block, zero));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(output + 8), _mm_unpackhi_epi8(block, zero));
+                    return true;
+#elif defined(NGBTOOLS_UNICODE_NEON)
+                    const auto block{ vld1q_u8(input) };
+                    if (vmaxvq_u8(block) >= 0x80)
+                        return false;
+
+                    vst1q_u16(reinterpret_cast<uint16_t*>(output), vmovl_u8(vget_low_u8(block)));
+                    vst1q_u16(reinterpret_cast<uint16_t*>(output + 8), vmovl_high_u8(block));
+                    return true;
+#endif
+                }
+                if (!is_ascii_block(input))
+                    return false;
+
+                for (size_t i = 0; i < ASCII_BLOCK_SIZE; ++i)
+                {
+                    output[i] = input[i];
+                }
+                return true;
+            }
+
+            // converts a block of 16 code units if they are all ASCII
+            inline bool narrow_ascii_block(const wchar_t* input, char* output)
+            {
+                if constexpr (sizeof(wchar_t) == 2)
+                {
+#if defined(NGBTOOLS_UNICODE_SSE2)
+                    const auto low{ _mm_loadu_si128(reinterpret_cast<const __m128i*>(input)) };
+                    const auto high{ _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + 8)) };
+                    const auto non_ascii_bits{ _mm_and_si128(_mm_or_si128(low, high), _mm_set1_epi16(static_cast<short>(0xFF80))) };
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(non_ascii_bits, _mm_setzero_si128())) != 0xFFFF)
+                        return false;
+
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(output), _mm_packus_epi16(low, high));
+                    return true;
+#elif defined(NGBTOOLS_UNICODE_NEON)
+                    const auto low{ vld1q_u16(reinterpret_cast<const uint16_t*>(input)) };
+                    const auto high{ vld1q_u16(reinterpret_cast<const uint16_t*>(input + 8)) };
+                    if (vmaxvq_u16(vorrq_u16(low, high)) >= 0x80)
+                        return false;
+
+                    vst1q_u8(reinterpret_cast<uint8_t*>(output), vcombine_u8(vmovn_u16(low), vmovn_u16(high)));
+                    return true;
+#endif
+                }
+                if (!is_ascii_block(input))
+                    return false;
+
+                for (size_t i = 0; i < ASCII_BLOCK_SIZE; ++i)
+                {
+                    output[i] = static_cast<char>(input[i]);
+                }
+                return true;
+            }
+
+            inline bool is_continuation(unsigned char c)
+            {
+                return (c & 0xC0) == 0x80;
+            }
+
+            /// <summary>
+            /// Decodes the multibyte sequence at p and moves p past it. An invalid sequence gives U+FFFD and is
+            /// skipped up to the first byte that cannot continue it (the "maximal subpart" of the Unicode standard).
+            /// </summary>
+            inline char32_t decode_utf8(const unsigned char*& p, const unsigned char* end)
+            {
+                const auto lead{ *p++ };
+                size_t continuation_bytes;
+                char32_t code_point;
+                unsigned char lowest_second{ 0x80 };
+                unsigned char highest_second{ 0xBF };
+                if ((lead >= 0xC2) && (lead <= 0xDF))
+                {
+                    continuation_bytes = 1;
+                    code_point = lead & 0x1F;
+                }
+                else if ((lead >= 0xE0) && (lead <= 0xEF))
+                {
+                    continuation_bytes = 2;
+                    code_point = lead & 0x0F;
+                    // no overlong encodings, no surrogates
+                    if (lead == 0xE0)
+                        lowest_second = 0xA0;
+                    else if (lead == 0xED)
+                        highest_second = 0x9F;
+                }
+                else if ((lead >= 0xF0) && (lead <= 0xF4))
+                {
+                    continuation_bytes = 3;
+                    code_point = lead & 0x07;
+                    // no overlong encodings, nothing beyond U+10FFFF
+                    if (lead == 0xF0)
+                        lowest_second = 0x90;
+                    else if (lead == 0xF4)
+                        highest_second = 0x8F;
+                }
+                else
+                {
+                    return REPLACEMENT_CHARACTER;
+                }
+
+                for (size_t i = 0; i < continuation_bytes; ++i)
+                {
+                    if (p == end)
+                        return REPLACEMENT_CHARACTER;
+
+                    const auto c{ *p };
+                    const bool is_valid{ (i == 0) ? ((c >= lowest_second) && (c <= highest_second)) : is_continuation(c) };
+                    if (!is_valid)
+                        return REPLACEMENT_CHARACTER;
+
+                    code_point = (code_point << 6) | (c & 0x3F);
+                    ++p;
+                }
+                return code_point;
+            }
+
+            inline bool is_high_surrogate(char32_t c)
+            {
+                return (c >= 0xD800) && (c <= 0xDBFF);
+            }
+
+            inline bool is_low_surrogate(char32_t c)
+            {
+                return (c >= 0xDC00) && (c <= 0xDFFF);
+            }
+
+            /// <summary>
+            /// Decodes the code point at p, which may be a surrogate pair, and moves p past it.
+            /// </summary>
+            inline char32_t decode_utf16(const wchar_t*& p, const wchar_t* end)
+            {
+                const char32_t unit{ static_cast<char32_t>(*p++) & 0xFFFF };
+                if (is_high_surrogate(unit))
+                {
+                    if ((p != end) && is_low_surrogate(static_cast<char32_t>(*p) & 0xFFFF))
+                    {
+                        const char32_t low{ static_cast<char32_t>(*p++) & 0xFFFF };
+                        return 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    return REPLACEMENT_CHARACTER;
+                }
+                if (is_low_surrogate(unit))
+                    return REPLACEMENT_CHARACTER;
+
+                return unit;
+            }
+
+            inline size_t utf8_length(char32_t code_point)
+            {
+                if (code_point < 0x80)
+                    return 1;
+                if (code_point < 0x800)
+                    return 2;
+                if (code_point < 0x10000)
+                    return 3;
+                return 4;
+            }
+        }
+
+        /// <summary>
+        /// Number of UTF-16 code units needed for the UTF-8 encoded text.
+        /// </summary>
+        inline size_t utf16_length(std::string_view utf8_encoded_text)
+        {
+            auto p{ reinterpret_cast<const unsigned char*>(utf8_encoded_text.data()) };
+            const auto end{ p + utf8_encoded_text.size() };
+            size_t result{ 0 };
+            while (p != end)
+            {
+                if ((static_cast<size_t>(end - p) >= detail::ASCII_BLOCK_SIZE) && detail::is_ascii_block(p))
+                {
+                    p += detail::ASCII_BLOCK_SIZE;
+                    result += detail::ASCII_BLOCK_SIZE;
+                }
+                else if (*p < 0x80)
+                {
+                    ++p;
+                    ++result;
+                }
+                else
+                {
+                    result += (detail::decode_utf8(p, end) >= 0x10000) ? 2 : 1;
+                }
+            }
+            return result;
+        }
+
+        /// <summary>
+        /// Number of bytes needed for the UTF-8 encoding of the UTF-16 text.
+        /// </summary>
+        inline size_t utf8_length(std::wstring_view utf16_encoded_text)
+        {
+            auto p{ utf16_encoded_text.data() };
+            const auto end{ p + utf16_encoded_text.size() };
+            size_t result{ 0 };
+            while (p != end)
+            {
+                if ((static_cast<size_t>(end - p) >= detail::ASCII_BLOCK_SIZE) && detail::is_ascii_block(p))
+                {
+                    p += detail::ASCII_BLOCK_SIZE;
+                    result += detail::ASCII_BLOCK_SIZE;
+                }
+                else
+                {
+                    result += detail::utf8_length(detail::decode_utf16(p, end));
+                }
+            }
+            return result;
+        }
+
+        /// <summary>
+        /// Writes the UTF-16 encoding of the text to output, which must have room for utf16_length(text) code units.
+        /// No terminating zero is written. Returns the number of code units written.
+        /// </summary>
+        inline size_t encode_as_utf16(std::string_view utf8_encoded_text, wchar_t* output)
+        {
+            auto p{ reinterpret_cast<const unsigned char*>(utf8_encoded_text.data()) };
+            const auto end{ p + utf8_encoded_text.size() };
+            const auto start_of_output{ output };
+            while (p != end)
+            {
+                if ((static_cast<size_t>(end - p) >= detail::ASCII_BLOCK_SIZE) && detail::widen_ascii_block(p, output))
+                {
+                    p += detail::ASCII_BLOCK_SIZE;
+                    output += detail::ASCII_BLOCK_SIZE;
+                    continue;
+                }
+
+                // a block that is not all ASCII: convert up to its end one code point at a time
+                const auto end_of_block{ p + std::min<size_t>(end - p, detail::ASCII_BLOCK_SIZE) };
+                while (p < end_of_block)
+                {
+                    if (*p < 0x80)
+                    {
+                        *(output++) = *(p++);
+                        continue;
+                    }
+                    const auto code_point{ detail::decode_utf8(p, end) };
+                    if (code_point >= 0x10000)
+                    {
+                        *(output++) = static_cast<wchar_t>(0xD800 + ((code_point - 0x10000) >> 10));
+                        *(output++) = static_cast<wchar_t>(0xDC00 + ((code_point - 0x10000) & 0x3FF));
+                    }
+                    else
+                    {
+                        *(output++) = static_cast<wchar_t>(code_point);
+                    }
+                }
+            }
+            return output - start_of_output;
+        }
+
+        /// <summary>
+        /// Writes the UTF-8 encoding of the text to output, which must have room for utf8_length(text) bytes.
+        /// No terminating zero is written. Returns the number of bytes written.
+        /// </summary>
+        inline size_t encode_as_utf8(std::wstring_view utf16_encoded_text, char* output)
+        {
+            auto p{ utf16_encoded_text.data() };
+            const auto end{ p + utf16_encoded_text.size() };
+            const auto start_of_output{ output };
+            while (p != end)
+            {
+                if ((static_cast<size_t>(end - p) >= detail::ASCII_BLOCK_SIZE) && detail::narrow_ascii_block(p, output))
+                {
+                    p += detail::ASCII_BLOCK_SIZE;
+                    output += detail::ASCII_BLOCK_SIZE;
+                    continue;
+                }
+
+                const auto end_of_block{ p + std::min<size_t>(end - p, detail::ASCII_BLOCK_SIZE) };
+                while (p < end_of_block)
+                {
+                    const auto code_point{ detail::decode_utf16(p, end) };
+                    if (code_point < 0x80)
+                    {
+                        *(output++) = static_cast<char>(code_point);
+                    }
+                    else if (code_point < 0x800)
+                    {
+                        *(output++) = static_cast<char>(0xC0 | (code_point >> 6));
+                        *(output++) = static_cast<char>(0x80 | (code_point & 0x3F));
+                    }
+                    else if (code_point < 0x10000)
+                    {
+                        *(output++) = static_cast<char>(0xE0 | (code_point >> 12));
+                        *(output++) = static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+                        *(output++) = static_cast<char>(0x80 | (code_point & 0x3F));
+                    }
+                    else
+                    {
+                        *(output++) = static_cast<char>(0xF0 | (code_point >> 18));
+                        *(output++) = static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+                        *(output++) = static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+                        *(output++) = static_cast<char>(0x80 | (code_point & 0x3F));
+                    }
+                }
+            }
+            return output - start_of_output;
+        }
+
+        inline std::wstring encode_as_utf16(std::string_view utf8_encoded_text)
+        {
+            std::wstring result(utf16_length(utf8_encoded_text), L'\0');
+            const auto written{ encode_as_utf16(utf8_encoded_text, result.data()) };
+            assert(written == result.size());
+            (void)written;
+            return result;
+        }
+
+        inline std::string encode_as_utf8(std::wstring_view utf16_encoded_text)
+        {
+            std::string result(utf8_length(utf16_encoded_text), '\0');
+            const auto written{ encode_as_utf8(utf16_encoded_text, result.data()) };
+            assert(written == result.size());
+            (void)written;
+            return result;
+        }
+    }
+}
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ngbtools
+{
+    /// <summary>
+    /// Which of the tasks in its own queue a worker of a work_stealing_pool runs next
+    /// </summary>
+    enum class task_order
+    {
+        /// <summary>the newest: best for recursive work such as walking directories, where the newest task continues what was just done</summary>
+        NEWEST_FIRST,
+
+        /// <summary>the oldest: tasks run roughly in the order they were submitted, so submitting the largest first keeps every worker busy until the end</summary>
+        OLDEST_FIRST,
+    };
+
+    /// <summary>
+    /// A small work-stealing thread pool. Every worker owns a task queue: it takes work from its own queue
+    /// (from the back or the front, see task_order), and once that runs dry it steals from the front of the
+    /// queues of the other workers. Each task is passed the index of the worker running it, so callers can
+    /// keep per-worker state (for example I/O buffers) without any locking of their own.
+    /// </summary>
+    class work_stealing_pool final
+    {
+    public:
+        typedef std::function<void(size_t worker_index)> task;
+
+        explicit work_stealing_pool(size_t number_of_workers, task_order order = task_order::NEWEST_FIRST)
+            :
+            m_order{ order },
+            m_next_queue{ 0 },
+            m_queued{ 0 },
+            m_pending{ 0 },
+            m_stopping{ false }
+        {
+            if (!number_of_workers)
+                number_of_workers = 1;
+
+            for (size_t index = 0; index < number_of_workers; ++index)
+            {
+                m_queues.push_back(std::make_unique<worker_queue>());
+            }
+            for (size_t index = 0; index < number_of_workers; ++index)
+            {
+                m_workers.emplace_back([this, index]() { run_worker(index); });
+            }
+        }
+
+        ~work_stealing_pool()
+        {
+            {
+                std::unique_lock<std::mutex> lock{ m_idle_lock };
+                m_stopping = true;
+            }
+            m_work_available.notify_all();
+            for (auto& worker : m_workers)
+            {
+                worker.join();
+            }
+        }
+
+    private:
+        work_stealing_pool(const work_stealing_pool&) = delete;
+        work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+        work_stealing_pool(work_stealing_pool&&) = delete;
+        work_stealing_pool& operator=(work_stealing_pool&&) = delete;
+
+    public:
+        /// <summary>
+        /// Number of threads to use if the caller has no better idea
+        /// </summary>
+        static size_t default_number_of_workers()
+        {
+            const auto result{ std::thread::hardware_concurrency() };
+            return result ? result : 1;
+        }
+
+        size_t size() const
+        {
+            return m_workers.size();
+        }
+
+        /// <summary>
+        /// Number of tasks submitted but not yet picked up by a worker. This is a snapshot: other threads may change it any time.
+        /// </summary>
+        size_t number_of_queued_tasks() const
+        {
+            return m_queued;
+        }
+
+        /// <summary>
+        /// Queue a task, distributing tasks round-robin over the worker queues
+        /// </summary>
+        void submit(task t)
+        {
+            submit(m_next_queue++ % m_queues.size(), std::move(t));
+        }
+
+        /// <summary>
+        /// Queue a task for a specific worker. Other workers may still steal it if they run out of work.
+        /// </summary>
+        void submit(size_t worker_index, task t)
+        {
+            assert(worker_index < m_queues.size());
+            auto& queue{ *m_queues[worker_index] };
+            count_new_task();
+            {
+                std::unique_lock<std::mutex> lock{ queue.m_lock };
+                queue.m_tasks.push_back(std::move(t));
+            }
+            m_work_available.notify_one();
+        }
+
+        /// <summary>
+        /// Queue a task ahead of the tasks already queued, for work that someone is waiting for. With
+        /// task_order::OLDEST_FIRST any idle worker picks it up next; with task_order::NEWEST_FIRST only
+        /// the worker that owns the queue does.
+        /// </summary>
+        void submit_first(task t)
+        {
+            auto& queue{ *m_queues[m_next_queue++ % m_queues.size()] };
+            count_new_task();
+            {
+                std::unique_lock<std::mutex> lock{ queue.m_lock };
+                if (m_order == task_order::OLDEST_FIRST)
+                {
+                    queue.m_tasks.push_front(std::move(t));
+                }
+                else
+                {
+                    queue.m_tasks.push_back(std::move(t));
+                }
+            }
+            m_work_available.notify_one();
+        }
+
+        /// <summary>
+        /// Blocks until every task submitted so far has finished running
+        /// </summary>
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock{ m_idle_lock };
+            m_all_done.wait(lock, [this]() { return m_pending == 0; });
+        }
+
+    private:
+        struct worker_queue
+        {
+            std::mutex m_lock;
+            std::deque<task> m_tasks;
+        };
+
+        // a task is counted before it is queued: once queued, another worker can steal it and finish it right
+        // away, and if that happened before it was counted, wait() could return while the task that submitted
+        // it is still running and submitting more. Until the task is queued, idle workers merely look again.
+        void count_new_task()
+        {
+            std::unique_lock<std::mutex> lock{ m_idle_lock };
+            ++m_queued;
+            ++m_pending;
+        }
+
+        bool pop_own_task(size_t worker_index, task& result)
+        {
+            auto& queue{ *m_queues[worker_index] };
+            std::unique_lock<std::mutex> lock{ queue.m_lock };
+            if (queue.m_tasks.empty())
+                return false;
+
+            if (m_order == task_order::OLDEST_FIRST)
+            {
+                result = std::move(queue.m_tasks.front());
+                queue.m_tasks.pop_front();
+            }
+            else
+            {
+                result = std::move(queue.m_tasks.back());
+                queue.m_tasks.pop_back();
+            }
+            return true;
+        }
+
+        bool steal_task(size_t worker_index, task& result)
+        {
+            for (size_t offset = 1; offset < m_queues.size(); ++offset)
+            {
+                auto& queue{ *m_queues[(worker_index + offset) % m_queues.size()] };
+                std::unique_lock<std::mutex> lock{ queue.m_lock };
+                if (!queue.m_tasks.empty())
+                {
+                    result = std::move(queue.m_tasks.front());
+                    queue.m_tasks.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void run_worker(size_t worker_index)
+        {
+            for (;;)
+            {
+                task current_task;
+                if (pop_own_task(worker_index, current_task) || steal_task(worker_index, current_task))
+                {
+                    --m_queued;
+                    current_task(worker_index);
+
+                    std::unique_lock<std::mutex> lock{ m_idle_lock };
+                    if (--m_pending == 0)
+                    {
+                        m_all_done.notify_all();
+                    }
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock{ m_idle_lock };
+                m_work_available.wait(lock, [this]() { return m_stopping || (m_queued > 0); });
+                if (m_stopping && (m_queued == 0))
+                    return;
+            }
+        }
+
+    private:
+        const task_order m_order;
+        std::vector<std::unique_ptr<worker_queue>> m_queues;
+        std::vector<std::thread> m_workers;
+        std::atomic<size_t> m_next_queue;
+
+        /// <summary>Tasks sitting in a queue, waiting for a worker</summary>
+        std::atomic<size_t> m_queued;
+
+        /// <summary>Tasks submitted but not yet finished (protected by m_idle_lock)</summary>
+        size_t m_pending;
+
+        bool m_stopping;
+        std::mutex m_idle_lock;
+        std::condition_variable m_work_available;
+        std::condition_variable m_all_done;
+    };
+}
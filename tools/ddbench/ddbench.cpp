@@ -0,0 +1,437 @@
+#include "precomp.h"
+
+namespace fs = std::filesystem;
+
+#include <ngbtools/hasher.h>
+#include <ngbtools/digest.h>
+#include <ngbtools/string.h>
+#include <ngbtools/wstring.h>
+#include <ngbtools/console.h>
+#include <ngbtools/string_writer.h>
+#include <ngbtools/cmdline_args.h>
+#include <ngbtools/logging.h>
+#include <ngbtools/windows_errors.h>
+#include <ngbtools/work_stealing_pool.h>
+#include <ngbtools/file_reader.h>
+
+#include "../ddupe/file_index.h"
+#include "../ddupe/directory_walker.h"
+#include "latency_histogram.h"
+#include "tree_generator.h"
+#include "writer_benchmark.h"
+
+namespace ngbtools
+{
+	/// <summary>
+	/// Generates a synthetic tree of files and runs the phases of ddupe on it one at a time, so that a change
+	/// to one phase can be measured without the noise of the others:
+	///
+	///		enumerate: list all folders, like ddupe does before anything else
+	///		bucket: sort the files by size and find the groups of files with the same size
+	///		hash: read and hash every file that has the same size as another file
+	///
+	/// With /WRITER, it runs the micro-benchmarks of writer_benchmark instead.
+	/// </summary>
+	class ddbench final
+	{
+	public:
+		ddbench()
+			:
+			m_keep{ false },
+			m_benchmark_writer{ false },
+			m_number_of_threads{ work_stealing_pool::default_number_of_workers() },
+			m_number_of_runs{ 3 },
+			m_read_method{ read_method::BUFFERED },
+			m_hash_algorithm{ hash_algorithm::FAST128 },
+			m_tree_settings{ 10000, 100, 10, 1024, 1024 * 1024, size_distribution::LOGUNIFORM, 25, 1 },
+			m_generate_microseconds{ 0 },
+			m_number_of_groups{ 0 },
+			m_enumerate{},
+			m_bucket{},
+			m_hash{}
+		{
+		}
+		~ddbench() = default;
+
+		int run(int argc, wchar_t* argv[])
+		{
+			cmdline_args args{
+				CONSOLE_FOREGROUND_GREEN "Benchmark the phases of ddupe on a synthetic tree - Version 5.0" CONSOLE_STANDARD "\r\n"
+				"Freeware written by NG Branch Technology GmbH (http://ng-branch-technology.com)",
+				"ddbench" };
+			std::string number_of_files{ std::to_string(m_tree_settings.number_of_files) };
+			args.add_option("FILES", number_of_files, "number of files to generate");
+			std::string files_per_folder{ std::to_string(m_tree_settings.files_per_folder) };
+			args.add_option("FILESPERFOLDER", files_per_folder, "number of files in each folder");
+			std::string subfolders_per_folder{ std::to_string(m_tree_settings.subfolders_per_folder) };
+			args.add_option("SUBFOLDERS", subfolders_per_folder, "number of subfolders in each folder");
+			std::string minimum_size{ std::to_string(m_tree_settings.minimum_size) };
+			args.add_option("MINSIZE", minimum_size, "size of the smallest file in bytes");
+			std::string maximum_size{ std::to_string(m_tree_settings.maximum_size) };
+			args.add_option("MAXSIZE", maximum_size, "size of the largest file in bytes");
+			std::string distribution_name{ tree_generator::name(m_tree_settings.distribution) };
+			args.add_option("SIZES", distribution_name, "how sizes are distributed: LOGUNIFORM or UNIFORM");
+			std::string duplicate_percent{ std::to_string(m_tree_settings.duplicate_percent) };
+			args.add_option("DUPLICATES", duplicate_percent, "percentage of files that are duplicates");
+			std::string seed{ std::to_string(m_tree_settings.seed) };
+			args.add_option("SEED", seed, "the same seed always generates the same tree");
+			args.add_option("ROOT", m_root, "folder for the tree, by default a new folder in %TEMP%");
+			args.add_flag("KEEP", m_keep, "keep the tree when done");
+			std::string number_of_runs{ std::to_string(m_number_of_runs) };
+			args.add_option("RUNS", number_of_runs, "number of times each phase is run");
+			std::string number_of_threads{ std::to_string(m_number_of_threads) };
+			args.add_option("THREADS", number_of_threads, "number of threads used for scanning and hashing");
+			std::string read_method_name{ "BUFFERED" };
+			args.add_option("READ", read_method_name, "how files are read: BUFFERED, MAPPED, UNBUFFERED or OVERLAPPED");
+			std::string hash_algorithm_name{ hasher::name(m_hash_algorithm) };
+			args.add_option("HASH", hash_algorithm_name, "checksum algorithm: FAST128, MD5 or BLAKE3");
+			args.add_option("OUTPUT", m_output_filename, "write the results to this file instead of the console");
+			args.add_flag("WRITER", m_benchmark_writer, "benchmark appending to string writers instead of the phases of ddupe");
+
+			if (!args.parse(argc, argv))
+				return 20;
+
+			uint64_t threads = 0;
+			uint64_t runs = 0;
+			if (!parse_number(number_of_files, "FILES", 1, m_tree_settings.number_of_files) ||
+				!parse_number(files_per_folder, "FILESPERFOLDER", 1, m_tree_settings.files_per_folder) ||
+				!parse_number(subfolders_per_folder, "SUBFOLDERS", 2, m_tree_settings.subfolders_per_folder) ||
+				!parse_number(minimum_size, "MINSIZE", 0, m_tree_settings.minimum_size) ||
+				!parse_number(maximum_size, "MAXSIZE", m_tree_settings.minimum_size, m_tree_settings.maximum_size) ||
+				!parse_number(duplicate_percent, "DUPLICATES", 0, m_tree_settings.duplicate_percent) ||
+				!parse_number(seed, "SEED", 0, m_tree_settings.seed) ||
+				!parse_number(number_of_runs, "RUNS", 1, runs) ||
+				!parse_number(number_of_threads, "THREADS", 1, threads))
+			{
+				return 20;
+			}
+			m_number_of_runs = (size_t)runs;
+			m_number_of_threads = (size_t)threads;
+			if (m_tree_settings.duplicate_percent > 100)
+			{
+				console::writeline(CONSOLE_FOREGROUND_RED "The /DUPLICATES option must be a percentage between 0 and 100" CONSOLE_STANDARD);
+				return 20;
+			}
+			if (!tree_generator::parse_distribution(distribution_name, m_tree_settings.distribution))
+			{
+				console::writeline(CONSOLE_FOREGROUND_RED "The /SIZES option must be one of LOGUNIFORM or UNIFORM" CONSOLE_STANDARD);
+				return 20;
+			}
+			if (!file_reader::parse_method(read_method_name, m_read_method))
+			{
+				console::writeline(CONSOLE_FOREGROUND_RED "The /READ option must be one of BUFFERED, MAPPED, UNBUFFERED or OVERLAPPED" CONSOLE_STANDARD);
+				return 20;
+			}
+			if (!hasher::parse_algorithm(hash_algorithm_name, m_hash_algorithm))
+			{
+				console::writeline(CONSOLE_FOREGROUND_RED "The /HASH option must be one of FAST128, MD5 or BLAKE3" CONSOLE_STANDARD);
+				return 20;
+			}
+			if (m_benchmark_writer)
+			{
+				return write_results(benchmark_writer());
+			}
+			if (m_root.empty())
+			{
+				m_root = default_root();
+			}
+
+			tree_generator generator{ m_tree_settings };
+			console::formatline("Generating {:L} files ({:L} bytes) in {}", m_tree_settings.number_of_files, generator.total_bytes(), m_root);
+			const auto start = std::chrono::high_resolution_clock::now();
+			const bool generated{ generator.generate(m_root, m_number_of_threads) };
+			m_generate_microseconds = microseconds_since(start);
+			if (generated)
+			{
+				for (size_t run = 0; run < m_number_of_runs; ++run)
+				{
+					console::formatline("Run {} of {}", run + 1, m_number_of_runs);
+					run_phases();
+				}
+			}
+			else
+			{
+				console::writeline(CONSOLE_FOREGROUND_RED "Unable to generate the tree" CONSOLE_STANDARD);
+			}
+
+			if (!m_keep)
+			{
+				std::error_code ec;
+				fs::remove_all(string::encode_as_utf16(m_root), ec);
+			}
+			if (!generated)
+				return 10;
+
+			return write_results(results_as_json(generator));
+		}
+
+	private:
+		ddbench(const ddbench&) = delete;
+		ddbench& operator=(const ddbench&) = delete;
+		ddbench(ddbench&&) = delete;
+		ddbench& operator=(ddbench&&) = delete;
+
+		/// <summary>
+		/// What was measured for one phase, summed up over all runs
+		/// </summary>
+		struct phase_result
+		{
+			uint64_t files;
+			uint64_t bytes;
+			uint64_t microseconds;
+			uint64_t peak_working_set;
+
+			// duration of each run
+			latency_histogram runs;
+		};
+
+		/// <summary>
+		/// Per-thread state of the hash phase
+		/// </summary>
+		struct worker_state
+		{
+			std::unique_ptr<file_reader> reader;
+			std::unique_ptr<hasher> hash;
+			latency_histogram latency;
+			uint64_t bytes;
+		};
+
+		void run_phases()
+		{
+			file_index files;
+
+			auto start = std::chrono::high_resolution_clock::now();
+			directory_walker walker{ m_number_of_threads };
+			walker.walk({ string::encode_as_utf16(m_root) }, true, files);
+			finish_phase(m_enumerate, start, files.size(), 0);
+
+			start = std::chrono::high_resolution_clock::now();
+			files.sort_by_size();
+			const auto groups{ files.groups(2) };
+			finish_phase(m_bucket, start, files.size(), 0);
+			m_number_of_groups = groups.size();
+
+			start = std::chrono::high_resolution_clock::now();
+			const auto buffer_size{ std::max(TOTAL_BUFFER_SIZE / m_number_of_threads, MINIMUM_BUFFER_SIZE_PER_THREAD) };
+			std::vector<worker_state> workers(m_number_of_threads);
+			uint64_t files_hashed = 0;
+			{
+				work_stealing_pool pool{ m_number_of_threads };
+				for (const auto& group : groups)
+				{
+					for (size_t index = group.first; index < group.first + group.count; ++index)
+					{
+						pool.submit([this, &files, &workers, index, buffer_size](size_t worker_index)
+							{
+								hash_file(files, files[index], workers[worker_index], buffer_size);
+							});
+					}
+					files_hashed += group.count;
+				}
+				pool.wait();
+			}
+			uint64_t bytes_hashed = 0;
+			for (const auto& worker : workers)
+			{
+				m_file_latency.merge(worker.latency);
+				bytes_hashed += worker.bytes;
+			}
+			finish_phase(m_hash, start, files_hashed, bytes_hashed);
+		}
+
+		// this is called on the worker threads
+		void hash_file(const file_index& files, const file_index::file_record& record, worker_state& worker, size_t buffer_size) const
+		{
+			if (!worker.reader)
+			{
+				worker.reader = file_reader::create(m_read_method, buffer_size);
+				worker.hash = hasher::create(m_hash_algorithm);
+				worker.bytes = 0;
+			}
+
+			const auto start = std::chrono::high_resolution_clock::now();
+			worker.hash->reset();
+			if (worker.reader->read(wstring::encode_as_utf8(files.path(record).wstring()), record.size,
+				[&worker](const unsigned char* data, size_t size)
+				{
+					worker.hash->update(data, size);
+				}))
+			{
+				worker.hash->finalize_as_digest();
+				worker.bytes += record.size;
+			}
+			worker.latency.add(microseconds_since(start));
+		}
+
+		static void finish_phase(phase_result& result, std::chrono::high_resolution_clock::time_point start, uint64_t files, uint64_t bytes)
+		{
+			const auto microseconds{ microseconds_since(start) };
+			result.files += files;
+			result.bytes += bytes;
+			result.microseconds += microseconds;
+			result.runs.add(microseconds);
+			result.peak_working_set = peak_working_set();
+		}
+
+		std::string results_as_json(const tree_generator& generator) const
+		{
+			string::writer output;
+			output.append(fmt::format("{{\"version\":1,\"settings\":{{\"threads\":{},\"runs\":{},\"read\":\"{}\",\"hash\":\"{}\"}}",
+				m_number_of_threads,
+				m_number_of_runs,
+				file_reader::name(m_read_method),
+				hasher::name(m_hash_algorithm)));
+			output.append(fmt::format(",\"tree\":{{\"files\":{},\"folders\":{},\"bytes\":{},\"duplicates\":{},\"minimum_size\":{},\"maximum_size\":{},\"sizes\":\"{}\",\"seed\":{},\"groups\":{}}}",
+				m_tree_settings.number_of_files,
+				generator.number_of_folders(),
+				generator.total_bytes(),
+				generator.number_of_duplicates(),
+				m_tree_settings.minimum_size,
+				m_tree_settings.maximum_size,
+				tree_generator::name(m_tree_settings.distribution),
+				m_tree_settings.seed,
+				m_number_of_groups));
+			output.append(fmt::format(",\"phases\":{{\"generate\":{{\"microseconds\":{}}}", m_generate_microseconds));
+			write_phase_json(output, "enumerate", m_enumerate);
+			write_phase_json(output, "bucket", m_bucket);
+			write_phase_json(output, "hash", m_hash);
+			output.append(",\"file_latency_us\":");
+			m_file_latency.write_json(output);
+			output.append("}}");
+			return output.as_string();
+		}
+
+		static void write_phase_json(string::writer& output, std::string_view name, const phase_result& result)
+		{
+			const auto seconds{ std::max(result.microseconds, (uint64_t)1) / 1000000.0 };
+			output.append(fmt::format(",\"{}\":{{\"files\":{},\"microseconds\":{},\"files_per_second\":{:.0f}",
+				name,
+				result.files,
+				result.microseconds,
+				result.files / seconds));
+			if (result.bytes)
+			{
+				output.append(fmt::format(",\"bytes\":{},\"mb_per_second\":{:.1f}", result.bytes, result.bytes / seconds / (1024 * 1024)));
+			}
+			output.append(fmt::format(",\"peak_working_set\":{},\"latency_us\":", result.peak_working_set));
+			result.runs.write_json(output);
+		}
+
+		std::string benchmark_writer() const
+		{
+			writer_benchmark benchmark;
+			for (size_t run = 0; run < m_number_of_runs; ++run)
+			{
+				console::formatline("Run {} of {}", run + 1, m_number_of_runs);
+				benchmark.run();
+			}
+
+			string::writer output;
+			output.append_formatted("{{\"version\":1,\"settings\":{{\"runs\":{}}},\"total_size\":{},\"writer\":",
+				m_number_of_runs,
+				benchmark.total_size());
+			benchmark.write_json(output);
+			output.append('}');
+			return output.as_string();
+		}
+
+		int write_results(const std::string& json) const
+		{
+			if (m_output_filename.empty())
+			{
+				console::writeline(json);
+			}
+			else if (!write_text_file(m_output_filename, json))
+			{
+				return 10;
+			}
+			return 0;
+		}
+
+		static bool parse_number(const std::string& text, std::string_view option, uint64_t minimum, uint64_t& result)
+		{
+			bool succeeded = true;
+			try
+			{
+				result = std::stoull(text);
+			}
+			catch (...)
+			{
+				succeeded = false;
+			}
+			if (!succeeded || (result < minimum))
+			{
+				console::formatline(CONSOLE_FOREGROUND_RED "You must pass a number of at least {} to the /{} option" CONSOLE_STANDARD, minimum, option);
+				return false;
+			}
+			return true;
+		}
+
+		static std::string default_root()
+		{
+			wchar_t buffer[MAX_PATH];
+			const auto length{ ::GetTempPathW((DWORD)std::size(buffer), buffer) };
+			const std::string temp{ (length && (length < std::size(buffer))) ? wstring::encode_as_utf8(std::wstring_view{ buffer, length }) : ".\\" };
+			return fmt::format("{}ddbench-{}", temp, ::GetCurrentProcessId());
+		}
+
+		static bool write_text_file(const std::string& pathname, const std::string& text)
+		{
+			HANDLE hFile = ::CreateFileW(string::encode_as_utf16(pathname).c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, 0);
+			if (hFile == INVALID_HANDLE_VALUE)
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("CreateFileW({}) failed", pathname));
+				return false;
+			}
+			DWORD bytes_written = 0;
+			const bool succeeded{ ::WriteFile(hFile, text.data(), (DWORD)text.size(), &bytes_written, nullptr) && (bytes_written == text.size()) };
+			if (!succeeded)
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("WriteFile({}) failed", pathname));
+			}
+			::CloseHandle(hFile);
+			return succeeded;
+		}
+
+		static uint64_t microseconds_since(std::chrono::high_resolution_clock::time_point start)
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+
+		static uint64_t peak_working_set()
+		{
+			PROCESS_MEMORY_COUNTERS counters{};
+			if (!::GetProcessMemoryInfo(::GetCurrentProcess(), &counters, sizeof(counters)))
+				return 0;
+			return counters.PeakWorkingSetSize;
+		}
+
+	private:
+		bool m_keep;
+		bool m_benchmark_writer;
+		size_t m_number_of_threads;
+		size_t m_number_of_runs;
+		read_method m_read_method;
+		hash_algorithm m_hash_algorithm;
+		tree_generator::settings m_tree_settings;
+		std::string m_root;
+		std::string m_output_filename;
+		uint64_t m_generate_microseconds;
+		size_t m_number_of_groups;
+		phase_result m_enumerate;
+		phase_result m_bucket;
+		phase_result m_hash;
+		latency_histogram m_file_latency;
+
+		// the same read buffers ddupe uses: 64 MB shared by all threads, but at least 4 MB each
+		static constexpr size_t TOTAL_BUFFER_SIZE = 1024 * 1024 * 64;
+		static constexpr size_t MINIMUM_BUFFER_SIZE_PER_THREAD = 1024 * 1024 * 4;
+	};
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+	return ngbtools::ddbench().run(argc, argv);
+}
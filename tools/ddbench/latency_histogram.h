@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <string>
+
+#include <ngbtools/string_writer.h>
+
+namespace ngbtools
+{
+	/// <summary>
+	/// Latencies in microseconds, counted in power-of-two buckets: bucket N counts all samples below 2^N
+	/// that did not fit into bucket N-1. That is precise enough to spot a regression, and adding a sample
+	/// costs next to nothing, so every file can be measured. Not thread-safe: use one per thread and merge().
+	/// </summary>
+	class latency_histogram final
+	{
+	public:
+		latency_histogram()
+			:
+			m_buckets{},
+			m_count{ 0 },
+			m_sum{ 0 },
+			m_minimum{ std::numeric_limits<uint64_t>::max() },
+			m_maximum{ 0 }
+		{
+		}
+
+		void add(uint64_t microseconds)
+		{
+			++m_buckets[bucket_of(microseconds)];
+			++m_count;
+			m_sum += microseconds;
+			m_minimum = std::min(m_minimum, microseconds);
+			m_maximum = std::max(m_maximum, microseconds);
+		}
+
+		void merge(const latency_histogram& other)
+		{
+			for (size_t index = 0; index < NUMBER_OF_BUCKETS; ++index)
+			{
+				m_buckets[index] += other.m_buckets[index];
+			}
+			m_count += other.m_count;
+			m_sum += other.m_sum;
+			m_minimum = std::min(m_minimum, other.m_minimum);
+			m_maximum = std::max(m_maximum, other.m_maximum);
+		}
+
+		uint64_t count() const
+		{
+			return m_count;
+		}
+
+		/// <summary>
+		/// Get the upper bound of the bucket that holds the given percentile of all samples
+		/// </summary>
+		/// <param name="percent">0..100</param>
+		uint64_t percentile(double percent) const
+		{
+			if (!m_count)
+				return 0;
+
+			const auto wanted{ std::max<uint64_t>(1, (uint64_t)(m_count * percent / 100.0 + 0.5)) };
+			uint64_t seen = 0;
+			for (size_t index = 0; index < NUMBER_OF_BUCKETS; ++index)
+			{
+				seen += m_buckets[index];
+				if (seen >= wanted)
+					return std::min(upper_bound_of(index), m_maximum);
+			}
+			return m_maximum;
+		}
+
+		/// <summary>
+		/// Write the histogram as a JSON object. Only buckets up to the highest one used are written.
+		/// </summary>
+		void write_json(string::writer& output) const
+		{
+			output.append(fmt::format("{{\"count\":{},\"min\":{},\"max\":{},\"mean\":{},\"p50\":{},\"p90\":{},\"p99\":{},\"buckets\":[",
+				m_count,
+				m_count ? m_minimum : 0,
+				m_maximum,
+				m_count ? m_sum / m_count : 0,
+				percentile(50),
+				percentile(90),
+				percentile(99)));
+
+			const auto used{ m_count ? bucket_of(m_maximum) + 1 : 0 };
+			for (size_t index = 0; index < used; ++index)
+			{
+				if (index)
+				{
+					output.append(',');
+				}
+				output.append(fmt::format("{{\"below\":{},\"count\":{}}}", upper_bound_of(index), m_buckets[index]));
+			}
+			output.append("]}");
+		}
+
+	private:
+		static size_t bucket_of(uint64_t microseconds)
+		{
+			size_t index = 0;
+			while ((index < NUMBER_OF_BUCKETS - 1) && (microseconds >= upper_bound_of(index)))
+				++index;
+			return index;
+		}
+
+		static uint64_t upper_bound_of(size_t bucket)
+		{
+			return 1ull << bucket;
+		}
+
+	private:
+		// the last bucket starts at about 18 minutes
+		static constexpr size_t NUMBER_OF_BUCKETS = 31;
+
+		std::array<uint64_t, NUMBER_OF_BUCKETS> m_buckets;
+		uint64_t m_count;
+		uint64_t m_sum;
+		uint64_t m_minimum;
+		uint64_t m_maximum;
+	};
+}
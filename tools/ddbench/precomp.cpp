@@ -0,0 +1 @@
+#include "precomp.h"
\ No newline at end of file
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <ngbtools/string.h>
+#include <ngbtools/logging.h>
+#include <ngbtools/windows_errors.h>
+#include <ngbtools/work_stealing_pool.h>
+
+namespace ngbtools
+{
+	/// <summary>
+	/// How file sizes are spread between the minimum and the maximum size
+	/// </summary>
+	enum class size_distribution
+	{
+		/// <summary>as many files between 1 KB and 2 KB as between 1 MB and 2 MB: small files are the most common, like on a real disk</summary>
+		LOGUNIFORM,
+
+		/// <summary>every size is equally likely, so most bytes are in large files</summary>
+		UNIFORM,
+	};
+
+	/// <summary>
+	/// Creates a tree of files with pseudo-random contents, for benchmarking. The same settings always create
+	/// the same tree, so numbers measured on different builds can be compared.
+	///
+	/// Files are spread evenly over folders, and folders are nested: folder N is a subfolder of folder
+	/// N / subfolders_per_folder, with folder 0 being the root. A duplicate gets the size and contents of a
+	/// random earlier file, and may end up in any folder.
+	/// </summary>
+	class tree_generator final
+	{
+	public:
+		struct settings
+		{
+			uint64_t number_of_files;
+			uint64_t files_per_folder;
+			uint64_t subfolders_per_folder;
+			uint64_t minimum_size;
+			uint64_t maximum_size;
+			size_distribution distribution;
+
+			// 0..100: how many of the files are duplicates of another file
+			uint64_t duplicate_percent;
+			uint64_t seed;
+		};
+
+		explicit tree_generator(const settings& settings)
+			:
+			m_settings{ settings },
+			m_number_of_duplicates{ 0 },
+			m_total_bytes{ 0 }
+		{
+			plan();
+		}
+
+	private:
+		tree_generator(const tree_generator&) = delete;
+		tree_generator& operator=(const tree_generator&) = delete;
+		tree_generator(tree_generator&&) = delete;
+		tree_generator& operator=(tree_generator&&) = delete;
+
+	public:
+		/// <summary>
+		/// Write all files below root, which is created if needed. Existing files with the same names are overwritten.
+		/// </summary>
+		bool generate(const std::string& root, size_t number_of_threads)
+		{
+			for (uint64_t folder = 0; folder < number_of_folders(); ++folder)
+			{
+				// parents have lower numbers than their subfolders, so they are always created first
+				const auto pathname{ folder_pathname(root, folder) };
+				if (!::CreateDirectoryW(string::encode_as_utf16(pathname).c_str(), nullptr) && (GetLastError() != ERROR_ALREADY_EXISTS))
+				{
+					logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+						fmt::format("CreateDirectoryW({}) failed", pathname));
+					return false;
+				}
+			}
+
+			std::atomic<bool> succeeded{ true };
+			std::vector<std::vector<uint64_t>> buffers(number_of_threads);
+			work_stealing_pool pool{ number_of_threads };
+			for (uint64_t folder = 0; folder < number_of_folders(); ++folder)
+			{
+				pool.submit([this, &root, &succeeded, &buffers, folder](size_t worker_index)
+					{
+						auto& buffer{ buffers[worker_index] };
+						buffer.resize(BUFFER_SIZE / sizeof(uint64_t));
+
+						const auto first{ folder * m_settings.files_per_folder };
+						const auto last{ std::min(first + m_settings.files_per_folder, m_settings.number_of_files) };
+						for (auto index = first; index < last; ++index)
+						{
+							if (!write_file(file_pathname(root, index), m_files[index], buffer))
+							{
+								succeeded = false;
+							}
+						}
+					});
+			}
+			pool.wait();
+			return succeeded;
+		}
+
+		uint64_t number_of_folders() const
+		{
+			return std::max<uint64_t>(1, (m_settings.number_of_files + m_settings.files_per_folder - 1) / m_settings.files_per_folder);
+		}
+
+		uint64_t number_of_duplicates() const
+		{
+			return m_number_of_duplicates;
+		}
+
+		uint64_t total_bytes() const
+		{
+			return m_total_bytes;
+		}
+
+		static const char* name(size_distribution distribution)
+		{
+			return (distribution == size_distribution::UNIFORM) ? "UNIFORM" : "LOGUNIFORM";
+		}
+
+		static bool parse_distribution(std::string_view name, size_distribution& result)
+		{
+			for (const auto distribution : { size_distribution::LOGUNIFORM, size_distribution::UNIFORM })
+			{
+				if (string::equals_nocase(name, tree_generator::name(distribution)))
+				{
+					result = distribution;
+					return true;
+				}
+			}
+			return false;
+		}
+
+	private:
+		struct planned_file
+		{
+			uint64_t size;
+
+			// files with the same contents seed are duplicates
+			uint64_t contents_seed;
+		};
+
+		// decides the size and contents of every file up front, so that writing them can be spread over threads
+		void plan()
+		{
+			std::mt19937_64 random{ m_settings.seed };
+			const auto minimum{ (double)m_settings.minimum_size + 1 };
+			const auto maximum{ (double)m_settings.maximum_size + 1 };
+
+			m_files.reserve(m_settings.number_of_files);
+			for (uint64_t index = 0; index < m_settings.number_of_files; ++index)
+			{
+				planned_file file;
+				if (index && (random() % 100 < m_settings.duplicate_percent))
+				{
+					file = m_files[random() % index];
+					++m_number_of_duplicates;
+				}
+				else
+				{
+					const auto fraction{ std::uniform_real_distribution<double>{ 0.0, 1.0 }(random) };
+					const auto size{ (m_settings.distribution == size_distribution::LOGUNIFORM)
+						? std::exp(std::log(minimum) + fraction * (std::log(maximum) - std::log(minimum)))
+						: minimum + fraction * (maximum - minimum) };
+					file.size = std::min((uint64_t)size - 1, m_settings.maximum_size);
+					file.contents_seed = random();
+				}
+				m_total_bytes += file.size;
+				m_files.push_back(file);
+			}
+		}
+
+		std::string folder_pathname(const std::string& root, uint64_t folder) const
+		{
+			if (!folder)
+				return root;
+
+			return fmt::format("{}\\folder{}", folder_pathname(root, folder / m_settings.subfolders_per_folder), folder % m_settings.subfolders_per_folder);
+		}
+
+		std::string file_pathname(const std::string& root, uint64_t index) const
+		{
+			return fmt::format("{}\\file{}.bin", folder_pathname(root, index / m_settings.files_per_folder), index);
+		}
+
+		static bool write_file(const std::string& pathname, const planned_file& file, std::vector<uint64_t>& buffer)
+		{
+			HANDLE hFile = ::CreateFileW(string::encode_as_utf16(pathname).c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+			if (hFile == INVALID_HANDLE_VALUE)
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("CreateFileW({}) failed", pathname));
+				return false;
+			}
+
+			// xorshift64: fast, and random enough that no two files share a chunk by accident
+			auto state{ file.contents_seed | 1 };
+			for (uint64_t offset = 0; offset < file.size; )
+			{
+				const auto bytes_to_write{ (DWORD)std::min<uint64_t>(BUFFER_SIZE, file.size - offset) };
+				for (size_t index = 0; index < (bytes_to_write + sizeof(uint64_t) - 1) / sizeof(uint64_t); ++index)
+				{
+					state ^= state << 13;
+					state ^= state >> 7;
+					state ^= state << 17;
+					buffer[index] = state;
+				}
+				DWORD bytes_written = 0;
+				if (!::WriteFile(hFile, buffer.data(), bytes_to_write, &bytes_written, nullptr) || (bytes_written != bytes_to_write))
+				{
+					logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+						fmt::format("WriteFile({}) failed", pathname));
+					::CloseHandle(hFile);
+					return false;
+				}
+				offset += bytes_to_write;
+			}
+			::CloseHandle(hFile);
+			return true;
+		}
+
+	private:
+		static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+
+		const settings m_settings;
+		std::vector<planned_file> m_files;
+		uint64_t m_number_of_duplicates;
+		uint64_t m_total_bytes;
+	};
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <ngbtools/string_writer.h>
+#include <ngbtools/segmented_writer.h>
+
+#include "latency_histogram.h"
+
+namespace ngbtools
+{
+	/// <summary>
+	/// Micro-benchmarks for the string writers. Every case appends pieces of one kind to a new writer until
+	/// BYTES_PER_RUN bytes are written, so the time includes growing the writer - which is where string::writer
+	/// and string::segmented_writer differ most.
+	///
+	///		char: one character at a time
+	///		short_literal: 16 byte strings with a terminating zero, so append() has to measure them
+	///		short_view: the same 16 bytes as a string_view
+	///		long_view: 4 KB string_views
+	///		formatted: append_formatted() with a number and a string
+	///		segmented_long_view: 4 KB string_views into a segmented_writer
+	///		segmented_formatted: append_formatted() into a segmented_writer, like formatted
+	/// </summary>
+	class writer_benchmark final
+	{
+	public:
+		writer_benchmark()
+			:
+			m_total_size{ 0 }
+		{
+		}
+		~writer_benchmark() = default;
+
+	private:
+		writer_benchmark(const writer_benchmark&) = delete;
+		writer_benchmark& operator=(const writer_benchmark&) = delete;
+		writer_benchmark(writer_benchmark&&) = delete;
+		writer_benchmark& operator=(writer_benchmark&&) = delete;
+
+	public:
+		/// <summary>
+		/// Run every case once; call again for more runs
+		/// </summary>
+		void run()
+		{
+			const std::string short_text(SHORT_SIZE, 'a');
+			const std::string long_text(LONG_SIZE, 'b');
+
+			measure("char", [](string::writer& output)
+				{
+					for (size_t index = 0; index < BYTES_PER_RUN; ++index)
+					{
+						output.append('c');
+					}
+				});
+			measure("short_literal", [&short_text](string::writer& output)
+				{
+					for (size_t index = 0; index < BYTES_PER_RUN / SHORT_SIZE; ++index)
+					{
+						output.append(short_text.c_str());
+					}
+				});
+			measure("short_view", [&short_text](string::writer& output)
+				{
+					const std::string_view text{ short_text };
+					for (size_t index = 0; index < BYTES_PER_RUN / SHORT_SIZE; ++index)
+					{
+						output.append(text);
+					}
+				});
+			measure("long_view", [&long_text](string::writer& output)
+				{
+					const std::string_view text{ long_text };
+					for (size_t index = 0; index < BYTES_PER_RUN / LONG_SIZE; ++index)
+					{
+						output.append(text);
+					}
+				});
+			measure("formatted", [](string::writer& output)
+				{
+					for (size_t index = 0; output.as_string_view().size() < BYTES_PER_RUN; ++index)
+					{
+						output.append_formatted("{} {}\r\n", index, "formatted");
+					}
+				});
+
+			const auto start = std::chrono::high_resolution_clock::now();
+			{
+				string::segmented_writer output;
+				const std::string_view text{ long_text };
+				for (size_t index = 0; index < BYTES_PER_RUN / LONG_SIZE; ++index)
+				{
+					output.append(text);
+				}
+				m_total_size += output.size();
+				add_result("segmented_long_view", output.size(), microseconds_since(start));
+			}
+
+			const auto formatted_start = std::chrono::high_resolution_clock::now();
+			{
+				string::segmented_writer output;
+				for (size_t index = 0; output.size() < BYTES_PER_RUN; ++index)
+				{
+					output.append_formatted("{} {}\r\n", index, "formatted");
+				}
+				m_total_size += output.size();
+				add_result("segmented_formatted", output.size(), microseconds_since(formatted_start));
+			}
+		}
+
+		/// <summary>
+		/// Write the results as a JSON object with one member per case
+		/// </summary>
+		void write_json(string::writer& output) const
+		{
+			output.append('{');
+			bool first = true;
+			for (const auto& result : m_results)
+			{
+				if (!first)
+					output.append(',');
+				first = false;
+
+				const auto seconds{ std::max(result.microseconds, (uint64_t)1) / 1000000.0 };
+				output.append_formatted("\"{}\":{{\"bytes\":{},\"microseconds\":{},\"mb_per_second\":{:.1f},\"latency_us\":",
+					result.name,
+					result.bytes,
+					result.microseconds,
+					result.bytes / seconds / (1024 * 1024));
+				result.runs.write_json(output);
+				output.append('}');
+			}
+			output.append('}');
+		}
+
+		/// <summary>
+		/// Sum of all output sizes: printing it keeps the compiler from optimizing the appends away
+		/// </summary>
+		uint64_t total_size() const
+		{
+			return m_total_size;
+		}
+
+	private:
+		struct case_result
+		{
+			std::string name;
+			uint64_t bytes;
+			uint64_t microseconds;
+			latency_histogram runs;
+		};
+
+		template <typename FUNCTION> void measure(std::string_view name, FUNCTION function)
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+			string::writer output;
+			function(output);
+			const auto size{ output.as_string_view().size() };
+			const auto microseconds{ microseconds_since(start) };
+			m_total_size += size;
+			add_result(name, size, microseconds);
+		}
+
+		void add_result(std::string_view name, uint64_t bytes, uint64_t microseconds)
+		{
+			for (auto& result : m_results)
+			{
+				if (result.name == name)
+				{
+					result.bytes += bytes;
+					result.microseconds += microseconds;
+					result.runs.add(microseconds);
+					return;
+				}
+			}
+			m_results.push_back({ std::string{ name }, bytes, microseconds, {} });
+			m_results.back().runs.add(microseconds);
+		}
+
+		static uint64_t microseconds_since(std::chrono::high_resolution_clock::time_point start)
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+
+	private:
+		static constexpr size_t BYTES_PER_RUN = 1024 * 1024 * 64;
+		static constexpr size_t SHORT_SIZE = 16;
+		static constexpr size_t LONG_SIZE = 1024 * 4;
+
+		std::vector<case_result> m_results;
+		uint64_t m_total_size;
+	};
+}
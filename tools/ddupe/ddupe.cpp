@@ -2,7 +2,8 @@
 
 namespace fs = std::filesystem;
 
-#include <ngbtools/md5hash.h>
+#include <ngbtools/hasher.h>
+#include <ngbtools/digest.h>
 #include <ngbtools/string.h>
 #include <ngbtools/wstring.h>
 #include <ngbtools/console.h>
@@ -11,6 +12,20 @@ namespace fs = std::filesystem;
 #include <ngbtools/logging.h>
 #include <ngbtools/file.h>
 #include <ngbtools/windows_errors.h>
+#include <ngbtools/work_stealing_pool.h>
+#include <ngbtools/file_reader.h>
+#include <ngbtools/md5_multibuffer.h>
+
+#include "hash_cache.h"
+#include "file_index.h"
+#include "directory_walker.h"
+#include "file_comparer.h"
+#include "file_record_sorter.h"
+#include "scan_manifest.h"
+#include "duplicate_report.h"
+#include "instrumentation.h"
+#include "tree_hasher.h"
+#include "scan_snapshot.h"
 
 namespace ngbtools
 {
@@ -25,6 +40,8 @@ namespace ngbtools
 			m_rename{ false },
 			m_delete{ false },
 			m_verify{ false },
+			m_confirm{ false },
+			m_merge{ false },
 			m_total_files{ 0 },
 			m_total_folders{ 0 },
 			m_total_bytes_used{ 0 },
@@ -33,9 +50,29 @@ namespace ngbtools
 			m_checksums_reused{ 0 },
 			m_bytes_used_for_reused{ 0 },
 			m_files_deleted{ 0 },
-			m_bytes_used_for_deleted_files{ 0 }
+			m_bytes_used_for_deleted_files{ 0 },
+			m_partial_checksums_calculated{ 0 },
+			m_bytes_used_for_partial_checksums{ 0 },
+			m_files_ruled_out_by_partial_checksums{ 0 },
+			m_bytes_used_for_ruled_out_files{ 0 },
+			m_cache_hits{ 0 },
+			m_bytes_used_for_cache_hits{ 0 },
+			m_cache_misses{ 0 },
+			m_bytes_used_for_cache_misses{ 0 },
+			m_files_compared{ 0 },
+			m_bytes_used_for_comparing{ 0 },
+			m_files_linked{ 0 },
+			m_bytes_used_for_linked_files{ 0 },
+			m_files_skipped_as_links{ 0 },
+			m_bytes_used_for_skipped_links{ 0 },
+			m_memory_budget{ 0 },
+			m_progress_interval{ 0 },
+			m_number_of_threads{ work_stealing_pool::default_number_of_workers() },
+			m_read_method{ read_method::BUFFERED },
+			m_hash_algorithm{ hash_algorithm::FAST128 },
+			m_link_method{ link_method::NONE },
+			m_file_comparer{ TOTAL_BUFFER_SIZE }
 		{
-			m_buffer.resize(1024 * 1024 * 64);
 		}
 		~ddupe() = default;
 
@@ -49,14 +86,169 @@ namespace ngbtools
 			args.add_flag("RENAME", m_rename, "rename files to include hash");
 			args.add_flag("DELETE", m_delete, "delete duplicates");
 			args.add_flag("VERIFY", m_verify, "verify hashes encoded in filenames");
+			args.add_flag("CONFIRM", m_confirm, "compare duplicates byte for byte");
+			args.add_flag("MERGE", m_merge, "find duplicates across the snapshots passed as PATH");
+			std::string number_of_threads{ std::to_string(m_number_of_threads) };
+			args.add_option("THREADS", number_of_threads, "number of threads used for scanning and hashing");
+			args.add_option("CACHE", m_cache_filename, "database of checksums reused between runs");
+			args.add_option("MANIFEST", m_manifest_filename, "list of files reused between runs for unchanged folders");
+			std::string read_method_name{ "BUFFERED" };
+			args.add_option("READ", read_method_name, "how files are read: BUFFERED, MAPPED, UNBUFFERED or OVERLAPPED");
+			std::string hash_algorithm_name{ hasher::name(m_hash_algorithm) };
+			args.add_option("HASH", hash_algorithm_name, "checksum algorithm: FAST128, MD5 or BLAKE3");
+			std::string link_method_name;
+			args.add_option("LINK", link_method_name, "replace duplicates with links: HARD, CLONE or AUTO");
+			std::string memory_budget;
+			args.add_option("MEMORY", memory_budget, "MB of memory for the list of files: the rest is sorted on disk");
+			args.add_option("REPORT", m_report_filename, "write checksums and duplicates to a file");
+			std::string report_format_name{ "JSON" };
+			args.add_option("REPORTFORMAT", report_format_name, "format of the /REPORT file: JSON or BINARY");
+			std::string progress_interval;
+			args.add_option("PROGRESS", progress_interval, "seconds between progress reports");
+			args.add_option("TRACE", m_trace_filename, "write what each thread did to a Chrome trace file");
+			args.add_option("SNAPSHOT", m_snapshot_filename, "write size, checksum and path of every file for /MERGE");
+			args.add_option("HOST", m_host, "name of this machine in the /SNAPSHOT (default: computer name)");
 			args.add_non_empty_path_list("PATH", m_pathlist);
 
 			if (!args.parse(argc, argv))
 				return 20;
 
-			read_all_files();
-			check_for_duplicates();
-			return 0;
+			try
+			{
+				m_number_of_threads = std::stoul(number_of_threads);
+			}
+			catch (...)
+			{
+				m_number_of_threads = 0;
+			}
+			if (!m_number_of_threads)
+			{
+				console::writeline(CONSOLE_FOREGROUND_RED "You must pass a positive integer to the /THREADS option" CONSOLE_STANDARD);
+				return 20;
+			}
+			if (!memory_budget.empty())
+			{
+				size_t megabytes = 0;
+				try
+				{
+					megabytes = std::stoul(memory_budget);
+				}
+				catch (...)
+				{
+				}
+				if (!megabytes)
+				{
+					console::writeline(CONSOLE_FOREGROUND_RED "You must pass a positive number of MB to the /MEMORY option" CONSOLE_STANDARD);
+					return 20;
+				}
+				m_memory_budget = megabytes * 1024 * 1024;
+			}
+			if (!file_reader::parse_method(read_method_name, m_read_method))
+			{
+				console::writeline(CONSOLE_FOREGROUND_RED "The /READ option must be one of BUFFERED, MAPPED, UNBUFFERED or OVERLAPPED" CONSOLE_STANDARD);
+				return 20;
+			}
+			if (!hasher::parse_algorithm(hash_algorithm_name, m_hash_algorithm))
+			{
+				console::writeline(CONSOLE_FOREGROUND_RED "The /HASH option must be one of FAST128, MD5 or BLAKE3" CONSOLE_STANDARD);
+				return 20;
+			}
+			if (!link_method_name.empty() && !parse_link_method(link_method_name, m_link_method))
+			{
+				console::writeline(CONSOLE_FOREGROUND_RED "The /LINK option must be one of HARD, CLONE or AUTO" CONSOLE_STANDARD);
+				return 20;
+			}
+			if (m_delete && (m_link_method != link_method::NONE))
+			{
+				console::writeline(CONSOLE_FOREGROUND_RED "You cannot use /DELETE and /LINK at the same time" CONSOLE_STANDARD);
+				return 20;
+			}
+			report_format format;
+			if (!duplicate_report::parse_format(report_format_name, format))
+			{
+				console::writeline(CONSOLE_FOREGROUND_RED "The /REPORTFORMAT option must be one of JSON or BINARY" CONSOLE_STANDARD);
+				return 20;
+			}
+			if (!progress_interval.empty())
+			{
+				try
+				{
+					m_progress_interval = std::stoul(progress_interval);
+				}
+				catch (...)
+				{
+				}
+				if (!m_progress_interval)
+				{
+					console::writeline(CONSOLE_FOREGROUND_RED "You must pass a positive number of seconds to the /PROGRESS option" CONSOLE_STANDARD);
+					return 20;
+				}
+			}
+			if (!m_trace_filename.empty())
+			{
+				m_instrumentation.start_tracing();
+			}
+			if (m_merge)
+			{
+				if (m_delete || m_rename || (m_link_method != link_method::NONE) || !m_snapshot_filename.empty())
+				{
+					console::writeline(CONSOLE_FOREGROUND_RED "/MERGE only reports duplicates: you cannot use it with /DELETE, /RENAME, /LINK or /SNAPSHOT" CONSOLE_STANDARD);
+					return 20;
+				}
+				return merge_snapshots(format);
+			}
+
+			if (!m_cache_filename.empty() && !m_cache.open(m_cache_filename))
+				return 10;
+
+			if (!m_manifest_filename.empty() && !m_manifest.open(m_manifest_filename))
+				return 10;
+
+			if (!m_report_filename.empty())
+			{
+				m_report = duplicate_report::create(format);
+				if (!m_report->open(m_report_filename, m_hash_algorithm))
+					return 10;
+			}
+
+			if (!m_snapshot_filename.empty() && !m_snapshot.open(m_snapshot_filename, m_host.empty() ? computer_name() : m_host, m_hash_algorithm))
+				return 10;
+
+			std::unique_ptr<progress_reporter> progress;
+			if (m_progress_interval)
+			{
+				progress = std::make_unique<progress_reporter>(m_instrumentation, std::chrono::seconds{ m_progress_interval });
+			}
+
+			if (!read_all_files())
+				return 10;
+
+			// the manifest is complete once all directories have been read
+			if (!m_manifest.close())
+				return 10;
+
+			const bool checked_all_files{ check_for_duplicates() };
+			progress.reset();
+			report_time_spent();
+
+			if (m_report && !m_report->close())
+				return 10;
+
+			if (!m_snapshot.close())
+				return 10;
+
+			if (!m_trace_filename.empty())
+			{
+				if (!m_instrumentation.write_trace(m_trace_filename))
+					return 10;
+
+				if (m_instrumentation.has_dropped_events())
+					console::writeline(CONSOLE_FOREGROUND_YELLOW "The trace was too long, only its beginning was written" CONSOLE_STANDARD);
+			}
+
+			if (!m_cache.close())
+				return 10;
+			return checked_all_files ? 0 : 10;
 		}
 
 	private:
@@ -66,80 +258,605 @@ namespace ngbtools
 		ddupe& operator=(ddupe&&) = delete;
 
 	private:
+		/// <summary>
+		/// What /LINK replaces a duplicate with
+		/// </summary>
+		enum class link_method
+		{
+			NONE,
+
+			/// <summary>a hard link to the original: both names share the same file from then on</summary>
+			HARD,
+
+			/// <summary>a block clone of the original (ReFS): an independent file that shares the data blocks</summary>
+			CLONE,
+
+			/// <summary>CLONE where the volume supports it, HARD everywhere else</summary>
+			AUTO,
+		};
+
+		static bool parse_link_method(std::string_view name, link_method& result)
+		{
+			if (string::equals_nocase(name, "HARD"))
+				result = link_method::HARD;
+			else if (string::equals_nocase(name, "CLONE"))
+				result = link_method::CLONE;
+			else if (string::equals_nocase(name, "AUTO"))
+				result = link_method::AUTO;
+			else
+				return false;
+			return true;
+		}
+
+		/// <summary>
+		/// A file that has been checked for duplicates
+		/// </summary>
+		struct known_file
+		{
+			std::string pathname;
+			uint32_t volume_serial_number;
+		};
+
+		/// <summary>
+		/// The checksum of a single file, calculated by one of the hashing threads
+		/// </summary>
+		struct checksum_result
+		{
+			bool is_done;
+			bool succeeded;
+			bool partial_succeeded;
+
+			// true if the partial checksum already proves that this file has no duplicate
+			bool is_ruled_out;
+
+			// only used with /CACHE: the identity of the file, and which checksums came from the cache
+			bool has_information;
+			bool partial_from_cache;
+			bool checksum_from_cache;
+			file::information information;
+
+			digest partial_checksum;
+			digest checksum;
+		};
 
-		bool read_checksum(std::string_view pathname, uintmax_t file_size, std::string& result)
+		/// <summary>
+		/// Per-thread I/O state, created on first use by the hashing thread that owns it
+		/// </summary>
+		struct worker_state
 		{
-			MD5 checksum;
-			++m_checksums_calculated;
-			m_bytes_used_for_checksums += file_size;
+			std::unique_ptr<file_reader> reader;
+			std::unique_ptr<hasher> hash;
+			std::unique_ptr<tree_hasher> tree_hash;
+			std::vector<char> partial_buffer;
+			std::vector<unsigned char> batch_buffer;
+		};
+
+		/// <summary>
+		/// Small files are hashed in batches, so that the multi-buffer MD5 can hash them in parallel
+		/// </summary>
+		struct batch_item
+		{
+			const file_index::file_record* record;
+			checksum_result* result;
+			uintmax_t file_size;
+		};
+
+		hasher& get_hasher(worker_state& worker) const
+		{
+			if (!worker.hash)
+			{
+				worker.hash = hasher::create(m_hash_algorithm);
+			}
+			return *worker.hash;
+		}
+
+		static std::string absolute_pathname(const fs::path& item)
+		{
+			std::error_code ec;
+			const auto result{ fs::absolute(item, ec) };
+			return wstring::encode_as_utf8(ec ? item.wstring() : result.wstring());
+		}
+
+		// this is called on the worker threads: the cache is only read, never written to. A file that no longer
+		// has the size it was listed with is left alone: its checksums would not belong in its group, and reading it fails.
+		void lookup_cached_checksums(const fs::path& item, uintmax_t file_size, checksum_result& result) const
+		{
+			if (!m_cache.is_open() || result.has_information || has_checksum_in_filename(item.filename().wstring()))
+				return;
+
+			const auto pathname{ absolute_pathname(item) };
+			{
+				instrumentation::timer timer{ m_instrumentation, activity::STAT };
+				result.has_information = file::get_information(pathname, result.information);
+			}
+			if (!result.has_information || (result.information.size != file_size))
+				return;
+
+			hash_cache::entry entry{};
+			instrumentation::timer timer{ m_instrumentation, activity::LOOKUP };
+			if (!m_cache.lookup(pathname, result.information, m_hash_algorithm, entry))
+				return;
+			timer.stop();
+
+			if (entry.has_partial_checksum)
+			{
+				result.partial_checksum = entry.partial_checksum;
+				result.partial_succeeded = true;
+				result.partial_from_cache = true;
+			}
+			if (entry.has_checksum)
+			{
+				result.checksum = entry.checksum;
+				result.succeeded = true;
+				result.checksum_from_cache = true;
+			}
+		}
+
+		void remember_checksums(const fs::path& item, const checksum_result& result)
+		{
+			if (!result.has_information)
+				return;
+
+			const bool has_new_partial_checksum{ result.partial_succeeded && !result.partial_from_cache };
+			const bool has_new_checksum{ result.succeeded && !result.checksum_from_cache };
+			if (!has_new_partial_checksum && !has_new_checksum)
+				return;
+
+			m_cache.store(absolute_pathname(item), result.information, m_hash_algorithm,
+				result.partial_succeeded ? &result.partial_checksum : nullptr,
+				result.succeeded ? &result.checksum : nullptr);
+		}
+
+		// this is called on the worker threads, so it must not touch any of the counters
+		bool read_partial_checksum(std::string_view pathname, uintmax_t file_size, std::vector<char>& buffer, hasher& checksum, digest& result) const
+		{
+			assert(file_size > 2 * PARTIAL_CHECKSUM_BLOCK_SIZE);
+			assert(buffer.size() >= PARTIAL_CHECKSUM_BLOCK_SIZE);
+			checksum.reset();
 
 			const auto wstr_pathname{ string::encode_as_utf16(pathname) };
 
+			instrumentation::timer open_timer{ m_instrumentation, activity::OPEN };
 			HANDLE hFile = ::CreateFileW(wstr_pathname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+			open_timer.stop();
 			if (hFile == INVALID_HANDLE_VALUE)
 			{
 				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
 					fmt::format("CreateFileW({}) failed", pathname));
 				return false;
 			}
-			while (file_size)
+			if (!file_reader::has_expected_size(hFile, pathname, file_size))
+			{
+				::CloseHandle(hFile);
+				return false;
+			}
+
+			// first the head, then the tail of the file
+			LARGE_INTEGER tail_position{};
+			tail_position.QuadPart = (LONGLONG)(file_size - PARTIAL_CHECKSUM_BLOCK_SIZE);
+			for (int block = 0; block < 2; ++block)
 			{
-				MD5::size_type bytes_to_read = (MD5::size_type)file_size;
-				if (bytes_to_read > m_buffer.size())
-					bytes_to_read = (MD5::size_type)m_buffer.size();
-				
+				if (block && !::SetFilePointerEx(hFile, tail_position, nullptr, FILE_BEGIN))
+				{
+					logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+						fmt::format("SetFilePointerEx({}) failed", pathname));
+					::CloseHandle(hFile);
+					return false;
+				}
 				DWORD bytesRead = 0;
-				if (!::ReadFile(hFile, &m_buffer[0], bytes_to_read, &bytesRead, nullptr))
+				instrumentation::timer read_timer{ m_instrumentation, activity::READ };
+				if (!::ReadFile(hFile, &buffer[0], PARTIAL_CHECKSUM_BLOCK_SIZE, &bytesRead, nullptr))
 				{
 					logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
 						fmt::format("ReadFile({}) failed", pathname));
+					::CloseHandle(hFile);
 					return false;
 				}
-				assert(bytesRead == bytes_to_read);
-				checksum.update((const unsigned char*)&m_buffer[0], bytes_to_read);
-				file_size -= bytes_to_read;
+				read_timer.stop(bytesRead);
+				assert(bytesRead == PARTIAL_CHECKSUM_BLOCK_SIZE);
+				instrumentation::timer hash_timer{ m_instrumentation, activity::HASH };
+				checksum.update((const unsigned char*)&buffer[0], bytesRead);
+				hash_timer.stop(bytesRead);
 			}
-			checksum.finalize();
-			result = checksum.hexdigest();
+			::CloseHandle(hFile);
+			result = checksum.finalize_as_digest();
 			return true;
 		}
 
-		bool check_for_duplicates_in(const fs::path& item, std::unordered_map<std::string, std::string>& checksum_lookup, uintmax_t file_size)
+		// this is called on the worker threads, so it must not touch any of the counters. The reader calls us
+		// back with every block it has read, so reading is what remains of the time once opening and hashing
+		// are taken out; the trace shows the whole file as a single READ.
+		bool read_checksum(std::string_view pathname, uintmax_t file_size, file_reader& reader, hasher& checksum, digest& result) const
 		{
-			auto pathname{ wstring::encode_as_utf8(item.wstring()) };
-			const auto filename{ item.filename().wstring() };
+			checksum.reset();
+			const auto start{ instrumentation::clock::now() };
+			auto time_spent_hashing{ instrumentation::clock::duration::zero() };
+			const bool succeeded{ reader.read(pathname, file_size, [&checksum, &time_spent_hashing](const unsigned char* data, size_t size)
+				{
+					const auto before{ instrumentation::clock::now() };
+					checksum.update(data, size);
+					time_spent_hashing += instrumentation::clock::now() - before;
+				}) };
+			const auto finish{ instrumentation::clock::now() };
+			const auto time_spent_opening{ reader.last_open_duration() };
+			m_instrumentation.count(activity::OPEN, time_spent_opening, 0);
+			m_instrumentation.count(activity::HASH, time_spent_hashing, succeeded ? file_size : 0);
+			m_instrumentation.count(activity::READ, finish - start - time_spent_opening - time_spent_hashing, succeeded ? file_size : 0);
+			m_instrumentation.trace(activity::READ, start, finish, succeeded ? file_size : 0);
+			if (!succeeded)
+			{
+				// a tree_hasher would otherwise keep its segments, and their share of the budget, until the next file
+				checksum.reset();
+				return false;
+			}
+
+			result = checksum.finalize_as_digest();
+			return true;
+		}
+
+		// this is called on the worker threads, so it must not touch any of the counters.
+		// Reads all files of the batch into one buffer, then hashes them in one go.
+		void read_checksums(std::vector<batch_item>& batch, worker_state& worker) const
+		{
+			auto& contents{ worker.batch_buffer };
+			contents.clear();
+
+			std::vector<size_t> offsets;
+			offsets.reserve(batch.size());
+			for (auto& entry : batch)
+			{
+				offsets.push_back(contents.size());
+				const auto item{ m_files.path(*entry.record) };
+				lookup_cached_checksums(item, entry.file_size, *entry.result);
+				if (entry.result->checksum_from_cache)
+					continue;
+
+				instrumentation::timer timer{ m_instrumentation, activity::READ };
+				entry.result->succeeded = worker.reader->read(wstring::encode_as_utf8(item.wstring()), entry.file_size,
+					[&contents](const unsigned char* data, size_t size)
+					{
+						contents.insert(contents.end(), data, data + size);
+					});
+				if (!entry.result->succeeded)
+				{
+					contents.resize(offsets.back());
+				}
+				timer.stop(contents.size() - offsets.back());
+			}
+
+			std::vector<const unsigned char*> messages;
+			std::vector<uint64_t> sizes;
+			std::vector<batch_item*> hashed_items;
+			for (size_t index = 0; index < batch.size(); ++index)
+			{
+				auto& entry{ batch[index] };
+				if (entry.result->checksum_from_cache || !entry.result->succeeded)
+					continue;
+
+				messages.push_back(contents.data() + offsets[index]);
+				sizes.push_back(entry.file_size);
+				hashed_items.push_back(&entry);
+			}
+
+			std::vector<md5_multibuffer::digest> digests;
+			digests.resize(messages.size());
+			instrumentation::timer timer{ m_instrumentation, activity::HASH };
+			m_multibuffer_md5.hash(messages.data(), sizes.data(), messages.size(), digests.data());
+			timer.stop(contents.size());
+			for (size_t index = 0; index < hashed_items.size(); ++index)
+			{
+				hashed_items[index]->result->checksum = digest{ digests[index].data(), digests[index].size() };
+			}
+		}
+
+		/// <summary>
+		/// A checksum in a filename looks like {ALGORITHM:0123...}name, or {0123...}name for MD5 (which is what
+		/// older versions of ddupe wrote).
+		/// </summary>
+		/// <param name="filename">filename without path</param>
+		/// <param name="algorithm">receives the algorithm</param>
+		/// <param name="checksum">receives the checksum</param>
+		/// <param name="prefix_length">receives the length of the {...} part</param>
+		/// <returns>true if the filename has a checksum, or false otherwise</returns>
+		static bool parse_checksum_in_filename(std::wstring_view filename, hash_algorithm& algorithm, digest& checksum, size_t& prefix_length)
+		{
+			if (filename.empty() || (filename[0] != L'{'))
+				return false;
+
+			const auto end{ filename.find(L'}') };
+			if ((end == std::wstring_view::npos) || (end + 1 == filename.size()))
+				return false;
+
+			auto text{ filename.substr(1, end - 1) };
+			algorithm = hash_algorithm::MD5;
+			const auto separator{ text.find(L':') };
+			if (separator != std::wstring_view::npos)
+			{
+				if (!hasher::parse_algorithm(wstring::encode_as_utf8(text.substr(0, separator)), algorithm))
+					return false;
+				text = text.substr(separator + 1);
+			}
+			if ((text.size() != hasher::digest_size(algorithm) * 2) || !digest::from_hex(text, checksum))
+				return false;
+
+			prefix_length = end + 1;
+			return true;
+		}
+
+		/// <summary>
+		/// Only checksums calculated with the algorithm we use in this run can be compared with each other
+		/// </summary>
+		bool has_checksum_in_filename(std::wstring_view filename) const
+		{
+			hash_algorithm algorithm;
+			digest checksum;
+			size_t prefix_length;
+			return parse_checksum_in_filename(filename, algorithm, checksum, prefix_length) && (algorithm == m_hash_algorithm);
+		}
+
+		std::string checksum_as_filename_prefix(const digest& checksum) const
+		{
+			if (m_hash_algorithm == hash_algorithm::MD5)
+				return "{" + checksum.to_hex() + "}";
+
+			return fmt::format("{{{}:{}}}", hasher::name(m_hash_algorithm), checksum.to_hex());
+		}
+
+		bool needs_checksum(const file_index::file_record& record) const
+		{
+			return m_verify || !has_checksum_in_filename(m_files.filename(record));
+		}
+
+		bool use_calculated_checksum(const checksum_result& calculated, uintmax_t file_size, digest& result)
+		{
+			assert(calculated.is_done);
+			if (!calculated.succeeded)
+				return false;
+
+			if (calculated.checksum_from_cache)
+			{
+				++m_cache_hits;
+				m_bytes_used_for_cache_hits += file_size;
+			}
+			else
+			{
+				++m_checksums_calculated;
+				m_bytes_used_for_checksums += file_size;
+				if (calculated.has_information)
+				{
+					++m_cache_misses;
+					m_bytes_used_for_cache_misses += file_size;
+				}
+			}
+			result = calculated.checksum;
+			return true;
+		}
+
+		/// <summary>
+		/// Partial checksums only pay off for files that are large compared to the blocks we read, and only if
+		/// we don't need the full checksum anyway: /RENAME and /SNAPSHOT want it for every file, and files that
+		/// already have a checksum in their name can only be compared by their full checksum.
+		/// </summary>
+		bool use_partial_checksums(const file_index::group& group) const
+		{
+			if (m_rename || m_snapshot.is_open() || (group.size < PARTIAL_CHECKSUM_MINIMUM_FILE_SIZE))
+				return false;
+
+			for (size_t index = group.first; index < group.first + group.count; ++index)
+			{
+				if (has_checksum_in_filename(m_files.filename(m_files[index])))
+					return false;
+			}
+			return true;
+		}
 
+		/// <summary>
+		/// BLAKE3 is a tree hash, so a huge file can be hashed by several threads and still get the same checksum
+		/// </summary>
+		bool use_tree_hash(uintmax_t file_size) const
+		{
+			return (m_hash_algorithm == hash_algorithm::BLAKE3) && (file_size >= TREE_HASH_MINIMUM_FILE_SIZE) && (m_number_of_threads > 1);
+		}
+
+		void count_checked_file(uintmax_t file_size)
+		{
 			++m_total_files;
-			if ((m_total_files % 1000) == 0)
+			m_instrumentation.checked(file_size);
+			if (((m_total_files % 1000) == 0) && !m_instrumentation.reports_progress())
 			{
 				console::formatline("- checked total of {:L} files using {:L} bytes", m_total_files, m_total_bytes_used);
 			}
 			m_total_bytes_used += file_size;
+		}
+
+		/// <summary>
+		/// With /CONFIRM, a file is only a duplicate if its contents are identical: the same checksum is not enough
+		/// </summary>
+		bool is_confirmed_duplicate(const std::string& pathname, const std::string& original, uintmax_t file_size)
+		{
+			if (!m_confirm)
+				return true;
+
+			std::vector<std::vector<size_t>> identical;
+			compare_contents({ original, pathname }, file_size, identical);
+			if ((identical.size() == 1) && (identical[0].size() == 2))
+				return true;
+
+			console::formatline(CONSOLE_FOREGROUND_YELLOW "{} has the same checksum as {}, but different contents" CONSOLE_STANDARD, pathname, original);
+			return false;
+		}
+
+		void compare_contents(const std::vector<std::string>& pathnames, uintmax_t file_size, std::vector<std::vector<size_t>>& identical)
+		{
+			const auto bytes_read_before{ m_file_comparer.bytes_read() };
+			m_file_comparer.compare(pathnames, file_size, identical);
+			m_files_compared += pathnames.size();
+			m_bytes_used_for_comparing += m_file_comparer.bytes_read() - bytes_read_before;
+		}
+
+		/// <summary>
+		/// Compare all files that have the same checksum as the first one (the original) byte for byte, and
+		/// report (and possibly delete or link) the ones that are actually identical.
+		/// </summary>
+		void confirm_duplicates(const digest& checksum, const std::vector<known_file>& files, uintmax_t file_size)
+		{
+			std::vector<std::string> pathnames;
+			for (const auto& file : files)
+			{
+				pathnames.push_back(file.pathname);
+			}
 
-			std::string checksum;
-			if ((filename.size() > 34) && (filename[0] == L'{') && (filename[33] == L'}'))
+			std::vector<std::vector<size_t>> identical;
+			compare_contents(pathnames, file_size, identical);
+			for (const auto& set : identical)
+			{
+				// the first file of a set of identical files survives, which is the original if it is part of the set
+				for (size_t index = 1; index < set.size(); ++index)
+				{
+					report_duplicate(files[set[index]], files[set[0]], file_size);
+				}
+				if ((set.size() == 1) && set[0])
+				{
+					console::formatline(CONSOLE_FOREGROUND_YELLOW "{} has the same checksum as {}, but different contents" CONSOLE_STANDARD, pathnames[set[0]], pathnames[0]);
+				}
+				else if (m_report && (set.size() > 1))
+				{
+					std::vector<std::string_view> identical_pathnames;
+					for (const auto index : set)
+					{
+						identical_pathnames.push_back(pathnames[index]);
+					}
+					m_report->duplicates(file_size, checksum, identical_pathnames);
+				}
+			}
+		}
+
+		void report_group(const digest& checksum, const std::vector<known_file>& files, uintmax_t file_size)
+		{
+			std::vector<std::string_view> pathnames;
+			for (const auto& file : files)
+			{
+				pathnames.push_back(file.pathname);
+			}
+			m_report->duplicates(file_size, checksum, pathnames);
+		}
+
+		bool report_duplicate(const known_file& duplicate, const known_file& original, uintmax_t file_size)
+		{
+			console::formatline(CONSOLE_FOREGROUND_RED "{} already exists as\r\n{}" CONSOLE_STANDARD,
+				duplicate.pathname,
+				original.pathname);
+
+			if (m_link_method != link_method::NONE)
+				return link_duplicate(duplicate, original, file_size);
+
+			if (m_delete)
+			{
+				if (!file::remove(duplicate.pathname))
+					return false;
+
+				++m_files_deleted;
+				m_bytes_used_for_deleted_files += file_size;
+			}
+			return true;
+		}
+
+		/// <summary>
+		/// Replace a duplicate by a link to the original, so that the directory layout stays the same. The link is
+		/// made under a temporary name first and then renamed over the duplicate in one step, so the duplicate
+		/// is never missing, not even if we are interrupted half-way.
+		/// </summary>
+		bool link_duplicate(const known_file& duplicate, const known_file& original, uintmax_t file_size)
+		{
+			if (duplicate.volume_serial_number != original.volume_serial_number)
+			{
+				console::formatline(CONSOLE_FOREGROUND_YELLOW "{} is on another volume than {}, so it cannot be linked" CONSOLE_STANDARD,
+					duplicate.pathname,
+					original.pathname);
+				return false;
+			}
+
+			const auto temporary_pathname{ duplicate.pathname + ".ddupe-link" };
+			const bool succeeded{ use_block_cloning(original)
+				? file::clone(original.pathname, temporary_pathname)
+				: file::create_hard_link(temporary_pathname, original.pathname) };
+			if (!succeeded)
+				return false;
+
+			if (!file::replace(temporary_pathname, duplicate.pathname))
+			{
+				file::remove(temporary_pathname);
+				return false;
+			}
+			++m_files_linked;
+			m_bytes_used_for_linked_files += file_size;
+			return true;
+		}
+
+		bool use_block_cloning(const known_file& original)
+		{
+			switch (m_link_method)
+			{
+			case link_method::CLONE:
+				return true;
+			case link_method::AUTO:
+				break;
+			default:
+				return false;
+			}
+
+			// asking the volume means opening a file, so we only do it once per volume
+			const auto existing{ m_supports_block_cloning.find(original.volume_serial_number) };
+			if (existing != m_supports_block_cloning.end())
+				return existing->second;
+
+			const bool result{ file::supports_block_cloning(original.pathname) };
+			m_supports_block_cloning[original.volume_serial_number] = result;
+			return result;
+		}
+
+		/// <summary>
+		/// checksum_lookup maps each checksum to the first file that had it. With /CONFIRM, the files that have the
+		/// same checksum are appended and only compared once all files of the same size have been looked at. With
+		/// /REPORT, duplicates are appended too, so that each group can be reported as a whole.
+		/// </summary>
+		bool check_for_duplicates_in(const fs::path& item, const file_index::file_record& record, std::unordered_map<digest, std::vector<known_file>>& checksum_lookup, const checksum_result& calculated)
+		{
+			const auto file_size{ record.size };
+			auto pathname{ wstring::encode_as_utf8(item.wstring()) };
+			const auto filename{ item.filename().wstring() };
+
+			count_checked_file(file_size);
+
+			hash_algorithm algorithm_in_filename;
+			digest checksum_in_filename;
+			size_t prefix_length = 0;
+			const bool has_any_checksum_in_filename{ parse_checksum_in_filename(filename, algorithm_in_filename, checksum_in_filename, prefix_length) };
+
+			digest checksum;
+			if (has_any_checksum_in_filename && (algorithm_in_filename == m_hash_algorithm))
 			{
 				m_checksums_reused += 1;
 				m_bytes_used_for_reused += file_size;
 
-				checksum = wstring::encode_as_utf8(filename.substr(1, 32));
+				checksum = checksum_in_filename;
 				if (m_verify)
 				{
-					std::string actual_checksum;
-					if (!read_checksum(pathname, file_size, actual_checksum))
+					digest actual_checksum;
+					if (!use_calculated_checksum(calculated, file_size, actual_checksum))
 					{
 						return false;
 					}
 					else if (actual_checksum != checksum)
 					{
 						console::formatline(CONSOLE_FOREGROUND_RED "Checksum falsified for {}", pathname);
-						console::formatline("-----> is: {}", checksum);
-						console::formatline("should be: {}" CONSOLE_STANDARD, actual_checksum);
+						console::formatline("-----> is: {}", checksum.to_hex());
+						console::formatline("should be: {}" CONSOLE_STANDARD, actual_checksum.to_hex());
 
 						checksum = actual_checksum;
 						if (m_rename)
 						{
-							const auto newname = string::encode_as_utf16("{" + actual_checksum + "}") + filename.substr(34);
+							const auto newname = string::encode_as_utf16(checksum_as_filename_prefix(actual_checksum)) + filename.substr(prefix_length);
 							const auto newpath{ item.parent_path() / fs::path{newname} };
 							console::formatline("renaming as : {}", newpath.string());
 							
@@ -155,7 +872,7 @@ namespace ngbtools
 										wstring::encode_as_utf8(newpath.wstring())));
 								if (hResult == ERROR_FILE_EXISTS)
 								{
-									if (m_delete)
+									if (m_delete && is_confirmed_duplicate(pathname, wstring::encode_as_utf8(newpath.wstring()), file_size))
 									{
 										if (file::remove(pathname))
 										{
@@ -173,13 +890,14 @@ namespace ngbtools
 			}
 			else
 			{
-				if (!read_checksum(pathname, file_size, checksum))
+				if (!use_calculated_checksum(calculated, file_size, checksum))
 				{
 					return false;
 				}
 				if (m_rename)
 				{
-					const auto newname = string::encode_as_utf16("{" + checksum + "}") + filename;
+					// a checksum calculated with another algorithm is replaced
+					const auto newname = string::encode_as_utf16(checksum_as_filename_prefix(checksum)) + filename.substr(prefix_length);
 					const auto newpath{ item.parent_path() / fs::path{newname} };
 					console::formatline("Renaming as: {}", newpath.string());
 
@@ -196,7 +914,7 @@ namespace ngbtools
 
 						if (hResult == ERROR_FILE_EXISTS)
 						{
-							if (m_delete)
+							if (m_delete && is_confirmed_duplicate(pathname, wstring::encode_as_utf8(newpath.wstring()), file_size))
 							{
 								if (!file::remove(pathname))
 									return false;
@@ -215,106 +933,547 @@ namespace ngbtools
 				}
 			}
 
-			const auto& existing_filename = checksum_lookup.find(checksum);
-			if (existing_filename != checksum_lookup.end())
+			if (m_report)
 			{
-				console::formatline(CONSOLE_FOREGROUND_RED "{} already exists as\r\n{}" CONSOLE_STANDARD,
-					pathname,
-					existing_filename->second);
-
-				if (m_delete)
-				{
-					if (!file::remove(pathname))
-						return false;
+				m_report->file(pathname, file_size, checksum);
+			}
+			if (m_snapshot.is_open())
+			{
+				m_snapshot.add(absolute_pathname(fs::path{ string::encode_as_utf16(pathname) }), file_size, checksum);
+			}
 
-					++m_files_deleted;
-					m_bytes_used_for_deleted_files += file_size;
-				}
+			known_file file{ std::move(pathname), m_files.volume_serial_number(record) };
+			instrumentation::timer timer{ m_instrumentation, activity::LOOKUP };
+			const auto& existing_filename = checksum_lookup.find(checksum);
+			timer.stop();
+			if (existing_filename == checksum_lookup.end())
+			{
+				checksum_lookup[checksum].push_back(std::move(file));
+			}
+			else if (m_confirm)
+			{
+				existing_filename->second.push_back(std::move(file));
 			}
 			else
 			{
-				checksum_lookup[checksum] = pathname;
+				const bool succeeded{ report_duplicate(file, existing_filename->second.front(), file_size) };
+				if (m_report)
+				{
+					existing_filename->second.push_back(std::move(file));
+				}
+				return succeeded;
 			}
 			return true;
 		}
 
-		void check_for_duplicates()
+		/// <returns>false if a batch of files was too large to check</returns>
+		bool check_for_duplicates()
 		{
 			const auto start = std::chrono::high_resolution_clock::now();
 			m_total_files = 0;
-			for (const auto& lookup_item : m_lookup_by_size)
-			{
-				if (lookup_item.second->size() < 2)
-					continue;
 
-				std::unordered_map<std::string, std::string> checksum_lookup;
-				for (const auto& item : *(lookup_item.second))
+			bool succeeded = true;
+			if (m_sorter)
+			{
+				// only one batch of files is in memory at any time
+				while (m_sorter->next_batch(m_files))
 				{
-					check_for_duplicates_in(item, checksum_lookup, lookup_item.first);
+					// a batch is only this large if a single group of files with the same size is
+					if (m_files.is_full())
+					{
+						console::writeline(CONSOLE_FOREGROUND_RED "The names of the files with the same size take up more than 4 G characters, too many to check at once" CONSOLE_STANDARD);
+						succeeded = false;
+						break;
+					}
+					m_files.sort_by_size();
+					count_links();
+					check_for_duplicates_in_index();
 				}
-
+			}
+			else
+			{
+				check_for_duplicates_in_index();
 			}
 
 			const auto finish = std::chrono::high_resolution_clock::now();
 			const auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(finish - start);
 			console::formatline(CONSOLE_FOREGROUND_GREEN "Took {:L} microseconds to scan {:L} files for duplicates" CONSOLE_STANDARD, microseconds.count(), m_total_files);
+			if (m_files_skipped_as_links)
+				console::formatline("Skipped {:L} files already linked to another file using {:L} bytes", m_files_skipped_as_links, m_bytes_used_for_skipped_links);
+			if (m_partial_checksums_calculated)
+				console::formatline("Calculated {:L} partial checksums using {:L} bytes", m_partial_checksums_calculated, m_bytes_used_for_partial_checksums);
+			if (m_files_ruled_out_by_partial_checksums)
+				console::formatline("Partial checksums ruled out {:L} files using {:L} bytes", m_files_ruled_out_by_partial_checksums, m_bytes_used_for_ruled_out_files);
 			if(m_checksums_calculated)
 				console::formatline("Calculated {:L} checksums using {:L} bytes", m_checksums_calculated, m_bytes_used_for_checksums);
 			if (m_checksums_reused)
 				console::formatline("Reused {:L} checksums using {:L} bytes", m_checksums_reused, m_bytes_used_for_reused);
+			if (m_cache_hits)
+				console::formatline("Reused {:L} cached checksums using {:L} bytes", m_cache_hits, m_bytes_used_for_cache_hits);
+			if (m_cache_misses)
+				console::formatline("Missed {:L} cached checksums using {:L} bytes", m_cache_misses, m_bytes_used_for_cache_misses);
+			if (m_files_compared)
+				console::formatline("Compared {:L} files byte for byte using {:L} bytes", m_files_compared, m_bytes_used_for_comparing);
 			if (m_files_deleted)
 				console::formatline("Deleted {:L} files using {:L} bytes", m_files_deleted, m_bytes_used_for_deleted_files);
+			if (m_files_linked)
+				console::formatline("Linked {:L} files using {:L} bytes", m_files_linked, m_bytes_used_for_linked_files);
+			return succeeded;
+		}
+
+		static std::string computer_name()
+		{
+			wchar_t name[MAX_COMPUTERNAME_LENGTH + 1];
+			DWORD size{ MAX_COMPUTERNAME_LENGTH + 1 };
+			if (!::GetComputerNameW(name, &size))
+				return "localhost";
+
+			return wstring::encode_as_utf8(std::wstring_view{ name, size });
 		}
 
-		void visit_dir_entry(const fs::directory_entry& dir_entry)
+		/// <summary>
+		/// /MERGE: all snapshots are sorted by size and checksum, so we read them side by side, and whatever files
+		/// are current in all of them at the same time are identical. The original is the first file of a group,
+		/// in the order the snapshots were passed.
+		/// </summary>
+		int merge_snapshots(report_format format)
 		{
-			if (dir_entry.is_regular_file())
+			const auto start = std::chrono::high_resolution_clock::now();
+			std::vector<std::unique_ptr<snapshot_reader>> snapshots;
+			uint64_t number_of_files = 0;
+			for (const auto& path : m_pathlist)
+			{
+				snapshots.push_back(std::make_unique<snapshot_reader>());
+				if (!snapshots.back()->open(wstring::encode_as_utf8(path.wstring())))
+					return 10;
+
+				if (snapshots.back()->algorithm() != snapshots.front()->algorithm())
+				{
+					console::formatline(CONSOLE_FOREGROUND_RED "{} uses {}, but {} uses {}: all snapshots must use the same /HASH" CONSOLE_STANDARD,
+						snapshots.back()->pathname(), hasher::name(snapshots.back()->algorithm()),
+						snapshots.front()->pathname(), hasher::name(snapshots.front()->algorithm()));
+					return 20;
+				}
+				number_of_files += snapshots.back()->number_of_files();
+			}
+
+			if (!m_report_filename.empty())
+			{
+				m_report = duplicate_report::create(format);
+				if (!m_report->open(m_report_filename, snapshots.front()->algorithm()))
+					return 10;
+			}
+
+			const auto digest_size{ snapshots.front()->digest_size() };
+			std::vector<snapshot_reader::file> current(snapshots.size());
+			std::vector<bool> has_current(snapshots.size());
+			for (size_t index = 0; index < snapshots.size(); ++index)
+			{
+				has_current[index] = snapshots[index]->next(current[index]);
+			}
+			const auto is_before = [digest_size](const snapshot_reader::file& a, const snapshot_reader::file& b)
+			{
+				if (a.size != b.size)
+					return a.size < b.size;
+
+				return memcmp(a.checksum, b.checksum, digest_size) < 0;
+			};
+			const auto is_same = [digest_size](const snapshot_reader::file& a, const snapshot_reader::file& b)
+			{
+				return (a.size == b.size) && !memcmp(a.checksum, b.checksum, digest_size);
+			};
+
+			uint64_t number_of_duplicates = 0;
+			uint64_t bytes_used_for_duplicates = 0;
+			uint64_t number_of_duplicates_on_other_hosts = 0;
+			std::vector<std::string> pathnames;
+			std::vector<size_t> sources;
+			for (;;)
 			{
-				const auto file_size{ dir_entry.file_size() };
-				const auto item{ m_lookup_by_size.find(file_size) };
-				if (item == m_lookup_by_size.end())
+				// the smallest file that is current in any snapshot
+				size_t first = snapshots.size();
+				for (size_t index = 0; index < snapshots.size(); ++index)
 				{
-					m_lookup_by_size[file_size] = std::make_unique<files_with_same_size>(std::initializer_list<fs::path>{dir_entry.path()});
+					if (has_current[index] && ((first == snapshots.size()) || is_before(current[index], current[first])))
+						first = index;
+				}
+				if (first == snapshots.size())
+					break;
+
+				const auto group{ current[first] };
+				const digest checksum{ group.checksum, digest_size };
+				pathnames.clear();
+				sources.clear();
+				for (size_t index = 0; index < snapshots.size(); ++index)
+				{
+					auto& snapshot{ *snapshots[index] };
+					while (has_current[index] && is_same(current[index], group))
+					{
+						pathnames.push_back(fmt::format("{}:{}\\{}", snapshot.host(), snapshot.directory(current[index].directory), current[index].name));
+						sources.push_back(index);
+						has_current[index] = snapshot.next(current[index]);
+					}
 				}
-				else
+				if (pathnames.size() < 2)
+					continue;
+
+				for (size_t index = 1; index < pathnames.size(); ++index)
 				{
-					item->second->push_back(dir_entry.path());
+					console::formatline(CONSOLE_FOREGROUND_RED "{} already exists as\r\n{}" CONSOLE_STANDARD, pathnames[index], pathnames.front());
+					++number_of_duplicates;
+					bytes_used_for_duplicates += group.size;
+					if (sources[index] != sources.front())
+						++number_of_duplicates_on_other_hosts;
 				}
-				++m_total_files;
-				if ((m_total_files % 10000) == 0)
+				if (m_report)
 				{
-					console::formatline("- {:L} files read...", m_total_files);
+					m_report->duplicates(group.size, checksum, std::vector<std::string_view>(pathnames.begin(), pathnames.end()));
 				}
 			}
-			else
+
+			for (const auto& snapshot : snapshots)
 			{
-				++m_total_folders;
+				if (!snapshot->is_valid())
+					return 10;
 			}
-		};
+			if (m_report && !m_report->close())
+				return 10;
+
+			const auto finish = std::chrono::high_resolution_clock::now();
+			const auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(finish - start);
+			console::formatline(CONSOLE_FOREGROUND_GREEN "Took {:L} microseconds to merge {:L} files from {:L} snapshots" CONSOLE_STANDARD, microseconds.count(), number_of_files, snapshots.size());
+			if (number_of_duplicates)
+				console::formatline("Found {:L} duplicates using {:L} bytes, {:L} of them in another snapshot than the original", number_of_duplicates, bytes_used_for_duplicates, number_of_duplicates_on_other_hosts);
+			return 0;
+		}
 
-		void read_all_files()
+		/// <summary>
+		/// With /PROGRESS or /TRACE, sum up what all threads together spent their time on
+		/// </summary>
+		void report_time_spent() const
 		{
-			const auto start = std::chrono::high_resolution_clock::now();
-			for (const auto& path : m_pathlist)
+			if (!m_progress_interval && m_trace_filename.empty())
+				return;
+
+			const auto totals{ m_instrumentation.sum() };
+			for (size_t index = 0; index < instrumentation::NUMBER_OF_ACTIVITIES; ++index)
+			{
+				if (!totals.count[index])
+					continue;
+
+				console::formatline("- {}: {:L} times in {:L} microseconds using {:L} bytes",
+					instrumentation::name((activity)index),
+					totals.count[index],
+					totals.nanoseconds[index] / 1000,
+					totals.bytes[index]);
+			}
+		}
+
+		/// <summary>
+		/// Hard links of a file that was already found are neither hashed nor reported as duplicates
+		/// </summary>
+		void count_links()
+		{
+			for (const auto& link : m_files.links())
 			{
-				if (m_recursive)
+				++m_files_skipped_as_links;
+				m_bytes_used_for_skipped_links += link.size;
+			}
+		}
+
+		void report_index_is_full() const
+		{
+			console::writeline(CONSOLE_FOREGROUND_RED "The names of the files found take up more than 4 G characters, which is more than a list of files in memory can hold. Use /MEMORY to sort the list on disk instead" CONSOLE_STANDARD);
+		}
+
+		void check_for_duplicates_in_index()
+		{
+			// the order in which we look at the files within a group decides which file survives, so we fix it
+			// up front and only calculate the checksums in parallel. Groups come smallest first: we look at the
+			// largest first instead, so that no huge file is left to a single thread once all others are done.
+			// a file without a duplicate here may still have one on another machine
+			auto groups{ m_files.groups(m_snapshot.is_open() ? 1 : 2) };
+			std::reverse(groups.begin(), groups.end());
+			size_t number_of_files = 0;
+			uintmax_t number_of_bytes = 0;
+			for (const auto& group : groups)
+			{
+				number_of_files += group.count;
+				number_of_bytes += group.count * group.size;
+			}
+			m_instrumentation.will_check(number_of_files, number_of_bytes);
+
+			std::vector<checksum_result> results;
+			results.resize(number_of_files);
+
+			const auto buffer_size{ std::max<size_t>(MINIMUM_BUFFER_SIZE_PER_THREAD, TOTAL_BUFFER_SIZE / m_number_of_threads) };
+
+			std::mutex results_lock;
+			std::condition_variable result_available;
+
+			// tasks run in the order they were submitted, and huge files are hashed by several threads
+			tree_hasher::budget tree_hash_budget{ m_number_of_threads };
+			work_stealing_pool pool{ m_number_of_threads, task_order::OLDEST_FIRST };
+			instrumentation::watched_pool watch{ m_instrumentation, pool };
+
+			// the tree hashers of the workers use the pool and the budget, so they must go first
+			std::vector<worker_state> workers;
+			workers.resize(m_number_of_threads);
+
+			// stage 1: a cheap checksum of the head and tail of large files rules out most files that merely
+			// happen to have the same size
+			size_t result_index = 0;
+			for (const auto& group : groups)
+			{
+				const auto file_size{ group.size };
+				if (!use_partial_checksums(group))
+				{
+					result_index += group.count;
+					continue;
+				}
+				for (size_t index = group.first; index < group.first + group.count; ++index)
+				{
+					const auto& record{ m_files[index] };
+					auto& result{ results[result_index++] };
+					pool.submit([this, &workers, &record, &result, file_size](size_t worker_index)
+						{
+							const auto item{ m_files.path(record) };
+							lookup_cached_checksums(item, file_size, result);
+							if (result.partial_succeeded)
+								return;
+
+							auto& buffer{ workers[worker_index].partial_buffer };
+							if (buffer.empty())
+							{
+								buffer.resize(PARTIAL_CHECKSUM_BLOCK_SIZE);
+							}
+							result.partial_succeeded = read_partial_checksum(wstring::encode_as_utf8(item.wstring()), file_size, buffer, get_hasher(workers[worker_index]), result.partial_checksum);
+						});
+				}
+			}
+			pool.wait();
+
+			result_index = 0;
+			for (const auto& group : groups)
+			{
+				if (!use_partial_checksums(group))
+				{
+					result_index += group.count;
+					continue;
+				}
+				// if we don't know the partial checksum of every file, we cannot rule out any of them
+				std::unordered_map<digest, size_t> partial_checksum_count;
+				bool all_partial_checksums_known = true;
+				for (size_t index = 0; index < group.count; ++index)
+				{
+					const auto& result{ results[result_index + index] };
+					if (result.partial_succeeded)
+					{
+						++partial_checksum_count[result.partial_checksum];
+					}
+					else
+					{
+						all_partial_checksums_known = false;
+					}
+				}
+				for (size_t index = 0; index < group.count; ++index)
+				{
+					auto& result{ results[result_index + index] };
+					if (result.partial_succeeded)
+					{
+						if (!result.partial_from_cache)
+						{
+							++m_partial_checksums_calculated;
+							m_bytes_used_for_partial_checksums += 2 * PARTIAL_CHECKSUM_BLOCK_SIZE;
+						}
+						result.is_ruled_out = all_partial_checksums_known && (partial_checksum_count[result.partial_checksum] == 1);
+					}
+				}
+				result_index += group.count;
+			}
+
+			// stage 2: full checksums for everything that is still a candidate. With /HASH MD5, small files are collected into batches
+			std::vector<batch_item> batch;
+			uintmax_t bytes_in_batch = 0;
+			const auto submit_batch = [this, &pool, &workers, &results_lock, &result_available, &batch, &bytes_in_batch, buffer_size]()
+			{
+				if (batch.empty())
+					return;
+
+				pool.submit([this, &workers, &results_lock, &result_available, batch = std::move(batch), buffer_size](size_t worker_index) mutable
+					{
+						auto& worker{ workers[worker_index] };
+						if (!worker.reader)
+						{
+							worker.reader = file_reader::create(m_read_method, buffer_size);
+						}
+						read_checksums(batch, worker);
+
+						std::unique_lock<std::mutex> lock{ results_lock };
+						for (auto& entry : batch)
+						{
+							entry.result->succeeded = entry.result->succeeded || entry.result->checksum_from_cache;
+							entry.result->is_done = true;
+						}
+						result_available.notify_one();
+					});
+				batch.clear();
+				bytes_in_batch = 0;
+			};
+
+			result_index = 0;
+			for (const auto& group : groups)
+			{
+				const auto file_size{ group.size };
+				for (size_t index = group.first; index < group.first + group.count; ++index)
 				{
-					for (const fs::directory_entry& dir_entry : fs::recursive_directory_iterator(path))
+					const auto& record{ m_files[index] };
+					auto& result{ results[result_index++] };
+					if (result.is_ruled_out || result.checksum_from_cache || !needs_checksum(record))
 					{
-						visit_dir_entry(dir_entry);
+						result.is_done = true;
+						continue;
+					}
+
+					if ((m_hash_algorithm == hash_algorithm::MD5) && (file_size <= BATCHED_FILE_MAXIMUM_SIZE))
+					{
+						batch.push_back({ &record, &result, file_size });
+						bytes_in_batch += file_size;
+						if ((batch.size() >= BATCH_MAXIMUM_FILES) || (bytes_in_batch >= buffer_size))
+						{
+							submit_batch();
+						}
+						continue;
+					}
+
+					pool.submit([this, &pool, &tree_hash_budget, &workers, &results_lock, &result_available, &record, &result, buffer_size, file_size](size_t worker_index)
+						{
+							const auto item{ m_files.path(record) };
+							lookup_cached_checksums(item, file_size, result);
+
+							digest checksum;
+							bool succeeded{ result.checksum_from_cache };
+							if (!succeeded)
+							{
+								auto& reader{ workers[worker_index].reader };
+								if (!reader)
+								{
+									reader = file_reader::create(m_read_method, buffer_size);
+								}
+								auto& tree_hash{ workers[worker_index].tree_hash };
+								if (!tree_hash && use_tree_hash(file_size))
+								{
+									tree_hash = std::make_unique<tree_hasher>(pool, tree_hash_budget, m_instrumentation);
+								}
+								auto& hash{ use_tree_hash(file_size) ? *tree_hash : get_hasher(workers[worker_index]) };
+								succeeded = read_checksum(wstring::encode_as_utf8(item.wstring()), file_size, *reader, hash, checksum);
+							}
+
+							std::unique_lock<std::mutex> lock{ results_lock };
+							if (!result.checksum_from_cache)
+							{
+								result.checksum = checksum;
+							}
+							result.succeeded = succeeded;
+							result.is_done = true;
+							result_available.notify_one();
+						});
+				}
+			}
+			submit_batch();
+
+			// results are consumed in submission order, so that renames and deletes are deterministic
+			result_index = 0;
+			for (const auto& group : groups)
+			{
+				std::unordered_map<digest, std::vector<known_file>> checksum_lookup;
+				for (size_t index = group.first; index < group.first + group.count; ++index)
+				{
+					const auto& record{ m_files[index] };
+					const auto item{ m_files.path(record) };
+					auto& result{ results[result_index++] };
+					{
+						std::unique_lock<std::mutex> lock{ results_lock };
+						result_available.wait(lock, [&result]() { return result.is_done; });
+					}
+					remember_checksums(item, result);
+					if (result.is_ruled_out)
+					{
+						count_checked_file(group.size);
+						++m_files_ruled_out_by_partial_checksums;
+						m_bytes_used_for_ruled_out_files += group.size;
+					}
+					else
+					{
+						check_for_duplicates_in(item, record, checksum_lookup, result);
 					}
 				}
-				else
+				for (const auto& [checksum, files] : checksum_lookup)
 				{
-					for (const fs::directory_entry& dir_entry : fs::directory_iterator(path))
+					if (files.size() < 2)
+						continue;
+
+					if (m_confirm)
 					{
-						visit_dir_entry(dir_entry);
+						confirm_duplicates(checksum, files, group.size);
 					}
+					else
+					{
+						report_group(checksum, files, group.size);
+					}
+				}
+			}
+			pool.wait();
+		}
+
+		bool read_all_files()
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+			std::vector<std::wstring> roots;
+			for (const auto& path : m_pathlist)
+			{
+				roots.push_back(path.wstring());
+			}
+			directory_walker walker{ m_number_of_threads };
+			walker.use_instrumentation(m_instrumentation);
+			if (m_manifest.is_open())
+			{
+				walker.use_manifest(m_manifest);
+			}
+			bool succeeded = true;
+			if (m_memory_budget)
+			{
+				// the list of files is sorted on disk, and check_for_duplicates() picks it up from there. A file
+				// without a duplicate here may still have one on another machine, so the snapshot needs them all.
+				m_sorter = std::make_unique<file_record_sorter>(m_memory_budget, m_snapshot.is_open());
+				walker.walk(roots, m_recursive, *m_sorter);
+				succeeded = m_sorter->finish();
+				if (!succeeded)
+				{
+					console::writeline(CONSOLE_FOREGROUND_RED "Unable to sort the list of files, check the temporary directory" CONSOLE_STANDARD);
+				}
+			}
+			else
+			{
+				walker.walk(roots, m_recursive, m_files);
+				succeeded = !m_files.is_full();
+				if (!succeeded)
+				{
+					report_index_is_full();
 				}
+				m_files.sort_by_size();
+				count_links();
 			}
+			m_total_files = walker.number_of_files();
+			m_total_folders = walker.number_of_folders();
 			const auto finish = std::chrono::high_resolution_clock::now();
 			const auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(finish - start);
 			console::formatline(CONSOLE_FOREGROUND_GREEN "Took {:L} microseconds to scan {:L} files in {:L} folders" CONSOLE_STANDARD, microseconds.count(), m_total_files, m_total_folders);
+			if (walker.number_of_folders_reused())
+				console::formatline("Reused {:L} unchanged folders from the manifest", walker.number_of_folders_reused());
+			if (m_sorter && m_sorter->number_of_runs_written())
+				console::formatline("Sorted the files in {:L} temporary files", m_sorter->number_of_runs_written());
+			return succeeded;
 		}
 
 	private:
@@ -322,6 +1481,8 @@ namespace ngbtools
 		bool m_rename;
 		bool m_delete;
 		bool m_verify;
+		bool m_confirm;
+		bool m_merge;
 		uintmax_t m_total_files;
 		uintmax_t m_total_folders;
 		uintmax_t m_total_bytes_used;
@@ -331,10 +1492,60 @@ namespace ngbtools
 		uintmax_t m_bytes_used_for_checksums;
 		uintmax_t m_files_deleted;
 		uintmax_t m_bytes_used_for_deleted_files;
+		uintmax_t m_partial_checksums_calculated;
+		uintmax_t m_bytes_used_for_partial_checksums;
+		uintmax_t m_files_ruled_out_by_partial_checksums;
+		uintmax_t m_bytes_used_for_ruled_out_files;
+		uintmax_t m_cache_hits;
+		uintmax_t m_bytes_used_for_cache_hits;
+		uintmax_t m_cache_misses;
+		uintmax_t m_bytes_used_for_cache_misses;
+		uintmax_t m_files_compared;
+		uintmax_t m_bytes_used_for_comparing;
+		uintmax_t m_files_linked;
+		uintmax_t m_bytes_used_for_linked_files;
+		uintmax_t m_files_skipped_as_links;
+		uintmax_t m_bytes_used_for_skipped_links;
 		std::vector<fs::path> m_pathlist;
-		typedef std::vector<fs::path> files_with_same_size;
-		std::unordered_map<uintmax_t, std::unique_ptr<files_with_same_size>> m_lookup_by_size;
-		std::vector<char> m_buffer;
+		file_index m_files;
+		size_t m_memory_budget;
+		size_t m_progress_interval;
+		std::string m_trace_filename;
+		std::string m_snapshot_filename;
+		std::string m_host;
+		snapshot_writer m_snapshot;
+
+		// the hashing threads only ever add to its counters, so it may change in const functions
+		mutable instrumentation m_instrumentation;
+		std::unique_ptr<file_record_sorter> m_sorter;
+		size_t m_number_of_threads;
+		std::string m_cache_filename;
+		hash_cache m_cache;
+		std::string m_manifest_filename;
+		scan_manifest m_manifest;
+		std::string m_report_filename;
+		std::unique_ptr<duplicate_report> m_report;
+		read_method m_read_method;
+		hash_algorithm m_hash_algorithm;
+		link_method m_link_method;
+		std::unordered_map<uint32_t, bool> m_supports_block_cloning;
+		const md5_multibuffer m_multibuffer_md5;
+		file_comparer m_file_comparer;
+
+		// all threads share 64 MB of read buffers, but each gets at least 4 MB
+		static constexpr size_t TOTAL_BUFFER_SIZE = 1024 * 1024 * 64;
+		static constexpr size_t MINIMUM_BUFFER_SIZE_PER_THREAD = 1024 * 1024 * 4;
+
+		// partial checksums read this much from both the head and the tail of a file
+		static constexpr DWORD PARTIAL_CHECKSUM_BLOCK_SIZE = 1024 * 16;
+		static constexpr uintmax_t PARTIAL_CHECKSUM_MINIMUM_FILE_SIZE = 1024 * 1024;
+
+		// with /HASH MD5, files up to this size are read completely and hashed in batches by the multi-buffer MD5
+		static constexpr uintmax_t BATCHED_FILE_MAXIMUM_SIZE = 1024 * 256;
+		static constexpr size_t BATCH_MAXIMUM_FILES = 64;
+
+		// with /HASH BLAKE3, files of this size or more are hashed in segments by all threads
+		static constexpr uintmax_t TREE_HASH_MINIMUM_FILE_SIZE = 1024 * 1024 * 64;
 	};
 }
 
@@ -0,0 +1,440 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <ngbtools/console.h>
+#include <ngbtools/logging.h>
+#include <ngbtools/wstring.h>
+#include <ngbtools/work_stealing_pool.h>
+
+#include "file_index.h"
+#include "file_record_sorter.h"
+#include "scan_manifest.h"
+#include "instrumentation.h"
+
+namespace ngbtools
+{
+	/// <summary>
+	/// Enumerates directory trees on several threads at once. On network shares and other high-latency storage,
+	/// a single thread spends most of its time waiting for one directory listing after the other, so we keep
+	/// one request in flight per thread instead. Each directory is read in bulk, many entries per call,
+	/// including size and file id, so files never need to be opened or queried one by one.
+	///
+	/// Every thread collects what it finds in its own buffers. At the end, the directories are sorted by path
+	/// and added to the file index, so the result doesn't depend on the number of threads or on timing.
+	/// Alternatively, each directory is handed to a file_record_sorter as soon as it has been read, so that
+	/// the buffers never hold more than one directory per thread.
+	///
+	/// With a scan_manifest, directories that haven't changed since the last scan are not read at all.
+	/// </summary>
+	class directory_walker final
+	{
+	public:
+		explicit directory_walker(size_t number_of_threads)
+			:
+			m_number_of_threads{ number_of_threads },
+			m_sorter{ nullptr },
+			m_manifest{ nullptr },
+			m_instrumentation{ nullptr },
+			m_number_of_files{ 0 },
+			m_number_of_folders{ 0 },
+			m_number_of_folders_reused{ 0 }
+		{
+		}
+
+		/// <summary>
+		/// Enumerate all roots and add every file found to the index
+		/// </summary>
+		/// <param name="roots">directories to enumerate</param>
+		/// <param name="recursive">true to include subdirectories</param>
+		/// <param name="index">receives all files found</param>
+		void walk(const std::vector<std::wstring>& roots, bool recursive, file_index& index)
+		{
+			m_sorter = nullptr;
+			enumerate_all(roots, recursive);
+			merge(index);
+			std::vector<worker_state>{}.swap(m_workers);
+		}
+
+		/// <summary>
+		/// Enumerate all roots and pass every file found to the sorter. The files arrive in no particular order,
+		/// the sorter takes care of that.
+		/// </summary>
+		void walk(const std::vector<std::wstring>& roots, bool recursive, file_record_sorter& sorter)
+		{
+			m_sorter = &sorter;
+			enumerate_all(roots, recursive);
+			m_sorter = nullptr;
+			std::vector<worker_state>{}.swap(m_workers);
+		}
+
+		uint64_t number_of_files() const
+		{
+			return m_number_of_files;
+		}
+
+		uint64_t number_of_folders() const
+		{
+			return m_number_of_folders;
+		}
+
+		/// <summary>
+		/// Number of folders that were unchanged since the last scan, so their contents came from the manifest
+		/// </summary>
+		uint64_t number_of_folders_reused() const
+		{
+			return m_number_of_folders_reused;
+		}
+
+		/// <summary>
+		/// Use the manifest of the last scan to skip reading unchanged directories, and record this scan in it
+		/// </summary>
+		void use_manifest(scan_manifest& manifest)
+		{
+			m_manifest = &manifest;
+		}
+
+		/// <summary>
+		/// Count the time spent reading each directory, and the files found
+		/// </summary>
+		void use_instrumentation(instrumentation& instrumentation)
+		{
+			m_instrumentation = &instrumentation;
+		}
+
+	private:
+		directory_walker(const directory_walker&) = delete;
+		directory_walker& operator=(const directory_walker&) = delete;
+		directory_walker(directory_walker&&) = delete;
+		directory_walker& operator=(directory_walker&&) = delete;
+
+		struct found_file
+		{
+			uint64_t size;
+			uint64_t file_id;
+
+			// position of the name in worker_state::names
+			size_t name;
+			size_t name_length;
+		};
+
+		struct found_directory
+		{
+			size_t root;
+			std::wstring pathname;
+			uint32_t volume_serial_number;
+
+			// the files of a directory are always found by the same thread, so they are a range in its buffer
+			size_t first_file;
+			size_t number_of_files;
+		};
+
+		struct worker_state
+		{
+			std::vector<found_directory> directories;
+			std::vector<found_file> files;
+			std::wstring names;
+
+			// FILE_ID_BOTH_DIR_INFO must be 8-byte aligned
+			std::vector<uint64_t> buffer;
+
+			// what we found in the directory being read, for the next scan
+			scan_manifest::directory_builder manifest;
+		};
+
+		void enumerate_all(const std::vector<std::wstring>& roots, bool recursive)
+		{
+			m_workers.clear();
+			m_workers.resize(m_number_of_threads);
+			work_stealing_pool pool{ m_number_of_threads };
+			std::unique_ptr<instrumentation::watched_pool> watch;
+			if (m_instrumentation)
+			{
+				watch = std::make_unique<instrumentation::watched_pool>(*m_instrumentation, pool);
+			}
+			for (size_t root = 0; root < roots.size(); ++root)
+			{
+				pool.submit([this, &pool, root, pathname = roots[root], recursive](size_t worker_index)
+					{
+						enumerate(pool, worker_index, root, pathname, recursive);
+					});
+			}
+			pool.wait();
+		}
+
+		void enumerate(work_stealing_pool& pool, size_t worker_index, size_t root, const std::wstring& pathname, bool recursive)
+		{
+			if (!m_instrumentation)
+			{
+				read_directory(pool, worker_index, root, pathname, recursive);
+				return;
+			}
+			instrumentation::timer timer{ *m_instrumentation, activity::ENUMERATE };
+			read_directory(pool, worker_index, root, pathname, recursive);
+		}
+
+		// this is called on the worker threads: anything found goes into the buffers of the calling thread
+		void read_directory(work_stealing_pool& pool, size_t worker_index, size_t root, const std::wstring& pathname, bool recursive)
+		{
+			auto& worker{ m_workers[worker_index] };
+			if (worker.buffer.empty())
+			{
+				worker.buffer.resize(BUFFER_SIZE / sizeof(uint64_t));
+			}
+
+			HANDLE hDirectory = ::CreateFileW(pathname.c_str(), FILE_LIST_DIRECTORY | FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+			if (hDirectory == INVALID_HANDLE_VALUE)
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("CreateFileW({}) failed", wstring::encode_as_utf8(pathname)));
+				return;
+			}
+
+			BY_HANDLE_FILE_INFORMATION info{};
+			if (!::GetFileInformationByHandle(hDirectory, &info))
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("GetFileInformationByHandle({}) failed", wstring::encode_as_utf8(pathname)));
+				::CloseHandle(hDirectory);
+				return;
+			}
+			++m_number_of_folders;
+
+			found_directory directory{ root, pathname, info.dwVolumeSerialNumber, worker.files.size(), 0 };
+			const uint64_t last_write_time{ ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime };
+			if (m_manifest)
+			{
+				if (const auto known{ m_manifest->find(pathname, info.dwVolumeSerialNumber, last_write_time) })
+				{
+					// unchanged since the last scan, so there is no need to read it
+					::CloseHandle(hDirectory);
+					++m_number_of_folders_reused;
+					scan_manifest::for_each_entry(known,
+						[this, &worker](std::wstring_view name, uint64_t size, uint64_t file_id)
+						{
+							add_file(worker, name, size, file_id);
+						},
+						[this, &pool, worker_index, root, &pathname, recursive](std::wstring_view name)
+						{
+							if (recursive)
+							{
+								enumerate_later(pool, worker_index, root, child_pathname(pathname, name), recursive);
+							}
+						});
+					m_manifest->store(known);
+					finish_directory(worker, std::move(directory));
+					return;
+				}
+				worker.manifest.begin(pathname, info.dwVolumeSerialNumber, last_write_time);
+			}
+			const bool use_file_ids{ has_unique_file_ids(hDirectory, info.dwVolumeSerialNumber, pathname) };
+
+			bool is_complete = true;
+			auto information_class{ FileIdBothDirectoryRestartInfo };
+			for (;;)
+			{
+				if (!::GetFileInformationByHandleEx(hDirectory, information_class, worker.buffer.data(), (DWORD)(worker.buffer.size() * sizeof(uint64_t))))
+				{
+					const auto error{ GetLastError() };
+					if (error != ERROR_NO_MORE_FILES)
+					{
+						logging::report_windows_error(error, FUNCTION_CONTEXT,
+							fmt::format("GetFileInformationByHandleEx({}) failed", wstring::encode_as_utf8(pathname)));
+						is_complete = false;
+					}
+					break;
+				}
+				information_class = FileIdBothDirectoryInfo;
+
+				auto entry{ (const FILE_ID_BOTH_DIR_INFO*)worker.buffer.data() };
+				for (;;)
+				{
+					const std::wstring_view name{ entry->FileName, entry->FileNameLength / sizeof(wchar_t) };
+					if (entry->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+					{
+						// junctions and directory symlinks are not followed, so we cannot run in circles
+						if ((name != L".") && (name != L"..") && !(entry->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+						{
+							if (m_manifest)
+							{
+								worker.manifest.add_subdirectory(name);
+							}
+							if (recursive)
+							{
+								enumerate_later(pool, worker_index, root, child_pathname(pathname, name), recursive);
+							}
+						}
+					}
+					else if (!is_symbolic_link(*entry))
+					{
+						const uint64_t file_id{ use_file_ids ? (uint64_t)entry->FileId.QuadPart : 0 };
+						if (m_manifest)
+						{
+							worker.manifest.add_file(name, (uint64_t)entry->EndOfFile.QuadPart, file_id);
+						}
+						add_file(worker, name, (uint64_t)entry->EndOfFile.QuadPart, file_id);
+					}
+					if (!entry->NextEntryOffset)
+						break;
+
+					entry = (const FILE_ID_BOTH_DIR_INFO*)((const char*)entry + entry->NextEntryOffset);
+				}
+			}
+			::CloseHandle(hDirectory);
+
+			// a directory we couldn't read completely is read again next time
+			if (m_manifest && is_complete)
+			{
+				m_manifest->store(worker.manifest.finish());
+			}
+			finish_directory(worker, std::move(directory));
+		}
+
+		// file symlinks are listed with the size and id of the link, not of its target, so they would all look alike.
+		// Other reparse points, like deduplicated files or cloud placeholders, are files in their own right.
+		static bool is_symbolic_link(const FILE_ID_BOTH_DIR_INFO& entry)
+		{
+			// for reparse points, EaSize holds the reparse tag
+			return (entry.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) && (entry.EaSize == IO_REPARSE_TAG_SYMLINK);
+		}
+
+		// only NTFS guarantees that the 64-bit file ids of a directory listing are unique on the volume. ReFS has
+		// 128-bit ids, and other file systems may have none at all, so there files are recorded without an id,
+		// and file_index doesn't mistake different files for links of each other.
+		bool has_unique_file_ids(HANDLE hDirectory, uint32_t volume_serial_number, const std::wstring& pathname)
+		{
+			std::lock_guard<std::mutex> lock{ m_volume_lock };
+			const auto known{ m_has_unique_file_ids.find(volume_serial_number) };
+			if (known != m_has_unique_file_ids.end())
+				return known->second;
+
+			wchar_t file_system_name[MAX_PATH + 1];
+			if (!::GetVolumeInformationByHandleW(hDirectory, nullptr, 0, nullptr, nullptr, nullptr, file_system_name, MAX_PATH + 1))
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("GetVolumeInformationByHandleW({}) failed", wstring::encode_as_utf8(pathname)));
+				return false;
+			}
+			const bool result{ wstring::equals_nocase(file_system_name, L"NTFS") };
+			m_has_unique_file_ids.emplace(volume_serial_number, result);
+			return result;
+		}
+
+		void enumerate_later(work_stealing_pool& pool, size_t worker_index, size_t root, std::wstring pathname, bool recursive)
+		{
+			pool.submit(worker_index, [this, &pool, root, pathname = std::move(pathname), recursive](size_t worker_index)
+				{
+					enumerate(pool, worker_index, root, pathname, recursive);
+				});
+		}
+
+		void add_file(worker_state& worker, std::wstring_view name, uint64_t size, uint64_t file_id)
+		{
+			worker.files.push_back({ size, file_id, worker.names.size(), name.size() });
+			worker.names.append(name);
+
+			const auto number_of_files{ ++m_number_of_files };
+			if (((number_of_files % 10000) == 0) && !(m_instrumentation && m_instrumentation->reports_progress()))
+			{
+				console::formatline("- {:L} files read...", number_of_files);
+			}
+		}
+
+		void finish_directory(worker_state& worker, found_directory&& directory)
+		{
+			directory.number_of_files = worker.files.size() - directory.first_file;
+			if (m_instrumentation)
+			{
+				m_instrumentation->found_files(directory.number_of_files);
+			}
+			if (m_sorter)
+			{
+				pass_to_sorter(worker, directory);
+				return;
+			}
+			worker.directories.push_back(std::move(directory));
+		}
+
+		// with a sorter, the buffers of a thread only ever hold the directory it is reading
+		void pass_to_sorter(worker_state& worker, const found_directory& directory)
+		{
+			if (directory.number_of_files)
+			{
+				std::lock_guard<std::mutex> lock{ m_sorter_lock };
+				m_sorter->add_directory((uint32_t)directory.root, directory.pathname, directory.volume_serial_number);
+				for (size_t file = directory.first_file; file < directory.first_file + directory.number_of_files; ++file)
+				{
+					const auto& found{ worker.files[file] };
+					m_sorter->add_file(std::wstring_view{ worker.names }.substr(found.name, found.name_length), found.size, found.file_id);
+				}
+			}
+			worker.files.clear();
+			worker.names.clear();
+		}
+
+		static std::wstring child_pathname(const std::wstring& pathname, std::wstring_view name)
+		{
+			std::wstring result{ pathname };
+			if (!result.empty() && (result.back() != L'\\') && (result.back() != L'/'))
+			{
+				result.push_back(L'\\');
+			}
+			result.append(name);
+			return result;
+		}
+
+		void merge(file_index& index) const
+		{
+			std::vector<std::pair<const worker_state*, const found_directory*>> directories;
+			for (const auto& worker : m_workers)
+			{
+				for (const auto& directory : worker.directories)
+				{
+					directories.emplace_back(&worker, &directory);
+				}
+			}
+			std::sort(directories.begin(), directories.end(), [](const auto& a, const auto& b)
+				{
+					if (a.second->root != b.second->root)
+						return a.second->root < b.second->root;
+
+					return file_index::path_is_less(a.second->pathname, b.second->pathname);
+				});
+
+			for (const auto& [worker, directory] : directories)
+			{
+				if (!directory->number_of_files)
+					continue;
+
+				const auto id{ index.add_directory(directory->pathname, directory->volume_serial_number) };
+				for (size_t file = directory->first_file; file < directory->first_file + directory->number_of_files; ++file)
+				{
+					const auto& found{ worker->files[file] };
+					index.add_file(id, std::wstring_view{ worker->names }.substr(found.name, found.name_length), found.size, found.file_id);
+				}
+			}
+		}
+
+	private:
+		// a bulk directory listing returns as many entries as fit into this
+		static constexpr size_t BUFFER_SIZE = 1024 * 64;
+
+		const size_t m_number_of_threads;
+		std::vector<worker_state> m_workers;
+		file_record_sorter* m_sorter;
+		std::mutex m_sorter_lock;
+		std::mutex m_volume_lock;
+		std::unordered_map<uint32_t, bool> m_has_unique_file_ids;
+		scan_manifest* m_manifest;
+		instrumentation* m_instrumentation;
+		std::atomic<uint64_t> m_number_of_files;
+		std::atomic<uint64_t> m_number_of_folders;
+		std::atomic<uint64_t> m_number_of_folders_reused;
+	};
+}
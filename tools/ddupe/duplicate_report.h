@@ -0,0 +1,350 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <ngbtools/string.h>
+#include <ngbtools/segmented_writer.h>
+#include <ngbtools/digest.h>
+#include <ngbtools/hasher.h>
+#include <ngbtools/logging.h>
+#include <ngbtools/windows_errors.h>
+
+namespace ngbtools
+{
+	/// <summary>
+	/// The formats a duplicate_report can be written in
+	/// </summary>
+	enum class report_format
+	{
+		/// <summary>one JSON object per line</summary>
+		JSON,
+
+		/// <summary>compact binary records, see binary_report</summary>
+		BINARY,
+	};
+
+	/// <summary>
+	/// What ddupe found, for other tools to read: the checksum of every file, and every group of duplicates.
+	/// Records are collected in a chain of segments and written to the file in big chunks, so writing the report
+	/// costs next to nothing compared with hashing.
+	/// </summary>
+	class duplicate_report
+	{
+	public:
+		duplicate_report()
+			:
+			m_hFile{ INVALID_HANDLE_VALUE },
+			m_succeeded{ true }
+		{
+		}
+
+		virtual ~duplicate_report()
+		{
+			close();
+		}
+
+	private:
+		duplicate_report(const duplicate_report&) = delete;
+		duplicate_report& operator=(const duplicate_report&) = delete;
+		duplicate_report(duplicate_report&&) = delete;
+		duplicate_report& operator=(duplicate_report&&) = delete;
+
+	public:
+		/// <summary>
+		/// Create the report file, replacing any existing file
+		/// </summary>
+		/// <param name="pathname">report filename</param>
+		/// <param name="algorithm">algorithm all checksums are calculated with</param>
+		/// <returns>true if the file was created, or false otherwise</returns>
+		bool open(std::string_view pathname, hash_algorithm algorithm)
+		{
+			close();
+			m_hFile = ::CreateFileW(string::encode_as_utf16(pathname).c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+			if (m_hFile == INVALID_HANDLE_VALUE)
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("CreateFileW({}) failed", pathname));
+				return false;
+			}
+			m_pathname = pathname;
+			m_succeeded = true;
+			header(algorithm);
+			return true;
+		}
+
+		/// <summary>
+		/// Write all pending records and close the file
+		/// </summary>
+		/// <returns>true if the whole report could be written, or false otherwise</returns>
+		bool close()
+		{
+			if (m_hFile == INVALID_HANDLE_VALUE)
+				return true;
+
+			const bool succeeded{ flush() && m_succeeded };
+			::CloseHandle(m_hFile);
+			m_hFile = INVALID_HANDLE_VALUE;
+			m_pathname.clear();
+			return succeeded;
+		}
+
+		/// <summary>
+		/// Report the checksum of a file
+		/// </summary>
+		void file(std::string_view pathname, uint64_t size, const digest& checksum)
+		{
+			file_record(pathname, size, checksum);
+			flush_if_full();
+		}
+
+		/// <summary>
+		/// Report a group of identical files
+		/// </summary>
+		/// <param name="size">size of every file</param>
+		/// <param name="checksum">checksum of every file</param>
+		/// <param name="pathnames">the original first, then its duplicates</param>
+		void duplicates(uint64_t size, const digest& checksum, const std::vector<std::string_view>& pathnames)
+		{
+			duplicates_record(size, checksum, pathnames);
+			flush_if_full();
+		}
+
+		static std::unique_ptr<duplicate_report> create(report_format format);
+
+		static bool parse_format(std::string_view name, report_format& result)
+		{
+			if (string::equals_nocase(name, "JSON"))
+				result = report_format::JSON;
+			else if (string::equals_nocase(name, "BINARY"))
+				result = report_format::BINARY;
+			else
+				return false;
+			return true;
+		}
+
+	protected:
+		virtual void header(hash_algorithm algorithm) = 0;
+		virtual void file_record(std::string_view pathname, uint64_t size, const digest& checksum) = 0;
+		virtual void duplicates_record(uint64_t size, const digest& checksum, const std::vector<std::string_view>& pathnames) = 0;
+
+		void append(const void* data, size_t size)
+		{
+			if (!m_buffer.append(std::string_view{ (const char*)data, size }))
+			{
+				m_succeeded = false;
+			}
+		}
+
+		void append(std::string_view text)
+		{
+			append(text.data(), text.size());
+		}
+
+	private:
+		void flush_if_full()
+		{
+			if (m_buffer.size() >= BUFFER_SIZE)
+			{
+				m_succeeded = flush() && m_succeeded;
+			}
+		}
+
+		bool flush()
+		{
+			if (!m_buffer.write_to(m_hFile))
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("WriteFile({}) failed", m_pathname));
+				m_buffer.clear();
+				return false;
+			}
+			m_buffer.clear();
+			return true;
+		}
+
+	private:
+		static constexpr size_t BUFFER_SIZE = 1024 * 1024 * 4;
+
+		HANDLE m_hFile;
+		std::string m_pathname;
+		string::segmented_writer m_buffer;
+		bool m_succeeded;
+	};
+
+	/// <summary>
+	/// JSON Lines: every line is a JSON object, with "type" telling what it is
+	///
+	///		{"type":"header","version":1,"algorithm":"FAST128"}
+	///		{"type":"file","path":"C:\\A\\B.jpg","size":1234,"checksum":"0123..."}
+	///		{"type":"duplicates","size":1234,"checksum":"0123...","original":"C:\\A\\B.jpg","duplicates":["C:\\C\\B.jpg"]}
+	/// </summary>
+	class json_report final : public duplicate_report
+	{
+	public:
+		~json_report() override
+		{
+			close();
+		}
+
+	protected:
+		void header(hash_algorithm algorithm) override
+		{
+			append("{\"type\":\"header\",\"version\":1,\"algorithm\":\"");
+			append(hasher::name(algorithm));
+			append("\"}\n");
+		}
+
+		void file_record(std::string_view pathname, uint64_t size, const digest& checksum) override
+		{
+			append("{\"type\":\"file\",\"path\":");
+			append_string(pathname);
+			append_size_and_checksum(size, checksum);
+			append("}\n");
+		}
+
+		void duplicates_record(uint64_t size, const digest& checksum, const std::vector<std::string_view>& pathnames) override
+		{
+			append("{\"type\":\"duplicates\"");
+			append_size_and_checksum(size, checksum);
+			append(",\"original\":");
+			append_string(pathnames.front());
+			append(",\"duplicates\":[");
+			for (size_t index = 1; index < pathnames.size(); ++index)
+			{
+				if (index > 1)
+				{
+					append(",");
+				}
+				append_string(pathnames[index]);
+			}
+			append("]}\n");
+		}
+
+	private:
+		void append_size_and_checksum(uint64_t size, const digest& checksum)
+		{
+			char text[32 + digest::MAXIMUM_SIZE * 2];
+			append(",\"size\":");
+			append(std::string_view{ text, (size_t)(fmt::format_to(text, "{}", size) - text) });
+			append(",\"checksum\":\"");
+			checksum.to_hex(text);
+			append(text, checksum.size() * 2);
+			append("\"");
+		}
+
+		// pathnames are UTF-8 already, so only quotes, backslashes and control characters need escaping
+		void append_string(std::string_view text)
+		{
+			append("\"");
+			size_t start = 0;
+			for (size_t index = 0; index < text.size(); ++index)
+			{
+				const auto c{ (unsigned char)text[index] };
+				if ((c >= 0x20) && (c != '"') && (c != '\\'))
+					continue;
+
+				append(text.substr(start, index - start));
+				if ((c == '"') || (c == '\\'))
+				{
+					const char escaped[2]{ '\\', (char)c };
+					append(escaped, sizeof(escaped));
+				}
+				else
+				{
+					const char escaped[6]{ '\\', 'u', '0', '0', string::hex_digit(c >> 4), string::hex_digit(c & 0xF) };
+					append(escaped, sizeof(escaped));
+				}
+				start = index + 1;
+			}
+			append(text.substr(start));
+			append("\"");
+		}
+	};
+
+	/// <summary>
+	/// Binary records, all numbers little-endian and nothing aligned. The file starts with the 8 characters
+	/// DDUPE-RP, a uint32_t version (1) and the uint16_t hash_algorithm. Then follow records, each starting
+	/// with a uint8_t type:
+	///
+	///		FILE: uint64_t size, digest, string
+	///		DUPLICATES: uint64_t size, digest, uint32_t number of files, then that many strings (the original first)
+	///
+	/// A digest is a uint8_t size and that many bytes; a string is a uint32_t size and that many bytes of UTF-8.
+	/// </summary>
+	class binary_report final : public duplicate_report
+	{
+	public:
+		enum : uint8_t
+		{
+			FILE = 1,
+			DUPLICATES = 2,
+		};
+
+		~binary_report() override
+		{
+			close();
+		}
+
+	protected:
+		void header(hash_algorithm algorithm) override
+		{
+			append("DDUPE-RP");
+			append_number((uint32_t)1);
+			append_number((uint16_t)algorithm);
+		}
+
+		void file_record(std::string_view pathname, uint64_t size, const digest& checksum) override
+		{
+			append_number(FILE);
+			append_number(size);
+			append_digest(checksum);
+			append_string(pathname);
+		}
+
+		void duplicates_record(uint64_t size, const digest& checksum, const std::vector<std::string_view>& pathnames) override
+		{
+			append_number(DUPLICATES);
+			append_number(size);
+			append_digest(checksum);
+			append_number((uint32_t)pathnames.size());
+			for (const auto& pathname : pathnames)
+			{
+				append_string(pathname);
+			}
+		}
+
+	private:
+		// Windows only runs little-endian
+		template <typename T> void append_number(T value)
+		{
+			append(&value, sizeof(value));
+		}
+
+		void append_digest(const digest& checksum)
+		{
+			append_number((uint8_t)checksum.size());
+			append(checksum.data(), checksum.size());
+		}
+
+		void append_string(std::string_view text)
+		{
+			append_number((uint32_t)text.size());
+			append(text);
+		}
+	};
+
+	inline std::unique_ptr<duplicate_report> duplicate_report::create(report_format format)
+	{
+		switch (format)
+		{
+		case report_format::BINARY:
+			return std::make_unique<binary_report>();
+		default:
+			return std::make_unique<json_report>();
+		}
+	}
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <ngbtools/string.h>
+#include <ngbtools/logging.h>
+#include <ngbtools/windows_errors.h>
+#include <ngbtools/file_reader.h>
+
+namespace ngbtools
+{
+	/// <summary>
+	/// Compares any number of files of the same size byte for byte. All files are read in lock-step, one chunk
+	/// at a time, and the set of files is split as soon as their contents diverge. A file that no longer
+	/// matches any other is not read any further, so in total every file is read at most once - unlike
+	/// comparing each pair of files, which would read a group of N files N-1 times.
+	/// </summary>
+	class file_comparer final
+	{
+	public:
+		/// <param name="buffer_size">total size of the read buffers, shared by all files compared at once</param>
+		explicit file_comparer(size_t buffer_size)
+			:
+			m_buffer_size{ buffer_size },
+			m_bytes_read{ 0 }
+		{
+		}
+
+		/// <summary>
+		/// Split files into sets of files with identical contents
+		/// </summary>
+		/// <param name="pathnames">files to compare</param>
+		/// <param name="file_size">size of every file</param>
+		/// <param name="result">receives the sets as indices into pathnames, in ascending order. A file that
+		/// matches no other is a set of its own; a file that cannot be read is not part of any set.</param>
+		void compare(const std::vector<std::string>& pathnames, uint64_t file_size, std::vector<std::vector<size_t>>& result)
+		{
+			result.clear();
+
+			std::vector<member> all;
+			for (size_t index = 0; index < pathnames.size(); ++index)
+			{
+				const auto wstr_pathname{ string::encode_as_utf16(pathnames[index]) };
+				HANDLE hFile = ::CreateFileW(wstr_pathname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+				if (hFile == INVALID_HANDLE_VALUE)
+				{
+					logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+						fmt::format("CreateFileW({}) failed", pathnames[index]));
+					continue;
+				}
+				if (!file_reader::has_expected_size(hFile, pathnames[index], file_size))
+				{
+					::CloseHandle(hFile);
+					continue;
+				}
+				all.push_back({ index, hFile, nullptr });
+			}
+			if (all.empty())
+				return;
+
+			// the more files we compare at once, the smaller the chunks
+			const auto chunk_size{ std::clamp<size_t>(m_buffer_size / all.size(), MINIMUM_CHUNK_SIZE, MAXIMUM_CHUNK_SIZE) & ~(MINIMUM_CHUNK_SIZE - 1) };
+			m_buffer.resize(chunk_size * all.size());
+			for (size_t index = 0; index < all.size(); ++index)
+			{
+				all[index].buffer = &m_buffer[index * chunk_size];
+			}
+
+			std::vector<std::vector<member>> candidates;
+			candidates.push_back(std::move(all));
+			for (uint64_t offset = 0; (offset < file_size) && !candidates.empty(); )
+			{
+				const auto bytes_to_read{ (DWORD)std::min<uint64_t>(chunk_size, file_size - offset) };
+				std::vector<std::vector<member>> still_candidates;
+				for (auto& candidate : candidates)
+				{
+					m_bytes_read += candidate.size() * (uint64_t)bytes_to_read;
+					for (auto& split : split_by_contents(candidate, pathnames, bytes_to_read))
+					{
+						if (split.size() > 1)
+						{
+							still_candidates.push_back(std::move(split));
+						}
+						else
+						{
+							finish(split, result);
+						}
+					}
+				}
+				candidates = std::move(still_candidates);
+				offset += bytes_to_read;
+			}
+			for (auto& candidate : candidates)
+			{
+				finish(candidate, result);
+			}
+			std::sort(result.begin(), result.end());
+		}
+
+		/// <summary>
+		/// Total number of bytes read by all calls to compare()
+		/// </summary>
+		uint64_t bytes_read() const
+		{
+			return m_bytes_read;
+		}
+
+	private:
+		file_comparer(const file_comparer&) = delete;
+		file_comparer& operator=(const file_comparer&) = delete;
+		file_comparer(file_comparer&&) = delete;
+		file_comparer& operator=(file_comparer&&) = delete;
+
+		struct member
+		{
+			size_t index;
+			HANDLE hFile;
+			char* buffer;
+		};
+
+		// reads the next chunk of every file and splits them into sets of identical chunks. Files that
+		// cannot be read are closed and dropped.
+		static std::vector<std::vector<member>> split_by_contents(std::vector<member>& candidate, const std::vector<std::string>& pathnames, DWORD bytes_to_read)
+		{
+			std::vector<std::vector<member>> result;
+			for (auto& file : candidate)
+			{
+				DWORD bytes_read = 0;
+				if (!::ReadFile(file.hFile, file.buffer, bytes_to_read, &bytes_read, nullptr) || (bytes_read != bytes_to_read))
+				{
+					logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+						fmt::format("ReadFile({}) failed", pathnames[file.index]));
+					::CloseHandle(file.hFile);
+					continue;
+				}
+
+				const auto same{ std::find_if(result.begin(), result.end(), [&file, bytes_to_read](const std::vector<member>& split)
+					{
+						return !memcmp(split.front().buffer, file.buffer, bytes_to_read);
+					}) };
+				if (same == result.end())
+				{
+					result.push_back({ file });
+				}
+				else
+				{
+					same->push_back(file);
+				}
+			}
+			return result;
+		}
+
+		static void finish(const std::vector<member>& files, std::vector<std::vector<size_t>>& result)
+		{
+			std::vector<size_t> indices;
+			for (const auto& file : files)
+			{
+				::CloseHandle(file.hFile);
+				indices.push_back(file.index);
+			}
+			result.push_back(std::move(indices));
+		}
+
+	private:
+		static constexpr size_t MINIMUM_CHUNK_SIZE = 1024 * 4;
+		static constexpr size_t MAXIMUM_CHUNK_SIZE = 1024 * 1024;
+
+		const size_t m_buffer_size;
+		std::vector<char> m_buffer;
+		uint64_t m_bytes_read;
+	};
+}
@@ -0,0 +1,337 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <filesystem>
+
+namespace ngbtools
+{
+	/// <summary>
+	/// All files found while scanning, grouped by size. A scan over a whole NAS volume easily finds tens of
+	/// millions of files, so this avoids a heap allocation per file: a file is a 24-byte record in one flat
+	/// array, and its name lives in a segmented string arena. Each directory path is stored only once and
+	/// shared by all files in it.
+	///
+	/// Hard links (and other paths that lead to the same file, like a share mounted twice) are collapsed
+	/// into a single record, so that a file is never read twice or reported as a duplicate of itself.
+	///
+	/// usage: add_directory() and add_file() while scanning, then sort_by_size() once and use groups()
+	/// </summary>
+	class file_index final
+	{
+	public:
+		struct file_record
+		{
+			uint64_t size;
+
+			// unique per volume: together with the volume serial number of the directory, this identifies the file.
+			// 0 if the file system has no unique 64-bit ids (see directory_walker)
+			uint64_t file_id;
+
+			// offset of the zero-terminated filename in the arena
+			uint32_t name;
+
+			// index into m_directories
+			uint32_t directory;
+		};
+		static_assert(sizeof(file_record) == 24);
+
+		/// <summary>
+		/// A run of files with the same size, as returned by groups()
+		/// </summary>
+		struct group
+		{
+			uint64_t size;
+			size_t first;
+			size_t count;
+		};
+
+		file_index()
+			:
+			m_segment_used{ 0 },
+			m_last_directory{ NO_DIRECTORY },
+			m_is_full{ false }
+		{
+		}
+
+		/// <summary>
+		/// Get the id of a directory, adding it if it is new
+		/// </summary>
+		/// <param name="pathname">full path of the directory</param>
+		/// <param name="volume_serial_number">serial number of the volume the directory is on</param>
+		/// <returns>id to pass to add_file(), which ignores it if the index is_full()</returns>
+		uint32_t add_directory(std::wstring_view pathname, uint32_t volume_serial_number)
+		{
+			// files arrive directory by directory, so this is almost always the same as last time
+			if ((m_last_directory != NO_DIRECTORY) && (directory(m_last_directory) == pathname))
+				return m_last_directory;
+
+			const auto existing{ m_directory_lookup.find(std::wstring{ pathname }) };
+			if (existing != m_directory_lookup.end())
+			{
+				m_last_directory = existing->second;
+				return m_last_directory;
+			}
+
+			uint32_t name;
+			if (!add_string(pathname, name))
+				return NO_DIRECTORY;
+
+			m_last_directory = (uint32_t)m_directories.size();
+			m_directories.push_back({ name, volume_serial_number });
+			m_directory_lookup.emplace(pathname, m_last_directory);
+			return m_last_directory;
+		}
+
+		void add_file(uint32_t directory, std::wstring_view filename, uint64_t size, uint64_t file_id)
+		{
+			uint32_t name;
+			if ((directory == NO_DIRECTORY) || !add_string(filename, name))
+				return;
+
+			m_files.push_back({ size, file_id, name, directory });
+		}
+
+		/// <summary>
+		/// True once the names no longer fit: a file_record addresses them with 32 bits, so there is room for
+		/// 4 G characters of names. From then on, nothing is added, so the index is incomplete.
+		/// </summary>
+		bool is_full() const
+		{
+			return m_is_full;
+		}
+
+		/// <summary>
+		/// Sort the files by size. Files of the same size keep the order in which they were added,
+		/// so the first one found is still the one that survives as the original. Any further names
+		/// of a file are moved from the index to links().
+		/// </summary>
+		void sort_by_size()
+		{
+			std::stable_sort(m_files.begin(), m_files.end(), [](const file_record& a, const file_record& b)
+				{
+					return a.size < b.size;
+				});
+			remove_links();
+
+			// the lookup is only needed while scanning
+			std::unordered_map<std::wstring, uint32_t>{}.swap(m_directory_lookup);
+			m_last_directory = NO_DIRECTORY;
+		}
+
+		/// <summary>
+		/// Get all runs of at least minimum_count files with the same size. Only valid after sort_by_size().
+		/// </summary>
+		std::vector<group> groups(size_t minimum_count) const
+		{
+			std::vector<group> result;
+			for (size_t first = 0; first < m_files.size(); )
+			{
+				size_t next = first + 1;
+				while ((next < m_files.size()) && (m_files[next].size == m_files[first].size))
+					++next;
+
+				if (next - first >= minimum_count)
+				{
+					result.push_back({ m_files[first].size, first, next - first });
+				}
+				first = next;
+			}
+			return result;
+		}
+
+		const file_record& operator[](size_t index) const
+		{
+			return m_files[index];
+		}
+
+		size_t size() const
+		{
+			return m_files.size();
+		}
+
+		/// <summary>
+		/// The names removed by sort_by_size() because an earlier name of the same file is in the index
+		/// </summary>
+		const std::vector<file_record>& links() const
+		{
+			return m_links;
+		}
+
+		std::wstring_view filename(const file_record& record) const
+		{
+			return string_at(record.name);
+		}
+
+		std::wstring_view directory(uint32_t id) const
+		{
+			return string_at(m_directories[id].name);
+		}
+
+		uint32_t volume_serial_number(const file_record& record) const
+		{
+			return m_directories[record.directory].volume_serial_number;
+		}
+
+		/// <summary>
+		/// Remove all files and directories, so that the index can be filled again
+		/// </summary>
+		void clear()
+		{
+			m_files.clear();
+			m_links.clear();
+			m_directories.clear();
+			m_segments.clear();
+			m_segment_used = 0;
+			m_directory_lookup.clear();
+			m_last_directory = NO_DIRECTORY;
+			m_is_full = false;
+		}
+
+		/// <summary>
+		/// Approximate number of bytes used by the index
+		/// </summary>
+		size_t memory_usage() const
+		{
+			return (m_files.capacity() + m_links.capacity()) * sizeof(file_record) +
+				m_directories.capacity() * sizeof(directory_record) +
+				m_segments.size() * SEGMENT_SIZE * sizeof(wchar_t);
+		}
+
+		/// <summary>
+		/// The order in which directories are added to the index. Separators sort before any other character,
+		/// so a directory comes before its subdirectories, and all files of a directory come before the files of
+		/// any of its subdirectories - unlike with a recursive_directory_iterator, which descends into each
+		/// subdirectory where the listing has it. Subdirectories follow in the order of their names.
+		/// </summary>
+		static bool path_is_less(std::wstring_view a, std::wstring_view b)
+		{
+			return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](wchar_t x, wchar_t y)
+				{
+					return path_sort_key(x) < path_sort_key(y);
+				});
+		}
+
+		/// <summary>
+		/// Build the full path of a file. This allocates, so only do it for files that are actually looked at.
+		/// </summary>
+		std::filesystem::path path(const file_record& record) const
+		{
+			std::filesystem::path result{ directory(record.directory) };
+			result /= filename(record);
+			return result;
+		}
+
+	private:
+		file_index(const file_index&) = delete;
+		file_index& operator=(const file_index&) = delete;
+		file_index(file_index&&) = delete;
+		file_index& operator=(file_index&&) = delete;
+
+		// strings never span two segments, and segments never move once allocated. Windows paths are
+		// limited to 32767 characters, so any string fits into a segment. Offsets are 32 bits, which limits
+		// the number of segments: once they are all used, the index is full rather than wrapping around.
+		bool add_string(std::wstring_view text, uint32_t& result)
+		{
+			const auto size_needed{ text.size() + 1 };
+			assert(size_needed <= SEGMENT_SIZE);
+			if (m_is_full)
+				return false;
+
+			if (m_segments.empty() || (m_segment_used + size_needed > SEGMENT_SIZE))
+			{
+				if (m_segments.size() == MAXIMUM_SEGMENTS)
+				{
+					m_is_full = true;
+					return false;
+				}
+				m_segments.push_back(std::make_unique<wchar_t[]>(SEGMENT_SIZE));
+				m_segment_used = 0;
+			}
+			result = (uint32_t)((m_segments.size() - 1) * SEGMENT_SIZE + m_segment_used);
+			auto p{ m_segments.back().get() + m_segment_used };
+			memcpy(p, text.data(), text.size() * sizeof(wchar_t));
+			p[text.size()] = 0;
+			m_segment_used += size_needed;
+			return true;
+		}
+
+		static wchar_t path_sort_key(wchar_t c)
+		{
+			return ((c == L'\\') || (c == L'/')) ? 0 : c;
+		}
+
+		std::wstring_view string_at(uint32_t offset) const
+		{
+			return m_segments[offset / SEGMENT_SIZE].get() + (offset % SEGMENT_SIZE);
+		}
+
+		// names of the same file always have the same size, so we only need to look within each run of
+		// files with the same size - which, for most files, is a run of one
+		void remove_links()
+		{
+			std::unordered_set<std::pair<uint32_t, uint64_t>, file_key_hash> seen;
+			size_t kept = 0;
+			for (size_t first = 0; first < m_files.size(); )
+			{
+				size_t next = first + 1;
+				while ((next < m_files.size()) && (m_files[next].size == m_files[first].size))
+					++next;
+
+				seen.clear();
+				for (size_t index = first; index < next; ++index)
+				{
+					const auto& record{ m_files[index] };
+
+					// not every file system has file ids
+					if ((next - first > 1) && has_file_id(record) && !seen.emplace(volume_serial_number(record), record.file_id).second)
+					{
+						m_links.push_back(record);
+						continue;
+					}
+					m_files[kept++] = record;
+				}
+				first = next;
+			}
+			m_files.resize(kept);
+		}
+
+	private:
+		struct directory_record
+		{
+			uint32_t name;
+			uint32_t volume_serial_number;
+		};
+
+		static bool has_file_id(const file_record& record)
+		{
+			return record.file_id && (record.file_id != (uint64_t)FILE_INVALID_FILE_ID);
+		}
+
+		struct file_key_hash
+		{
+			size_t operator()(const std::pair<uint32_t, uint64_t>& key) const
+			{
+				return std::hash<uint64_t>{}(key.second ^ ((uint64_t)key.first << 32));
+			}
+		};
+
+		static constexpr size_t SEGMENT_SIZE = 1024 * 64;
+		static constexpr size_t MAXIMUM_SEGMENTS = ((uint64_t)UINT32_MAX + 1) / SEGMENT_SIZE;
+		static constexpr uint32_t NO_DIRECTORY = UINT32_MAX;
+
+		std::vector<file_record> m_files;
+		std::vector<file_record> m_links;
+		std::vector<directory_record> m_directories;
+		std::vector<std::unique_ptr<wchar_t[]>> m_segments;
+		size_t m_segment_used;
+		std::unordered_map<std::wstring, uint32_t> m_directory_lookup;
+		uint32_t m_last_directory;
+		bool m_is_full;
+	};
+}
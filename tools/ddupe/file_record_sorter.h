@@ -0,0 +1,492 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <ngbtools/string.h>
+#include <ngbtools/wstring.h>
+#include <ngbtools/logging.h>
+#include <ngbtools/windows_errors.h>
+
+#include "file_index.h"
+
+namespace ngbtools
+{
+	/// <summary>
+	/// Sorts the files found while scanning by size, without ever holding all of them in memory. Files are
+	/// collected until they use up the memory budget, then sorted and written to a temporary run file. At
+	/// the end, all runs are merged, and the files come back a batch of same-size groups at a time, ready
+	/// to be hashed. Files with a size no other file has are dropped during the merge, because they cannot
+	/// have duplicates - unless they are needed anyway, like for a snapshot of every file.
+	///
+	/// The order is the same as that of file_index::sort_by_size() after a directory_walker: by size, then
+	/// root, then directory, then the order within the directory. So the same file survives as the original,
+	/// no matter if the files are sorted in memory or on disk.
+	///
+	/// usage: add_directory() and add_file() while scanning, finish() once, then next_batch() until it returns false
+	/// </summary>
+	class file_record_sorter final
+	{
+	public:
+		/// <param name="memory_budget">approximate number of bytes used for collecting files, and again for each batch</param>
+		/// <param name="keep_singletons">true to return files with a size no other file has, too</param>
+		file_record_sorter(size_t memory_budget, bool keep_singletons)
+			:
+			m_memory_budget{ memory_budget },
+			m_keep_singletons{ keep_singletons },
+			m_succeeded{ true },
+			m_position{ 0 },
+			m_has_previous{ false },
+			m_previous_size{ 0 }
+		{
+		}
+
+		~file_record_sorter()
+		{
+			for (auto& run : m_runs)
+			{
+				if (run.hFile != INVALID_HANDLE_VALUE)
+				{
+					::CloseHandle(run.hFile);
+				}
+			}
+		}
+
+		/// <summary>
+		/// Start a new directory: all files added from now on are in this directory
+		/// </summary>
+		void add_directory(uint32_t root, std::wstring_view pathname, uint32_t volume_serial_number)
+		{
+			m_directories.push_back({ root, volume_serial_number, (uint32_t)m_names.size(), (uint32_t)pathname.size() });
+			m_names.append(pathname);
+			m_position = 0;
+		}
+
+		void add_file(std::wstring_view filename, uint64_t size, uint64_t file_id)
+		{
+			assert(!m_directories.empty());
+			m_files.push_back({ size, file_id, (uint32_t)(m_directories.size() - 1), m_position++, m_names.size(), (uint32_t)filename.size() });
+			m_names.append(filename);
+			if (memory_usage() >= m_memory_budget)
+			{
+				write_run();
+			}
+		}
+
+		/// <summary>
+		/// Finish adding files and prepare the merge
+		/// </summary>
+		/// <returns>false if a run could not be written, in which case some files are missing</returns>
+		bool finish()
+		{
+			// if everything fits into memory, there is no need to write anything
+			if (m_runs.empty())
+			{
+				sort_pending_files();
+				m_runs.push_back({});
+				m_runs.back().hFile = INVALID_HANDLE_VALUE;
+			}
+			else if (!m_files.empty())
+			{
+				write_run();
+			}
+
+			for (auto& run : m_runs)
+			{
+				if (run.hFile != INVALID_HANDLE_VALUE)
+				{
+					LARGE_INTEGER start{};
+					if (!::SetFilePointerEx(run.hFile, start, nullptr, FILE_BEGIN))
+					{
+						logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT, "SetFilePointerEx() failed for a temporary run file");
+						m_succeeded = false;
+						continue;
+					}
+					run.buffer.resize(std::clamp<size_t>(m_memory_budget / 4 / m_runs.size(), MINIMUM_READ_BUFFER_SIZE, MAXIMUM_READ_BUFFER_SIZE));
+				}
+				if (read_next(run))
+				{
+					m_heap.push_back(&run);
+				}
+			}
+			std::make_heap(m_heap.begin(), m_heap.end(), run_is_greater);
+			return m_succeeded;
+		}
+
+		/// <summary>
+		/// Get the next batch of files. A batch is always made of complete groups of files with the same size,
+		/// and it is only larger than the memory budget if a single group is.
+		/// </summary>
+		/// <param name="index">is cleared, then receives the files of the batch in order of size</param>
+		/// <returns>true if there was another batch, or false if all files have been returned</returns>
+		bool next_batch(file_index& index)
+		{
+			index.clear();
+			while (!m_heap.empty())
+			{
+				const auto size{ m_heap.front()->current.size };
+				if (m_has_previous && (size != m_previous_size) && (index.memory_usage() >= m_memory_budget))
+					break;
+
+				std::pop_heap(m_heap.begin(), m_heap.end(), run_is_greater);
+				auto run{ m_heap.back() };
+				m_heap.pop_back();
+				std::swap(m_file, run->current);
+				if (read_next(*run))
+				{
+					m_heap.push_back(run);
+					std::push_heap(m_heap.begin(), m_heap.end(), run_is_greater);
+				}
+
+				// the file is part of a group if the file before it or the file after it has the same size
+				const bool has_same_size_as_previous{ m_has_previous && (size == m_previous_size) };
+				const bool has_same_size_as_next{ !m_heap.empty() && (m_heap.front()->current.size == size) };
+				if (m_keep_singletons || has_same_size_as_previous || has_same_size_as_next)
+				{
+					index.add_file(index.add_directory(m_file.directory, m_file.volume_serial_number), m_file.filename, m_file.size, m_file.file_id);
+				}
+				m_has_previous = true;
+				m_previous_size = size;
+			}
+			return index.size() > 0;
+		}
+
+		/// <summary>
+		/// Number of run files written so far: 0 if all files fit into memory
+		/// </summary>
+		size_t number_of_runs_written() const
+		{
+			size_t result = 0;
+			for (const auto& run : m_runs)
+			{
+				if (run.hFile != INVALID_HANDLE_VALUE)
+					++result;
+			}
+			return result;
+		}
+
+	private:
+		file_record_sorter(const file_record_sorter&) = delete;
+		file_record_sorter& operator=(const file_record_sorter&) = delete;
+		file_record_sorter(file_record_sorter&&) = delete;
+		file_record_sorter& operator=(file_record_sorter&&) = delete;
+
+		struct pending_directory
+		{
+			uint32_t root;
+			uint32_t volume_serial_number;
+
+			// position of the pathname in m_names
+			uint32_t name;
+			uint32_t name_length;
+		};
+
+		struct pending_file
+		{
+			uint64_t size;
+			uint64_t file_id;
+			uint32_t directory;
+
+			// order within the directory
+			uint32_t position;
+
+			// position of the filename in m_names
+			size_t name;
+			uint32_t name_length;
+		};
+
+		// a record in a run file is this header, followed by the directory pathname and the filename
+		struct run_record_header
+		{
+			uint64_t size;
+			uint64_t file_id;
+			uint32_t root;
+			uint32_t volume_serial_number;
+			uint32_t position;
+
+			// Windows paths are limited to 32767 characters
+			uint16_t directory_length;
+			uint16_t filename_length;
+		};
+		static_assert(sizeof(run_record_header) == 32);
+
+		struct merged_file
+		{
+			uint64_t size;
+			uint64_t file_id;
+			uint32_t root;
+			uint32_t volume_serial_number;
+			uint32_t position;
+			std::wstring directory;
+			std::wstring filename;
+		};
+
+		// a sorted run: either a temporary file, or (if nothing had to be written) the pending files in memory
+		struct run
+		{
+			HANDLE hFile;
+			std::vector<char> buffer;
+			size_t buffer_position;
+			size_t buffer_used;
+
+			// for the run in memory: the next pending file
+			size_t next_file;
+
+			merged_file current;
+		};
+
+		size_t memory_usage() const
+		{
+			return m_files.capacity() * sizeof(pending_file) +
+				m_directories.capacity() * sizeof(pending_directory) +
+				m_names.capacity() * sizeof(wchar_t);
+		}
+
+		void sort_pending_files()
+		{
+			// comparing paths is expensive, so we sort the directories once and use their rank instead
+			std::vector<uint32_t> directories;
+			directories.resize(m_directories.size());
+			for (uint32_t index = 0; index < directories.size(); ++index)
+			{
+				directories[index] = index;
+			}
+			std::sort(directories.begin(), directories.end(), [this](uint32_t a, uint32_t b)
+				{
+					return directory_is_less(m_directories[a], m_directories[b]);
+				});
+			std::vector<uint32_t> rank;
+			rank.resize(m_directories.size());
+			for (uint32_t index = 0; index < directories.size(); ++index)
+			{
+				rank[directories[index]] = index;
+			}
+
+			std::sort(m_files.begin(), m_files.end(), [&rank](const pending_file& a, const pending_file& b)
+				{
+					if (a.size != b.size)
+						return a.size < b.size;
+
+					if (a.directory != b.directory)
+						return rank[a.directory] < rank[b.directory];
+
+					return a.position < b.position;
+				});
+		}
+
+		bool directory_is_less(const pending_directory& a, const pending_directory& b) const
+		{
+			if (a.root != b.root)
+				return a.root < b.root;
+
+			return file_index::path_is_less(
+				std::wstring_view{ m_names }.substr(a.name, a.name_length),
+				std::wstring_view{ m_names }.substr(b.name, b.name_length));
+		}
+
+		static bool run_is_greater(const run* a, const run* b)
+		{
+			const auto& x{ a->current };
+			const auto& y{ b->current };
+			if (x.size != y.size)
+				return x.size > y.size;
+
+			if (x.root != y.root)
+				return x.root > y.root;
+
+			if (x.directory != y.directory)
+				return file_index::path_is_less(y.directory, x.directory);
+
+			return x.position > y.position;
+		}
+
+		// sorts the pending files and writes them to a new temporary file
+		void write_run()
+		{
+			sort_pending_files();
+
+			HANDLE hFile = create_temporary_file();
+			if (hFile != INVALID_HANDLE_VALUE)
+			{
+				std::vector<char> output;
+				output.reserve(WRITE_BUFFER_SIZE + sizeof(run_record_header) + 2 * sizeof(wchar_t) * MAXIMUM_PATH_LENGTH);
+				bool succeeded = true;
+				for (const auto& file : m_files)
+				{
+					const auto& directory{ m_directories[file.directory] };
+					const run_record_header header{ file.size, file.file_id, directory.root, directory.volume_serial_number, file.position,
+						(uint16_t)directory.name_length, (uint16_t)file.name_length };
+					append(output, &header, sizeof(header));
+					append(output, &m_names[directory.name], directory.name_length * sizeof(wchar_t));
+					append(output, &m_names[file.name], file.name_length * sizeof(wchar_t));
+					if (output.size() >= WRITE_BUFFER_SIZE)
+					{
+						succeeded = succeeded && write_to(hFile, output.data(), output.size());
+						output.clear();
+					}
+				}
+				succeeded = succeeded && write_to(hFile, output.data(), output.size());
+				if (succeeded)
+				{
+					m_runs.push_back({});
+					m_runs.back().hFile = hFile;
+				}
+				else
+				{
+					::CloseHandle(hFile);
+					m_succeeded = false;
+				}
+			}
+			else
+			{
+				m_succeeded = false;
+			}
+
+			// the current directory continues in the next run
+			const auto current_directory{ m_directories.back() };
+			const auto current_pathname{ m_names.substr(current_directory.name, current_directory.name_length) };
+			std::vector<pending_file>{}.swap(m_files);
+			std::vector<pending_directory>{}.swap(m_directories);
+			std::wstring{}.swap(m_names);
+			m_directories.push_back({ current_directory.root, current_directory.volume_serial_number, 0, current_directory.name_length });
+			m_names.append(current_pathname);
+		}
+
+		static void append(std::vector<char>& output, const void* data, size_t size)
+		{
+			output.insert(output.end(), (const char*)data, (const char*)data + size);
+		}
+
+		static HANDLE create_temporary_file()
+		{
+			wchar_t directory[MAX_PATH + 1];
+			wchar_t pathname[MAX_PATH + 1];
+			if (!::GetTempPathW(MAX_PATH + 1, directory) || !::GetTempFileNameW(directory, L"dd", 0, pathname))
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT, "Unable to create a temporary run file");
+				return INVALID_HANDLE_VALUE;
+			}
+
+			// the file is gone as soon as the handle is closed, even if we crash
+			HANDLE hFile = ::CreateFileW(pathname, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+				FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+			if (hFile == INVALID_HANDLE_VALUE)
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("CreateFileW({}) failed", wstring::encode_as_utf8(pathname)));
+			}
+			return hFile;
+		}
+
+		static bool write_to(HANDLE hFile, const void* data, size_t size)
+		{
+			const char* p = (const char*)data;
+			while (size)
+			{
+				const DWORD bytes_to_write = (DWORD)std::min<size_t>(size, 1024 * 1024 * 16);
+				DWORD bytes_written = 0;
+				if (!::WriteFile(hFile, p, bytes_to_write, &bytes_written, nullptr))
+				{
+					logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT, "WriteFile() failed for a temporary run file");
+					return false;
+				}
+				p += bytes_written;
+				size -= bytes_written;
+			}
+			return true;
+		}
+
+		// reads exactly size bytes from a run file
+		bool read_from(run& source, void* data, size_t size)
+		{
+			char* p = (char*)data;
+			while (size)
+			{
+				if (source.buffer_position == source.buffer_used)
+				{
+					DWORD bytes_read = 0;
+					if (!::ReadFile(source.hFile, source.buffer.data(), (DWORD)source.buffer.size(), &bytes_read, nullptr))
+					{
+						logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT, "ReadFile() failed for a temporary run file");
+						m_succeeded = false;
+						return false;
+					}
+					if (!bytes_read)
+						return false;
+
+					source.buffer_position = 0;
+					source.buffer_used = bytes_read;
+				}
+				const auto chunk_size{ std::min(size, source.buffer_used - source.buffer_position) };
+				memcpy(p, &source.buffer[source.buffer_position], chunk_size);
+				source.buffer_position += chunk_size;
+				p += chunk_size;
+				size -= chunk_size;
+			}
+			return true;
+		}
+
+		// moves the next file of a run into run::current
+		bool read_next(run& source)
+		{
+			auto& current{ source.current };
+			if (source.hFile == INVALID_HANDLE_VALUE)
+			{
+				if (source.next_file == m_files.size())
+					return false;
+
+				const auto& file{ m_files[source.next_file++] };
+				const auto& directory{ m_directories[file.directory] };
+				current.size = file.size;
+				current.file_id = file.file_id;
+				current.root = directory.root;
+				current.volume_serial_number = directory.volume_serial_number;
+				current.position = file.position;
+				current.directory.assign(m_names, directory.name, directory.name_length);
+				current.filename.assign(m_names, file.name, file.name_length);
+				return true;
+			}
+
+			run_record_header header;
+			if (!read_from(source, &header, sizeof(header)))
+				return false;
+
+			current.size = header.size;
+			current.file_id = header.file_id;
+			current.root = header.root;
+			current.volume_serial_number = header.volume_serial_number;
+			current.position = header.position;
+			current.directory.resize(header.directory_length);
+			current.filename.resize(header.filename_length);
+			return read_from(source, current.directory.data(), header.directory_length * sizeof(wchar_t)) &&
+				read_from(source, current.filename.data(), header.filename_length * sizeof(wchar_t));
+		}
+
+	private:
+		static constexpr size_t WRITE_BUFFER_SIZE = 1024 * 1024;
+		static constexpr size_t MINIMUM_READ_BUFFER_SIZE = 1024 * 64;
+		static constexpr size_t MAXIMUM_READ_BUFFER_SIZE = 1024 * 1024 * 4;
+		static constexpr size_t MAXIMUM_PATH_LENGTH = 32767;
+
+		const size_t m_memory_budget;
+		const bool m_keep_singletons;
+		bool m_succeeded;
+
+		// the files collected for the next run
+		std::vector<pending_file> m_files;
+		std::vector<pending_directory> m_directories;
+		std::wstring m_names;
+		uint32_t m_position;
+
+		std::vector<run> m_runs;
+		std::vector<run*> m_heap;
+
+		// the file next_batch() is looking at
+		merged_file m_file;
+		bool m_has_previous;
+		uint64_t m_previous_size;
+	};
+}
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <ngbtools/string.h>
+#include <ngbtools/console.h>
+#include <ngbtools/file.h>
+#include <ngbtools/hasher.h>
+#include <ngbtools/logging.h>
+#include <ngbtools/memory_mapped_file.h>
+#include <ngbtools/windows_errors.h>
+
+namespace ngbtools
+{
+	/// <summary>
+	/// A persistent database of checksums, so that a rerun over an unchanged tree doesn't need to read
+	/// the files again. An entry is only used as long as size, modification time and file id still match,
+	/// and only if it was calculated with the same algorithm.
+	///
+	/// The database is append-only: it is memory-mapped for reading, and new checksums are appended as new
+	/// records that supersede older records for the same path. Once more than half of the records are
+	/// superseded, the database is compacted, which also drops records of files that no longer exist.
+	/// </summary>
+	class hash_cache final
+	{
+	public:
+		struct entry
+		{
+			bool has_partial_checksum;
+			bool has_checksum;
+			digest partial_checksum;
+			digest checksum;
+		};
+
+		hash_cache()
+			:
+			m_number_of_records{ 0 },
+			m_number_of_superseded_records{ 0 },
+			m_number_of_new_records{ 0 },
+			m_valid_size{ 0 }
+		{
+		}
+
+		~hash_cache()
+		{
+			close();
+		}
+
+	private:
+		hash_cache(const hash_cache&) = delete;
+		hash_cache& operator=(const hash_cache&) = delete;
+		hash_cache(hash_cache&&) = delete;
+		hash_cache& operator=(hash_cache&&) = delete;
+
+	public:
+		/// <summary>
+		/// Open (or create) the database
+		/// </summary>
+		/// <param name="pathname">database filename</param>
+		/// <returns>true if the database can be used, or false otherwise</returns>
+		bool open(std::string_view pathname)
+		{
+			close();
+			m_pathname = pathname;
+
+			if (!file::exists(pathname))
+			{
+				// new database, will be created when closing
+				m_valid_size = 0;
+				return true;
+			}
+
+			if (!m_file.open(pathname, FILE_FLAG_SEQUENTIAL_SCAN))
+			{
+				m_pathname.clear();
+				return false;
+			}
+
+			const auto data{ m_file.data() };
+			const auto size{ m_file.size() };
+			if ((size >= sizeof(file_header)) && !memcmp(data, &expected_header(), sizeof(expected_header().magic)) &&
+				(((const file_header*)data)->version < expected_header().version))
+			{
+				// we cannot use the old records, but the database is rewritten when closing
+				console::formatline(CONSOLE_FOREGROUND_YELLOW "{} was written by an older version of ddupe and will be rebuilt" CONSOLE_STANDARD, pathname);
+				m_valid_size = 0;
+				return true;
+			}
+			if ((size < sizeof(file_header)) || memcmp(data, &expected_header(), sizeof(file_header)))
+			{
+				console::formatline(CONSOLE_FOREGROUND_RED "{} is not a ddupe hash cache (or was written by an incompatible version)" CONSOLE_STANDARD, pathname);
+				m_file.close();
+				m_pathname.clear();
+				return false;
+			}
+
+			uint64_t offset = sizeof(file_header);
+			while (offset + sizeof(record_header) <= size)
+			{
+				const auto record{ (const record_header*)(data + offset) };
+				if ((record->record_size < sizeof(record_header) + record->path_length) ||
+					(record->record_size % RECORD_ALIGNMENT) ||
+					(offset + record->record_size > size))
+				{
+					// most likely a record that was only partially written when ddupe was interrupted
+					break;
+				}
+				const std::string_view path{ (const char*)(record + 1), record->path_length };
+				auto& existing{ m_lookup[path] };
+				if (existing)
+				{
+					++m_number_of_superseded_records;
+				}
+				existing = record;
+				++m_number_of_records;
+				offset += record->record_size;
+			}
+			m_valid_size = offset;
+			return true;
+		}
+
+		bool is_open() const
+		{
+			return !m_pathname.empty();
+		}
+
+		/// <summary>
+		/// Look up the checksums of a file. This is safe to call from multiple threads, as long as nobody
+		/// opens or closes the database at the same time.
+		/// </summary>
+		/// <param name="path">absolute path of the file</param>
+		/// <param name="info">current size, modification time and file id</param>
+		/// <param name="algorithm">algorithm the checksums must have been calculated with</param>
+		/// <param name="result">receives the checksums</param>
+		/// <returns>true if there is a valid entry, or false otherwise</returns>
+		bool lookup(std::string_view path, const file::information& info, hash_algorithm algorithm, entry& result) const
+		{
+			const auto item{ m_lookup.find(path) };
+			if (item == m_lookup.end())
+				return false;
+
+			const auto record{ item->second };
+			if ((record->file_size != info.size) ||
+				(record->last_write_time != info.last_write_time) ||
+				(record->file_id != info.file_id) ||
+				(record->volume_serial_number != info.volume_serial_number) ||
+				(record->algorithm != (uint16_t)algorithm))
+			{
+				return false;
+			}
+
+			const auto checksum_size{ hasher::digest_size(algorithm) };
+			result.has_partial_checksum = (record->flags & HAS_PARTIAL_CHECKSUM) != 0;
+			if (result.has_partial_checksum)
+			{
+				result.partial_checksum = digest{ record->partial_checksum, checksum_size };
+			}
+			result.has_checksum = (record->flags & HAS_CHECKSUM) != 0;
+			if (result.has_checksum)
+			{
+				result.checksum = digest{ record->checksum, checksum_size };
+			}
+			return result.has_partial_checksum || result.has_checksum;
+		}
+
+		/// <summary>
+		/// Remember the checksums of a file. The record is written when the database is closed.
+		/// </summary>
+		/// <param name="path">absolute path of the file</param>
+		/// <param name="info">size, modification time and file id at the time the checksums were calculated</param>
+		/// <param name="algorithm">algorithm the checksums were calculated with</param>
+		/// <param name="partial_checksum">partial checksum, or nullptr if unknown</param>
+		/// <param name="checksum">full checksum, or nullptr if unknown</param>
+		void store(std::string_view path, const file::information& info, hash_algorithm algorithm, const digest* partial_checksum, const digest* checksum)
+		{
+			record_header record{};
+			record.record_size = (uint32_t)aligned_record_size(path.size());
+			record.path_length = (uint32_t)path.size();
+			record.file_size = info.size;
+			record.last_write_time = info.last_write_time;
+			record.file_id = info.file_id;
+			record.volume_serial_number = info.volume_serial_number;
+			record.algorithm = (uint16_t)algorithm;
+
+			const auto checksum_size{ hasher::digest_size(algorithm) };
+			if (partial_checksum && copy_checksum(*partial_checksum, record.partial_checksum, checksum_size))
+			{
+				record.flags |= HAS_PARTIAL_CHECKSUM;
+			}
+			if (checksum && copy_checksum(*checksum, record.checksum, checksum_size))
+			{
+				record.flags |= HAS_CHECKSUM;
+			}
+			if (!record.flags)
+				return;
+
+			const auto offset{ m_pending.size() };
+			m_pending.resize(offset + record.record_size);
+			memcpy(&m_pending[offset], &record, sizeof(record));
+			memcpy(&m_pending[offset + sizeof(record)], path.data(), path.size());
+			++m_number_of_new_records;
+		}
+
+		/// <summary>
+		/// Write all new records and close the database
+		/// </summary>
+		/// <returns>true if the database could be written, or false otherwise</returns>
+		bool close()
+		{
+			if (!is_open())
+				return true;
+
+			bool succeeded = true;
+			if (needs_compaction())
+			{
+				succeeded = compact();
+			}
+			else if (!m_pending.empty())
+			{
+				succeeded = append();
+			}
+			m_file.close();
+			m_lookup.clear();
+			m_pending.clear();
+			m_pathname.clear();
+			m_number_of_records = 0;
+			m_number_of_superseded_records = 0;
+			m_number_of_new_records = 0;
+			m_valid_size = 0;
+			return succeeded;
+		}
+
+		size_t number_of_records() const
+		{
+			return m_number_of_records;
+		}
+
+		size_t number_of_new_records() const
+		{
+			return m_number_of_new_records;
+		}
+
+	private:
+		struct file_header
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t reserved;
+		};
+
+		struct record_header
+		{
+			// including header, path and padding
+			uint32_t record_size;
+
+			// UTF8-encoded path, follows the header
+			uint32_t path_length;
+			uint64_t file_size;
+			uint64_t last_write_time;
+			uint64_t file_id;
+			uint32_t volume_serial_number;
+			uint16_t flags;
+
+			// a hash_algorithm value: checksums use the first hasher::digest_size() bytes
+			uint16_t algorithm;
+			uint8_t partial_checksum[hasher::MAXIMUM_DIGEST_SIZE];
+			uint8_t checksum[hasher::MAXIMUM_DIGEST_SIZE];
+		};
+		static_assert(sizeof(record_header) == 104);
+
+		enum
+		{
+			HAS_PARTIAL_CHECKSUM = 1,
+			HAS_CHECKSUM = 2,
+		};
+
+		static constexpr size_t RECORD_ALIGNMENT = 8;
+
+		// don't bother compacting small databases
+		static constexpr size_t MINIMUM_RECORDS_FOR_COMPACTION = 1024;
+
+		static const file_header& expected_header()
+		{
+			static const file_header header{ { 'D', 'D', 'U', 'P', 'E', '-', 'H', 'C' }, 2, 0 };
+			return header;
+		}
+
+		static size_t aligned_record_size(size_t path_length)
+		{
+			const auto size{ sizeof(record_header) + path_length };
+			return (size + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1);
+		}
+
+		static bool copy_checksum(const digest& checksum, uint8_t* result, size_t size)
+		{
+			if (checksum.size() != size)
+				return false;
+
+			memcpy(result, checksum.data(), size);
+			return true;
+		}
+
+		bool needs_compaction() const
+		{
+			// a partially written record at the end must go
+			if (m_file.is_open() && (m_valid_size < m_file.size()))
+				return true;
+
+			const auto total{ m_number_of_records + m_number_of_new_records };
+			if (total < MINIMUM_RECORDS_FOR_COMPACTION)
+				return false;
+
+			return (m_number_of_superseded_records + number_of_superseding_new_records()) * 2 > total;
+		}
+
+		size_t number_of_superseding_new_records() const
+		{
+			size_t result = 0;
+			for_each_pending_record([this, &result](const record_header*, std::string_view path)
+				{
+					if (m_lookup.find(path) != m_lookup.end())
+						++result;
+				});
+			return result;
+		}
+
+		template <typename T> void for_each_pending_record(T callback) const
+		{
+			size_t offset = 0;
+			while (offset < m_pending.size())
+			{
+				const auto record{ (const record_header*)&m_pending[offset] };
+				callback(record, std::string_view{ (const char*)(record + 1), record->path_length });
+				offset += record->record_size;
+			}
+		}
+
+		static bool write_to(HANDLE hFile, const void* data, size_t size, std::string_view pathname)
+		{
+			const char* p = (const char*)data;
+			while (size)
+			{
+				const DWORD bytes_to_write = (DWORD)std::min<size_t>(size, 1024 * 1024 * 16);
+				DWORD bytes_written = 0;
+				if (!::WriteFile(hFile, p, bytes_to_write, &bytes_written, nullptr))
+				{
+					logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+						fmt::format("WriteFile({}) failed", pathname));
+					return false;
+				}
+				p += bytes_written;
+				size -= bytes_written;
+			}
+			return true;
+		}
+
+		bool append()
+		{
+			// the new records go behind the mapped part, so we no longer need the mapping
+			const bool is_new_database{ !m_file.is_open() };
+			m_file.close();
+			m_lookup.clear();
+
+			const auto wpathname{ string::encode_as_utf16(m_pathname) };
+			HANDLE hFile = ::CreateFileW(wpathname.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+			if (hFile == INVALID_HANDLE_VALUE)
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("CreateFileW({}) failed", m_pathname));
+				return false;
+			}
+			bool succeeded = true;
+			if (is_new_database)
+			{
+				succeeded = write_to(hFile, &expected_header(), sizeof(file_header), m_pathname);
+			}
+			if (succeeded)
+			{
+				succeeded = write_to(hFile, m_pending.data(), m_pending.size(), m_pathname);
+			}
+			::CloseHandle(hFile);
+			return succeeded;
+		}
+
+		bool compact()
+		{
+			// the latest record per path wins, and the new records are newer than anything in the file
+			std::unordered_map<std::string_view, const record_header*> latest{ m_lookup };
+			for_each_pending_record([&latest](const record_header* record, std::string_view path)
+				{
+					latest[path] = record;
+				});
+
+			const auto temp_pathname{ m_pathname + ".tmp" };
+			const auto wtemp_pathname{ string::encode_as_utf16(temp_pathname) };
+			HANDLE hFile = ::CreateFileW(wtemp_pathname.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+			if (hFile == INVALID_HANDLE_VALUE)
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("CreateFileW({}) failed", temp_pathname));
+				return false;
+			}
+
+			std::vector<char> output;
+			output.insert(output.end(), (const char*)&expected_header(), (const char*)&expected_header() + sizeof(file_header));
+			bool succeeded = true;
+			for (const auto& item : latest)
+			{
+				if (!file::exists(item.first))
+					continue;
+
+				output.insert(output.end(), (const char*)item.second, (const char*)item.second + item.second->record_size);
+				if (output.size() >= 1024 * 1024 * 16)
+				{
+					succeeded = write_to(hFile, output.data(), output.size(), temp_pathname);
+					output.clear();
+					if (!succeeded)
+						break;
+				}
+			}
+			if (succeeded)
+			{
+				succeeded = write_to(hFile, output.data(), output.size(), temp_pathname);
+			}
+			::CloseHandle(hFile);
+
+			// only now can we let go of the mapping, because the old records are part of it
+			latest.clear();
+			m_file.close();
+			m_lookup.clear();
+			if (!succeeded)
+			{
+				file::remove(temp_pathname);
+				return false;
+			}
+			if (!::MoveFileExW(wtemp_pathname.c_str(), string::encode_as_utf16(m_pathname).c_str(), MOVEFILE_REPLACE_EXISTING))
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("Unable to rename {} as {}", temp_pathname, m_pathname));
+				return false;
+			}
+			return true;
+		}
+
+	private:
+		std::string m_pathname;
+		memory_mapped_file m_file;
+
+		// keys and values point into the mapped file
+		std::unordered_map<std::string_view, const record_header*> m_lookup;
+
+		// new records, in the same format as on disk
+		std::vector<char> m_pending;
+		size_t m_number_of_records;
+		size_t m_number_of_superseded_records;
+		size_t m_number_of_new_records;
+		uint64_t m_valid_size;
+	};
+}
@@ -0,0 +1,555 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <ngbtools/string.h>
+#include <ngbtools/console.h>
+#include <ngbtools/logging.h>
+#include <ngbtools/windows_errors.h>
+#include <ngbtools/work_stealing_pool.h>
+
+namespace ngbtools
+{
+	/// <summary>
+	/// The things ddupe spends its time on
+	/// </summary>
+	enum class activity
+	{
+		/// <summary>reading a directory listing</summary>
+		ENUMERATE,
+
+		/// <summary>asking for the size, time and id of a single file</summary>
+		STAT,
+
+		/// <summary>opening a file for reading</summary>
+		OPEN,
+
+		/// <summary>waiting for file contents</summary>
+		READ,
+
+		/// <summary>calculating checksums</summary>
+		HASH,
+
+		/// <summary>looking up checksums in the cache and in the list of known checksums</summary>
+		LOOKUP,
+	};
+
+	/// <summary>
+	/// Counts how often and for how long ddupe does each activity, so that we can tell whether a run waits for the
+	/// disk or for the CPU. Counters are striped over cache lines, one stripe per thread, and only ever updated with
+	/// relaxed atomic adds: measuring an activity costs two clock reads, no locks. Anyone can read the totals at any
+	/// time, which is what the progress_reporter does.
+	///
+	/// Optionally, every single activity is also recorded as an event for a Chrome trace (load it in chrome://tracing
+	/// or https://ui.perfetto.dev), which shows what each thread did when.
+	/// </summary>
+	class instrumentation final
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		static constexpr size_t NUMBER_OF_ACTIVITIES = 6;
+
+		/// <summary>
+		/// Sum of all stripes
+		/// </summary>
+		struct totals
+		{
+			uint64_t count[NUMBER_OF_ACTIVITIES];
+			uint64_t nanoseconds[NUMBER_OF_ACTIVITIES];
+			uint64_t bytes[NUMBER_OF_ACTIVITIES];
+		};
+
+		/// <summary>
+		/// Measures an activity from construction to stop() (or destruction)
+		/// </summary>
+		class timer final
+		{
+		public:
+			timer(instrumentation& owner, ngbtools::activity activity)
+				:
+				m_owner{ owner },
+				m_activity{ activity },
+				m_start{ clock::now() },
+				m_is_running{ true }
+			{
+			}
+
+			~timer()
+			{
+				stop();
+			}
+
+			/// <returns>the duration of the activity</returns>
+			clock::duration stop(uint64_t bytes = 0)
+			{
+				if (!m_is_running)
+					return clock::duration::zero();
+
+				m_is_running = false;
+				const auto finish{ clock::now() };
+				m_owner.count(m_activity, finish - m_start, bytes);
+				m_owner.trace(m_activity, m_start, finish, bytes);
+				return finish - m_start;
+			}
+
+		private:
+			timer(const timer&) = delete;
+			timer& operator=(const timer&) = delete;
+			timer(timer&&) = delete;
+			timer& operator=(timer&&) = delete;
+
+		private:
+			instrumentation& m_owner;
+			const ngbtools::activity m_activity;
+			const clock::time_point m_start;
+			bool m_is_running;
+		};
+
+		/// <summary>
+		/// Makes the number of tasks waiting in a pool visible to the progress_reporter while the pool is in use
+		/// </summary>
+		class watched_pool final
+		{
+		public:
+			watched_pool(instrumentation& owner, const work_stealing_pool& pool)
+				:
+				m_owner{ owner }
+			{
+				std::unique_lock<std::mutex> lock{ m_owner.m_pool_lock };
+				m_owner.m_pool = &pool;
+			}
+
+			~watched_pool()
+			{
+				std::unique_lock<std::mutex> lock{ m_owner.m_pool_lock };
+				m_owner.m_pool = nullptr;
+			}
+
+		private:
+			watched_pool(const watched_pool&) = delete;
+			watched_pool& operator=(const watched_pool&) = delete;
+			watched_pool(watched_pool&&) = delete;
+			watched_pool& operator=(watched_pool&&) = delete;
+
+		private:
+			instrumentation& m_owner;
+		};
+
+		instrumentation()
+			:
+			m_stripes{ std::make_unique<stripe[]>(NUMBER_OF_STRIPES) },
+			m_start{ clock::now() },
+			m_is_tracing{ false },
+			m_reports_progress{ false },
+			m_number_of_events{ 0 },
+			m_files_found{ 0 },
+			m_files_checked{ 0 },
+			m_bytes_checked{ 0 },
+			m_files_to_check{ 0 },
+			m_bytes_to_check{ 0 },
+			m_pool{ nullptr }
+		{
+		}
+
+	private:
+		instrumentation(const instrumentation&) = delete;
+		instrumentation& operator=(const instrumentation&) = delete;
+		instrumentation(instrumentation&&) = delete;
+		instrumentation& operator=(instrumentation&&) = delete;
+
+	public:
+		/// <summary>
+		/// Record an event for every activity from now on, see write_trace()
+		/// </summary>
+		void start_tracing()
+		{
+			m_is_tracing = true;
+		}
+
+		/// <summary>
+		/// True while a progress_reporter prints the progress, so nobody else needs to
+		/// </summary>
+		bool reports_progress() const
+		{
+			return m_reports_progress;
+		}
+
+		void count(ngbtools::activity activity, clock::duration duration, uint64_t bytes)
+		{
+			auto& counters{ local_stripe() };
+			const auto index{ (size_t)activity };
+			counters.count[index].fetch_add(1, std::memory_order_relaxed);
+			counters.nanoseconds[index].fetch_add((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(), std::memory_order_relaxed);
+			counters.bytes[index].fetch_add(bytes, std::memory_order_relaxed);
+		}
+
+		void trace(ngbtools::activity activity, clock::time_point start, clock::time_point finish, uint64_t bytes)
+		{
+			if (!m_is_tracing)
+				return;
+
+			// a trace of a huge run would need more memory than the scan itself
+			if (m_number_of_events.fetch_add(1, std::memory_order_relaxed) >= MAXIMUM_NUMBER_OF_EVENTS)
+				return;
+
+			auto& counters{ local_stripe() };
+			std::unique_lock<std::mutex> lock{ counters.events_lock };
+			counters.events.push_back({
+				(uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(start - m_start).count(),
+				(uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count(),
+				bytes,
+				(uint32_t)::GetCurrentThreadId(),
+				activity });
+		}
+
+		totals sum() const
+		{
+			totals result{};
+			for (size_t stripe = 0; stripe < NUMBER_OF_STRIPES; ++stripe)
+			{
+				for (size_t index = 0; index < NUMBER_OF_ACTIVITIES; ++index)
+				{
+					result.count[index] += m_stripes[stripe].count[index].load(std::memory_order_relaxed);
+					result.nanoseconds[index] += m_stripes[stripe].nanoseconds[index].load(std::memory_order_relaxed);
+					result.bytes[index] += m_stripes[stripe].bytes[index].load(std::memory_order_relaxed);
+				}
+			}
+			return result;
+		}
+
+		void found_files(uint64_t number_of_files)
+		{
+			m_files_found.fetch_add(number_of_files, std::memory_order_relaxed);
+		}
+
+		uint64_t files_found() const
+		{
+			return m_files_found.load(std::memory_order_relaxed);
+		}
+
+		/// <summary>
+		/// Files of the same size are about to be checked for duplicates
+		/// </summary>
+		void will_check(uint64_t number_of_files, uint64_t number_of_bytes)
+		{
+			m_files_to_check.fetch_add(number_of_files, std::memory_order_relaxed);
+			m_bytes_to_check.fetch_add(number_of_bytes, std::memory_order_relaxed);
+		}
+
+		void checked(uint64_t file_size)
+		{
+			m_files_checked.fetch_add(1, std::memory_order_relaxed);
+			m_bytes_checked.fetch_add(file_size, std::memory_order_relaxed);
+		}
+
+		uint64_t files_checked() const
+		{
+			return m_files_checked.load(std::memory_order_relaxed);
+		}
+
+		uint64_t bytes_checked() const
+		{
+			return m_bytes_checked.load(std::memory_order_relaxed);
+		}
+
+		uint64_t files_to_check() const
+		{
+			return m_files_to_check.load(std::memory_order_relaxed);
+		}
+
+		uint64_t bytes_to_check() const
+		{
+			return m_bytes_to_check.load(std::memory_order_relaxed);
+		}
+
+		/// <returns>number of tasks waiting in the pool that is currently watched</returns>
+		size_t number_of_queued_tasks()
+		{
+			std::unique_lock<std::mutex> lock{ m_pool_lock };
+			return m_pool ? m_pool->number_of_queued_tasks() : 0;
+		}
+
+		static const char* name(ngbtools::activity activity)
+		{
+			switch (activity)
+			{
+			case activity::ENUMERATE:
+				return "enumerate";
+			case activity::STAT:
+				return "stat";
+			case activity::OPEN:
+				return "open";
+			case activity::READ:
+				return "read";
+			case activity::HASH:
+				return "hash";
+			default:
+				return "lookup";
+			}
+		}
+
+		/// <summary>
+		/// Write all events recorded since start_tracing() in the Chrome trace event format. Call this only
+		/// once all threads are done.
+		/// </summary>
+		bool write_trace(std::string_view pathname) const
+		{
+			HANDLE hFile = ::CreateFileW(string::encode_as_utf16(pathname).c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+			if (hFile == INVALID_HANDLE_VALUE)
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("CreateFileW({}) failed", pathname));
+				return false;
+			}
+
+			bool succeeded = true;
+			std::string output{ "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" };
+			const auto process_id{ ::GetCurrentProcessId() };
+			bool is_first = true;
+			for (size_t stripe = 0; (stripe < NUMBER_OF_STRIPES) && succeeded; ++stripe)
+			{
+				for (const auto& event : m_stripes[stripe].events)
+				{
+					// timestamps are in microseconds, but fractions are allowed
+					fmt::format_to(std::back_inserter(output), "{}\n{{\"name\":\"{}\",\"ph\":\"X\",\"ts\":{}.{:03},\"dur\":{}.{:03},\"pid\":{},\"tid\":{}",
+						is_first ? "" : ",",
+						name(event.activity),
+						event.start / 1000, event.start % 1000,
+						event.duration / 1000, event.duration % 1000,
+						process_id,
+						event.thread_id);
+					if (event.bytes)
+					{
+						fmt::format_to(std::back_inserter(output), ",\"args\":{{\"bytes\":{}}}", event.bytes);
+					}
+					output.push_back('}');
+					is_first = false;
+					if (output.size() >= WRITE_SIZE)
+					{
+						succeeded = write(hFile, pathname, output);
+						if (!succeeded)
+							break;
+					}
+				}
+			}
+			output.append("\n]}\n");
+			succeeded = succeeded && write(hFile, pathname, output);
+			::CloseHandle(hFile);
+			return succeeded;
+		}
+
+		bool has_dropped_events() const
+		{
+			return m_number_of_events.load(std::memory_order_relaxed) > MAXIMUM_NUMBER_OF_EVENTS;
+		}
+
+	private:
+		friend class progress_reporter;
+
+		struct trace_event
+		{
+			// nanoseconds since the instrumentation was created
+			uint64_t start;
+			uint64_t duration;
+			uint64_t bytes;
+			uint32_t thread_id;
+			ngbtools::activity activity;
+		};
+
+		struct alignas(64) stripe
+		{
+			std::atomic<uint64_t> count[NUMBER_OF_ACTIVITIES];
+			std::atomic<uint64_t> nanoseconds[NUMBER_OF_ACTIVITIES];
+			std::atomic<uint64_t> bytes[NUMBER_OF_ACTIVITIES];
+
+			// only locked by the threads that share the stripe, and only while tracing
+			std::mutex events_lock;
+			std::vector<trace_event> events;
+		};
+
+		stripe& local_stripe()
+		{
+			// threads take turns, so unless there are more threads than stripes, no two threads share one
+			static std::atomic<size_t> next_stripe{ 0 };
+			thread_local const size_t index{ next_stripe.fetch_add(1, std::memory_order_relaxed) % NUMBER_OF_STRIPES };
+			return m_stripes[index];
+		}
+
+		static bool write(HANDLE hFile, std::string_view pathname, std::string& output)
+		{
+			DWORD bytes_written = 0;
+			if (!::WriteFile(hFile, output.data(), (DWORD)output.size(), &bytes_written, nullptr) || (bytes_written != output.size()))
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("WriteFile({}) failed", pathname));
+				return false;
+			}
+			output.clear();
+			return true;
+		}
+
+	private:
+		static constexpr size_t NUMBER_OF_STRIPES = 64;
+
+		// 32 bytes each, so a trace takes at most 256 MB
+		static constexpr uint64_t MAXIMUM_NUMBER_OF_EVENTS = 1024 * 1024 * 8;
+
+		static constexpr size_t WRITE_SIZE = 1024 * 1024 * 4;
+
+		const std::unique_ptr<stripe[]> m_stripes;
+		const clock::time_point m_start;
+		std::atomic<bool> m_is_tracing;
+		std::atomic<bool> m_reports_progress;
+		std::atomic<uint64_t> m_number_of_events;
+		std::atomic<uint64_t> m_files_found;
+		std::atomic<uint64_t> m_files_checked;
+		std::atomic<uint64_t> m_bytes_checked;
+		std::atomic<uint64_t> m_files_to_check;
+		std::atomic<uint64_t> m_bytes_to_check;
+		std::mutex m_pool_lock;
+		const work_stealing_pool* m_pool;
+	};
+
+	/// <summary>
+	/// Prints what ddupe is doing at a fixed interval, on a thread of its own: how many files have been found or
+	/// checked, how fast, when it is going to be done, and what share of the time all threads together spent on
+	/// each activity since the last report.
+	/// </summary>
+	class progress_reporter final
+	{
+	public:
+		progress_reporter(instrumentation& source, std::chrono::seconds interval)
+			:
+			m_source{ source },
+			m_interval{ interval },
+			m_is_stopping{ false },
+			m_last{ source.sum() },
+			m_last_files_found{ 0 },
+			m_last_files_checked{ 0 },
+			m_last_bytes_checked{ 0 },
+			m_last_report{ instrumentation::clock::now() }
+		{
+			m_source.m_reports_progress = true;
+			m_thread = std::thread{ [this]() { run(); } };
+		}
+
+		~progress_reporter()
+		{
+			stop();
+		}
+
+	private:
+		progress_reporter(const progress_reporter&) = delete;
+		progress_reporter& operator=(const progress_reporter&) = delete;
+		progress_reporter(progress_reporter&&) = delete;
+		progress_reporter& operator=(progress_reporter&&) = delete;
+
+	public:
+		void stop()
+		{
+			{
+				std::unique_lock<std::mutex> lock{ m_lock };
+				m_is_stopping = true;
+			}
+			m_wake_up.notify_all();
+			if (m_thread.joinable())
+			{
+				m_thread.join();
+			}
+			m_source.m_reports_progress = false;
+		}
+
+	private:
+		void run()
+		{
+			std::unique_lock<std::mutex> lock{ m_lock };
+			while (!m_wake_up.wait_for(lock, m_interval, [this]() { return m_is_stopping; }))
+			{
+				report();
+			}
+		}
+
+		void report()
+		{
+			const auto now{ instrumentation::clock::now() };
+			const auto seconds{ std::chrono::duration<double>(now - m_last_report).count() };
+			const auto current{ m_source.sum() };
+			const auto files_found{ m_source.files_found() };
+			const auto files_checked{ m_source.files_checked() };
+			const auto bytes_checked{ m_source.bytes_checked() };
+
+			std::string line;
+			if (!m_source.files_to_check())
+			{
+				// still scanning
+				line = fmt::format("- {:L} files found, {:.0f} files/s",
+					files_found,
+					(files_found - m_last_files_found) / seconds);
+			}
+			else
+			{
+				const auto bytes_per_second{ (bytes_checked - m_last_bytes_checked) / seconds };
+				const auto bytes_to_check{ m_source.bytes_to_check() };
+				line = fmt::format("- {:L} of {:L} files checked, {:.0f} files/s, {:.1f} MB/s",
+					files_checked,
+					m_source.files_to_check(),
+					(files_checked - m_last_files_checked) / seconds,
+					bytes_per_second / (1024 * 1024));
+				if ((bytes_per_second > 0) && (bytes_to_check > bytes_checked))
+				{
+					const auto remaining{ (uint64_t)((bytes_to_check - bytes_checked) / bytes_per_second) };
+					line += fmt::format(", ETA {}:{:02}:{:02}", remaining / 3600, (remaining / 60) % 60, remaining % 60);
+				}
+			}
+			line += fmt::format(", {:L} tasks queued", m_source.number_of_queued_tasks());
+
+			uint64_t total_nanoseconds = 0;
+			for (size_t index = 0; index < instrumentation::NUMBER_OF_ACTIVITIES; ++index)
+			{
+				total_nanoseconds += current.nanoseconds[index] - m_last.nanoseconds[index];
+			}
+			if (total_nanoseconds)
+			{
+				const char* separator = "; busy: ";
+				for (size_t index = 0; index < instrumentation::NUMBER_OF_ACTIVITIES; ++index)
+				{
+					const auto nanoseconds{ current.nanoseconds[index] - m_last.nanoseconds[index] };
+					if (!nanoseconds)
+						continue;
+
+					line += fmt::format("{}{} {:.0f}%", separator, instrumentation::name((activity)index), 100.0 * nanoseconds / total_nanoseconds);
+					separator = ", ";
+				}
+			}
+			console::writeline(line);
+
+			m_last = current;
+			m_last_files_found = files_found;
+			m_last_files_checked = files_checked;
+			m_last_bytes_checked = bytes_checked;
+			m_last_report = now;
+		}
+
+	private:
+		instrumentation& m_source;
+		const std::chrono::seconds m_interval;
+		std::mutex m_lock;
+		std::condition_variable m_wake_up;
+		bool m_is_stopping;
+		instrumentation::totals m_last;
+		uint64_t m_last_files_found;
+		uint64_t m_last_files_checked;
+		uint64_t m_last_bytes_checked;
+		instrumentation::clock::time_point m_last_report;
+		std::thread m_thread;
+	};
+}
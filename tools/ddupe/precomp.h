@@ -23,6 +23,9 @@
 #include <ios>
 #include <filesystem>
 #include <cassert>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
 
 // see http://stackoverflow.com/questions/5641427/how-to-make-preprocessor-generate-a-string-for-line-keyword
 #define S(x) #x
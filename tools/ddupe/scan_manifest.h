@@ -0,0 +1,402 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <ngbtools/string.h>
+#include <ngbtools/console.h>
+#include <ngbtools/file.h>
+#include <ngbtools/logging.h>
+#include <ngbtools/memory_mapped_file.h>
+#include <ngbtools/windows_errors.h>
+
+namespace ngbtools
+{
+	/// <summary>
+	/// What the last scan found in each directory, so that the next scan only needs to read directories that
+	/// have changed since. Adding, removing or renaming an entry updates the modification time of its
+	/// directory, so as long as that time is the same, the remembered files and subdirectories are still
+	/// there. Subdirectories are still visited, because a change deep down doesn't show in their parents.
+	///
+	/// The remembered file sizes are another matter: writing to a file doesn't touch its directory, so they
+	/// can be out of date. Whoever reads a file must check its size on the open handle first, like
+	/// file_reader::has_expected_size() does.
+	///
+	/// The previous manifest is memory-mapped for reading. The new one is written to a temporary file while
+	/// scanning, and replaces the previous one on close(), so it only ever lists what the last scan found.
+	/// </summary>
+	class scan_manifest final
+	{
+	public:
+		/// <summary>
+		/// A directory, followed by its path, its files and its subdirectories. Everything is aligned to
+		/// 8 bytes, so the path and names can be used right where they are.
+		/// </summary>
+		struct directory_record
+		{
+			// including path, files, subdirectories and padding
+			uint32_t record_size;
+			uint32_t volume_serial_number;
+			uint64_t last_write_time;
+			uint32_t number_of_files;
+			uint32_t number_of_subdirectories;
+			uint32_t path_length;
+			uint32_t reserved;
+		};
+		static_assert(sizeof(directory_record) == 32);
+
+		/// <summary>
+		/// Collects a directory record while the directory is being read
+		/// </summary>
+		class directory_builder final
+		{
+		public:
+			void begin(std::wstring_view pathname, uint32_t volume_serial_number, uint64_t last_write_time)
+			{
+				m_data.clear();
+				m_subdirectories.clear();
+				const directory_record record{ 0, volume_serial_number, last_write_time, 0, 0, (uint32_t)pathname.size(), 0 };
+				append(m_data, &record, sizeof(record));
+				append_name(m_data, pathname);
+			}
+
+			void add_file(std::wstring_view filename, uint64_t size, uint64_t file_id)
+			{
+				const file_entry entry{ size, file_id, (uint32_t)filename.size(), 0 };
+				append(m_data, &entry, sizeof(entry));
+				append_name(m_data, filename);
+				++header().number_of_files;
+			}
+
+			void add_subdirectory(std::wstring_view name)
+			{
+				const subdirectory_entry entry{ (uint32_t)name.size(), 0 };
+				append(m_subdirectories, &entry, sizeof(entry));
+				append_name(m_subdirectories, name);
+				++header().number_of_subdirectories;
+			}
+
+			/// <summary>
+			/// Get the complete record. Call this once, after all files and subdirectories have been added.
+			/// </summary>
+			const directory_record* finish()
+			{
+				// subdirectories follow all files
+				m_data.insert(m_data.end(), m_subdirectories.begin(), m_subdirectories.end());
+				header().record_size = (uint32_t)(m_data.size() * sizeof(uint64_t));
+				return &header();
+			}
+
+		private:
+			directory_record& header()
+			{
+				return *(directory_record*)m_data.data();
+			}
+
+			static void append(std::vector<uint64_t>& output, const void* data, size_t size)
+			{
+				if (!size)
+					return;
+
+				const auto offset{ output.size() };
+				output.resize(offset + (size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+				memcpy(&output[offset], data, size);
+			}
+
+			static void append_name(std::vector<uint64_t>& output, std::wstring_view name)
+			{
+				append(output, name.data(), name.size() * sizeof(wchar_t));
+			}
+
+		private:
+			// uint64_t, so that the record is aligned
+			std::vector<uint64_t> m_data;
+			std::vector<uint64_t> m_subdirectories;
+		};
+
+		scan_manifest()
+			:
+			m_hFile{ INVALID_HANDLE_VALUE },
+			m_succeeded{ true }
+		{
+		}
+
+		~scan_manifest()
+		{
+			close();
+		}
+
+	private:
+		scan_manifest(const scan_manifest&) = delete;
+		scan_manifest& operator=(const scan_manifest&) = delete;
+		scan_manifest(scan_manifest&&) = delete;
+		scan_manifest& operator=(scan_manifest&&) = delete;
+
+	public:
+		/// <summary>
+		/// Open the previous manifest, if there is one, and start writing the new one
+		/// </summary>
+		/// <param name="pathname">manifest filename</param>
+		/// <returns>true if the manifest can be used, or false otherwise</returns>
+		bool open(std::string_view pathname)
+		{
+			close();
+			m_pathname = pathname;
+			m_succeeded = true;
+
+			if (file::exists(pathname) && !read_previous_manifest())
+			{
+				m_pathname.clear();
+				return false;
+			}
+
+			const auto temp_pathname{ m_pathname + ".tmp" };
+			m_hFile = ::CreateFileW(string::encode_as_utf16(temp_pathname).c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+			if (m_hFile == INVALID_HANDLE_VALUE)
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("CreateFileW({}) failed", temp_pathname));
+				m_file.close();
+				m_lookup.clear();
+				m_pathname.clear();
+				return false;
+			}
+			m_pending.insert(m_pending.end(), (const char*)&expected_header(), (const char*)&expected_header() + sizeof(file_header));
+			return true;
+		}
+
+		bool is_open() const
+		{
+			return !m_pathname.empty();
+		}
+
+		/// <summary>
+		/// Find a directory that hasn't changed since the last scan. This is safe to call from multiple threads.
+		/// </summary>
+		/// <returns>the record of the directory, or nullptr if it is new or has changed</returns>
+		const directory_record* find(std::wstring_view pathname, uint32_t volume_serial_number, uint64_t last_write_time) const
+		{
+			const auto existing{ m_lookup.find(pathname) };
+			if (existing == m_lookup.end())
+				return nullptr;
+
+			const auto record{ existing->second };
+			if ((record->volume_serial_number != volume_serial_number) || (record->last_write_time != last_write_time))
+				return nullptr;
+
+			return record;
+		}
+
+		/// <summary>
+		/// Enumerate the files and subdirectories of a directory record, in the order they were added
+		/// </summary>
+		/// <param name="record">a valid record</param>
+		/// <param name="on_file">called with name, size and file id of each file</param>
+		/// <param name="on_subdirectory">called with the name of each subdirectory</param>
+		template <typename FILE_CALLBACK, typename SUBDIRECTORY_CALLBACK> static void for_each_entry(const directory_record* record, FILE_CALLBACK on_file, SUBDIRECTORY_CALLBACK on_subdirectory)
+		{
+			auto p{ (const char*)record + sizeof(directory_record) + aligned_size(record->path_length * sizeof(wchar_t)) };
+			for (uint32_t index = 0; index < record->number_of_files; ++index)
+			{
+				const auto entry{ (const file_entry*)p };
+				on_file(std::wstring_view{ (const wchar_t*)(entry + 1), entry->name_length }, entry->size, entry->file_id);
+				p += sizeof(file_entry) + aligned_size(entry->name_length * sizeof(wchar_t));
+			}
+			for (uint32_t index = 0; index < record->number_of_subdirectories; ++index)
+			{
+				const auto entry{ (const subdirectory_entry*)p };
+				on_subdirectory(std::wstring_view{ (const wchar_t*)(entry + 1), entry->name_length });
+				p += sizeof(subdirectory_entry) + aligned_size(entry->name_length * sizeof(wchar_t));
+			}
+		}
+
+		/// <summary>
+		/// Add a directory to the new manifest. This is safe to call from multiple threads.
+		/// </summary>
+		void store(const directory_record* record)
+		{
+			std::lock_guard<std::mutex> lock{ m_pending_lock };
+			m_pending.insert(m_pending.end(), (const char*)record, (const char*)record + record->record_size);
+			if (m_pending.size() >= WRITE_BUFFER_SIZE)
+			{
+				m_succeeded = write_pending() && m_succeeded;
+			}
+		}
+
+		/// <summary>
+		/// Finish the new manifest and replace the previous one with it
+		/// </summary>
+		/// <returns>true if the manifest could be written, or false otherwise</returns>
+		bool close()
+		{
+			if (!is_open())
+				return true;
+
+			const auto temp_pathname{ m_pathname + ".tmp" };
+			bool succeeded = write_pending() && m_succeeded;
+			::CloseHandle(m_hFile);
+			m_hFile = INVALID_HANDLE_VALUE;
+
+			// the lookup points into the mapped file
+			m_lookup.clear();
+			m_file.close();
+			if (!succeeded)
+			{
+				file::remove(temp_pathname);
+			}
+			else if (!::MoveFileExW(string::encode_as_utf16(temp_pathname).c_str(), string::encode_as_utf16(m_pathname).c_str(), MOVEFILE_REPLACE_EXISTING))
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("Unable to rename {} as {}", temp_pathname, m_pathname));
+				succeeded = false;
+			}
+			m_pending.clear();
+			m_pathname.clear();
+			return succeeded;
+		}
+
+		size_t number_of_known_directories() const
+		{
+			return m_lookup.size();
+		}
+
+	private:
+		struct file_header
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t reserved;
+		};
+
+		// followed by the name
+		struct file_entry
+		{
+			uint64_t size;
+			uint64_t file_id;
+			uint32_t name_length;
+			uint32_t reserved;
+		};
+		static_assert(sizeof(file_entry) == 24);
+
+		// followed by the name
+		struct subdirectory_entry
+		{
+			uint32_t name_length;
+			uint32_t reserved;
+		};
+
+		static constexpr size_t RECORD_ALIGNMENT = 8;
+		static constexpr size_t WRITE_BUFFER_SIZE = 1024 * 1024 * 16;
+
+		static const file_header& expected_header()
+		{
+			static const file_header header{ { 'D', 'D', 'U', 'P', 'E', '-', 'S', 'M' }, 3, 0 };
+			return header;
+		}
+
+		static size_t aligned_size(size_t size)
+		{
+			return (size + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1);
+		}
+
+		bool read_previous_manifest()
+		{
+			if (!m_file.open(m_pathname, FILE_FLAG_SEQUENTIAL_SCAN))
+				return false;
+
+			const auto data{ m_file.data() };
+			const auto size{ m_file.size() };
+			if ((size < sizeof(file_header)) || memcmp(data, &expected_header(), sizeof(file_header)))
+			{
+				// there is nothing in it we cannot find out by scanning again
+				console::formatline(CONSOLE_FOREGROUND_YELLOW "{} is not a ddupe scan manifest (or was written by an incompatible version) and will be rebuilt" CONSOLE_STANDARD, m_pathname);
+				m_file.close();
+				return true;
+			}
+
+			uint64_t offset = sizeof(file_header);
+			while (offset + sizeof(directory_record) <= size)
+			{
+				const auto record{ (const directory_record*)(data + offset) };
+				if ((record->record_size % RECORD_ALIGNMENT) ||
+					(offset + record->record_size > size) ||
+					!is_valid(record))
+				{
+					// most likely a record that was only partially written when ddupe was interrupted
+					break;
+				}
+				const std::wstring_view path{ (const wchar_t*)(record + 1), record->path_length };
+				m_lookup[path] = record;
+				offset += record->record_size;
+			}
+			return true;
+		}
+
+		// checks that all entries are within the record
+		static bool is_valid(const directory_record* record)
+		{
+			const auto end{ (const char*)record + record->record_size };
+			auto p{ (const char*)record + sizeof(directory_record) };
+			if (p + aligned_size(record->path_length * sizeof(wchar_t)) > end)
+				return false;
+
+			p += aligned_size(record->path_length * sizeof(wchar_t));
+			for (uint32_t index = 0; index < record->number_of_files; ++index)
+			{
+				if (p + sizeof(file_entry) > end)
+					return false;
+
+				p += sizeof(file_entry) + aligned_size(((const file_entry*)p)->name_length * sizeof(wchar_t));
+				if (p > end)
+					return false;
+			}
+			for (uint32_t index = 0; index < record->number_of_subdirectories; ++index)
+			{
+				if (p + sizeof(subdirectory_entry) > end)
+					return false;
+
+				p += sizeof(subdirectory_entry) + aligned_size(((const subdirectory_entry*)p)->name_length * sizeof(wchar_t));
+				if (p > end)
+					return false;
+			}
+			return p == end;
+		}
+
+		bool write_pending()
+		{
+			const char* p = m_pending.data();
+			size_t size = m_pending.size();
+			while (size)
+			{
+				DWORD bytes_written = 0;
+				if (!::WriteFile(m_hFile, p, (DWORD)size, &bytes_written, nullptr))
+				{
+					logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+						fmt::format("WriteFile({}.tmp) failed", m_pathname));
+					m_pending.clear();
+					return false;
+				}
+				p += bytes_written;
+				size -= bytes_written;
+			}
+			m_pending.clear();
+			return true;
+		}
+
+	private:
+		std::string m_pathname;
+		memory_mapped_file m_file;
+
+		// keys and values point into the mapped file
+		std::unordered_map<std::wstring_view, const directory_record*> m_lookup;
+
+		// the new manifest
+		HANDLE m_hFile;
+		std::mutex m_pending_lock;
+		std::vector<char> m_pending;
+		bool m_succeeded;
+	};
+}
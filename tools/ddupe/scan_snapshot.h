@@ -0,0 +1,450 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <ngbtools/string.h>
+#include <ngbtools/console.h>
+#include <ngbtools/digest.h>
+#include <ngbtools/hasher.h>
+#include <ngbtools/logging.h>
+#include <ngbtools/memory_mapped_file.h>
+#include <ngbtools/windows_errors.h>
+
+namespace ngbtools
+{
+	/// <summary>
+	/// The size, checksum and location of every file one run of ddupe has checked, for finding duplicates across
+	/// machines: each machine writes a snapshot of its own files, and ddupe /MERGE reads any number of them and
+	/// reports the groups of identical files, without reading any of the files again.
+	///
+	/// Files are sorted by size and checksum, so that merging is a single pass over all snapshots side by side,
+	/// however large they are. All numbers are little-endian and nothing is aligned:
+	///
+	///		header: the 8 characters DDUPE-SS, uint32_t version (1), uint16_t hash_algorithm, uint16_t digest size,
+	///			uint64_t number of files, uint32_t number of directories, then the name of the host as a string
+	///		directories: the full path of each, as a string
+	///		files: uint64_t size, the digest, uint32_t index of the directory, then the filename as a string
+	///
+	/// A string is a uint32_t size and that many bytes of UTF-8. Each directory is stored only once, which keeps
+	/// a snapshot of a million files at about 50 MB.
+	/// </summary>
+	class snapshot_writer final
+	{
+	public:
+		snapshot_writer()
+			:
+			m_hFile{ INVALID_HANDLE_VALUE },
+			m_algorithm{ hash_algorithm::FAST128 }
+		{
+		}
+
+		~snapshot_writer()
+		{
+			close();
+		}
+
+	private:
+		snapshot_writer(const snapshot_writer&) = delete;
+		snapshot_writer& operator=(const snapshot_writer&) = delete;
+		snapshot_writer(snapshot_writer&&) = delete;
+		snapshot_writer& operator=(snapshot_writer&&) = delete;
+
+	public:
+		/// <summary>
+		/// Create the snapshot file, replacing any existing file. Files are collected in memory and only
+		/// written, sorted, on close().
+		/// </summary>
+		/// <param name="pathname">snapshot filename</param>
+		/// <param name="host">name of the machine the files are on</param>
+		/// <param name="algorithm">algorithm all checksums are calculated with</param>
+		/// <returns>true if the file was created, or false otherwise</returns>
+		bool open(std::string_view pathname, std::string_view host, hash_algorithm algorithm)
+		{
+			close();
+			m_hFile = ::CreateFileW(string::encode_as_utf16(pathname).c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+			if (m_hFile == INVALID_HANDLE_VALUE)
+			{
+				logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+					fmt::format("CreateFileW({}) failed", pathname));
+				return false;
+			}
+			m_pathname = pathname;
+			m_host = host;
+			m_algorithm = algorithm;
+			return true;
+		}
+
+		bool is_open() const
+		{
+			return m_hFile != INVALID_HANDLE_VALUE;
+		}
+
+		/// <summary>
+		/// Add a file
+		/// </summary>
+		/// <param name="pathname">full path of the file</param>
+		void add(std::string_view pathname, uint64_t size, const digest& checksum)
+		{
+			const auto separator{ pathname.find_last_of('\\') };
+			const auto directory{ (separator == std::string_view::npos) ? std::string_view{} : pathname.substr(0, separator) };
+			const auto filename{ (separator == std::string_view::npos) ? pathname : pathname.substr(separator + 1) };
+
+			const auto existing{ m_directory_lookup.find(directory) };
+			uint32_t directory_index;
+			if (existing == m_directory_lookup.end())
+			{
+				directory_index = (uint32_t)m_directories.size();
+				m_directories.emplace_back(directory);
+				m_directory_lookup[m_directories.back()] = directory_index;
+			}
+			else
+			{
+				directory_index = existing->second;
+			}
+
+			m_files.push_back({ size, (uint64_t)m_names.size(), (uint32_t)filename.size(), directory_index, (uint32_t)m_files.size() });
+			m_names.insert(m_names.end(), filename.begin(), filename.end());
+			m_digests.insert(m_digests.end(), checksum.data(), checksum.data() + checksum.size());
+		}
+
+		/// <summary>
+		/// Sort all files and write the snapshot
+		/// </summary>
+		/// <returns>true if the whole snapshot could be written, or false otherwise</returns>
+		bool close()
+		{
+			if (!is_open())
+				return true;
+
+			const auto digest_size{ hasher::digest_size(m_algorithm) };
+			std::sort(m_files.begin(), m_files.end(), [this, digest_size](const file_entry& a, const file_entry& b)
+				{
+					if (a.size != b.size)
+						return a.size < b.size;
+
+					const auto order{ memcmp(&m_digests[a.digest * digest_size], &m_digests[b.digest * digest_size], digest_size) };
+					if (order)
+						return order < 0;
+
+					if (a.directory != b.directory)
+						return m_directories[a.directory] < m_directories[b.directory];
+
+					return name(a) < name(b);
+				});
+
+			std::vector<char> buffer;
+			buffer.reserve(WRITE_BUFFER_SIZE + 1024 * 128);
+			append(buffer, "DDUPE-SS", 8);
+			append_number(buffer, (uint32_t)1);
+			append_number(buffer, (uint16_t)m_algorithm);
+			append_number(buffer, (uint16_t)digest_size);
+			append_number(buffer, (uint64_t)m_files.size());
+			append_number(buffer, (uint32_t)m_directories.size());
+			append_string(buffer, m_host);
+
+			bool succeeded = true;
+			for (const auto& directory : m_directories)
+			{
+				append_string(buffer, directory);
+				if (buffer.size() >= WRITE_BUFFER_SIZE)
+				{
+					succeeded = write(buffer) && succeeded;
+				}
+			}
+			for (const auto& file : m_files)
+			{
+				append_number(buffer, file.size);
+				append(buffer, &m_digests[file.digest * digest_size], digest_size);
+				append_number(buffer, file.directory);
+				append_string(buffer, name(file));
+				if (buffer.size() >= WRITE_BUFFER_SIZE)
+				{
+					succeeded = write(buffer) && succeeded;
+				}
+			}
+			succeeded = write(buffer) && succeeded;
+
+			::CloseHandle(m_hFile);
+			m_hFile = INVALID_HANDLE_VALUE;
+			m_pathname.clear();
+			m_files.clear();
+			m_names.clear();
+			m_digests.clear();
+			m_directories.clear();
+			m_directory_lookup.clear();
+			return succeeded;
+		}
+
+	private:
+		struct file_entry
+		{
+			uint64_t size;
+
+			// offset and length of the filename in m_names
+			uint64_t name;
+			uint32_t name_length;
+			uint32_t directory;
+
+			// index of the digest in m_digests, which doesn't move when the files are sorted
+			uint32_t digest;
+		};
+
+		std::string_view name(const file_entry& file) const
+		{
+			return std::string_view{ m_names.data() + file.name, file.name_length };
+		}
+
+		static void append(std::vector<char>& output, const void* data, size_t size)
+		{
+			output.insert(output.end(), (const char*)data, (const char*)data + size);
+		}
+
+		// Windows only runs little-endian
+		template <typename T> static void append_number(std::vector<char>& output, T value)
+		{
+			append(output, &value, sizeof(value));
+		}
+
+		static void append_string(std::vector<char>& output, std::string_view text)
+		{
+			append_number(output, (uint32_t)text.size());
+			append(output, text.data(), text.size());
+		}
+
+		bool write(std::vector<char>& buffer)
+		{
+			const char* p = buffer.data();
+			size_t size = buffer.size();
+			while (size)
+			{
+				DWORD bytes_written = 0;
+				if (!::WriteFile(m_hFile, p, (DWORD)size, &bytes_written, nullptr))
+				{
+					logging::report_windows_error(GetLastError(), FUNCTION_CONTEXT,
+						fmt::format("WriteFile({}) failed", m_pathname));
+					buffer.clear();
+					return false;
+				}
+				p += bytes_written;
+				size -= bytes_written;
+			}
+			buffer.clear();
+			return true;
+		}
+
+	private:
+		static constexpr size_t WRITE_BUFFER_SIZE = 1024 * 1024 * 16;
+
+		HANDLE m_hFile;
+		std::string m_pathname;
+		std::string m_host;
+		hash_algorithm m_algorithm;
+		std::vector<file_entry> m_files;
+		std::vector<char> m_names;
+		std::vector<unsigned char> m_digests;
+
+		// a deque, so that the keys of the lookup stay where they are
+		std::deque<std::string> m_directories;
+		std::unordered_map<std::string_view, uint32_t> m_directory_lookup;
+	};
+
+	/// <summary>
+	/// Reads the files of a snapshot written by snapshot_writer one by one, in the order they were sorted.
+	/// The snapshot is memory-mapped, so only the list of directories is kept in memory.
+	/// </summary>
+	class snapshot_reader final
+	{
+	public:
+		struct file
+		{
+			uint64_t size;
+
+			// digest_size() bytes
+			const unsigned char* checksum;
+			uint32_t directory;
+			std::string_view name;
+		};
+
+		snapshot_reader()
+			:
+			m_algorithm{ hash_algorithm::FAST128 },
+			m_digest_size{ 0 },
+			m_number_of_files{ 0 },
+			m_files_left{ 0 },
+			m_offset{ 0 },
+			m_is_valid{ true }
+		{
+		}
+
+	private:
+		snapshot_reader(const snapshot_reader&) = delete;
+		snapshot_reader& operator=(const snapshot_reader&) = delete;
+		snapshot_reader(snapshot_reader&&) = delete;
+		snapshot_reader& operator=(snapshot_reader&&) = delete;
+
+	public:
+		/// <summary>
+		/// Open a snapshot and read its header and directories
+		/// </summary>
+		/// <returns>true if this is a snapshot we can read, or false otherwise</returns>
+		bool open(std::string_view pathname)
+		{
+			m_pathname = pathname;
+			if (!m_file.open(pathname, FILE_FLAG_SEQUENTIAL_SCAN))
+				return false;
+
+			m_offset = 0;
+			char magic[8];
+			uint32_t version = 0;
+			uint16_t algorithm = 0;
+			uint16_t digest_size = 0;
+			uint32_t number_of_directories = 0;
+			if (!read(magic, sizeof(magic)) ||
+				memcmp(magic, "DDUPE-SS", sizeof(magic)) ||
+				!read_number(version) ||
+				(version != 1) ||
+				!read_number(algorithm) ||
+				!read_number(digest_size) ||
+				!read_number(m_number_of_files) ||
+				!read_number(number_of_directories) ||
+				!read_string(m_host))
+			{
+				console::formatline(CONSOLE_FOREGROUND_RED "{} is not a ddupe snapshot (or was written by an incompatible version)" CONSOLE_STANDARD, m_pathname);
+				return false;
+			}
+			m_algorithm = (hash_algorithm)algorithm;
+			m_digest_size = digest_size;
+			const bool is_known_algorithm{ (m_algorithm == hash_algorithm::MD5) || (m_algorithm == hash_algorithm::FAST128) || (m_algorithm == hash_algorithm::BLAKE3) };
+			if (!is_known_algorithm || (m_digest_size != hasher::digest_size(m_algorithm)))
+				return report_damage();
+
+			// every directory takes at least its size
+			if (number_of_directories > (m_file.size() - m_offset) / sizeof(uint32_t))
+				return report_damage();
+
+			m_directories.resize(number_of_directories);
+			for (auto& directory : m_directories)
+			{
+				if (!read_string(directory))
+					return report_damage();
+			}
+			m_files_left = m_number_of_files;
+			m_is_valid = true;
+			return true;
+		}
+
+		/// <summary>
+		/// Read the next file
+		/// </summary>
+		/// <returns>true if there was another file, or false at the end (or if the snapshot is damaged, see is_valid())</returns>
+		bool next(file& result)
+		{
+			if (!m_files_left || !m_is_valid)
+				return false;
+
+			if (!read_number(result.size) ||
+				(m_offset + m_digest_size > m_file.size()))
+			{
+				return report_damage();
+			}
+			result.checksum = m_file.data() + m_offset;
+			m_offset += m_digest_size;
+			if (!read_number(result.directory) ||
+				(result.directory >= m_directories.size()) ||
+				!read_string(result.name))
+			{
+				return report_damage();
+			}
+			--m_files_left;
+			return true;
+		}
+
+		bool is_valid() const
+		{
+			return m_is_valid;
+		}
+
+		const std::string& pathname() const
+		{
+			return m_pathname;
+		}
+
+		std::string_view host() const
+		{
+			return m_host;
+		}
+
+		hash_algorithm algorithm() const
+		{
+			return m_algorithm;
+		}
+
+		size_t digest_size() const
+		{
+			return m_digest_size;
+		}
+
+		uint64_t number_of_files() const
+		{
+			return m_number_of_files;
+		}
+
+		std::string_view directory(uint32_t index) const
+		{
+			return m_directories[index];
+		}
+
+	private:
+		bool report_damage()
+		{
+			console::formatline(CONSOLE_FOREGROUND_RED "{} is damaged" CONSOLE_STANDARD, m_pathname);
+			m_is_valid = false;
+			return false;
+		}
+
+		bool read(void* result, size_t size)
+		{
+			if (m_offset + size > m_file.size())
+				return false;
+
+			memcpy(result, m_file.data() + m_offset, size);
+			m_offset += size;
+			return true;
+		}
+
+		template <typename T> bool read_number(T& result)
+		{
+			return read(&result, sizeof(result));
+		}
+
+		// the view points into the mapped file
+		bool read_string(std::string_view& result)
+		{
+			uint32_t size = 0;
+			if (!read_number(size) || (m_offset + size > m_file.size()))
+				return false;
+
+			result = std::string_view{ (const char*)m_file.data() + m_offset, size };
+			m_offset += size;
+			return true;
+		}
+
+	private:
+		std::string m_pathname;
+		memory_mapped_file m_file;
+		std::string_view m_host;
+		hash_algorithm m_algorithm;
+		size_t m_digest_size;
+		uint64_t m_number_of_files;
+		uint64_t m_files_left;
+		uint64_t m_offset;
+		std::vector<std::string_view> m_directories;
+		bool m_is_valid;
+	};
+}
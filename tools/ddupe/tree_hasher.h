@@ -0,0 +1,248 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <ngbtools/blake3.h>
+#include <ngbtools/hasher.h>
+#include <ngbtools/work_stealing_pool.h>
+
+#include "instrumentation.h"
+
+namespace ngbtools
+{
+	/// <summary>
+	/// Hashes a single large file with BLAKE3 on all threads of a pool. BLAKE3 is a tree hash, so the input can be
+	/// cut into segments whose chaining values other workers calculate while the thread reading the file reads on.
+	/// The digest is the same as with blake3_hasher, so checksums in the cache and in filenames stay valid.
+	///
+	/// The reading thread never waits for a segment that nobody has started yet: it hashes that one itself. This
+	/// makes it safe to use a tree_hasher from within a task of the pool it hands segments to.
+	/// </summary>
+	class tree_hasher final : public hasher
+	{
+	public:
+		/// <summary>
+		/// Shared by all tree_hashers of a pool, so that together they never keep more than a fixed number of
+		/// segments in memory. Once the budget is used up, segments are hashed by the reading thread.
+		/// </summary>
+		struct budget
+		{
+			explicit budget(size_t maximum_segments)
+				:
+				maximum_segments{ maximum_segments },
+				segments_in_use{ 0 }
+			{
+			}
+
+			const size_t maximum_segments;
+			std::atomic<size_t> segments_in_use;
+		};
+
+		// 4096 chunks: a subtree needs a power of two
+		static constexpr size_t SEGMENT_SIZE = 1024 * 1024 * 4;
+
+		tree_hasher(work_stealing_pool& pool, tree_hasher::budget& budget, ngbtools::instrumentation& instrumentation)
+			:
+			m_pool{ pool },
+			m_budget{ budget },
+			m_instrumentation{ instrumentation },
+			m_next_chunk{ 0 }
+		{
+			m_current.reserve(SEGMENT_SIZE);
+		}
+
+		~tree_hasher() override
+		{
+			abandon_segments();
+		}
+
+	private:
+		tree_hasher(const tree_hasher&) = delete;
+		tree_hasher& operator=(const tree_hasher&) = delete;
+		tree_hasher(tree_hasher&&) = delete;
+		tree_hasher& operator=(tree_hasher&&) = delete;
+
+	public:
+		hash_algorithm algorithm() const override
+		{
+			return hash_algorithm::BLAKE3;
+		}
+
+		void reset() override
+		{
+			// only after a failed read are there segments left over: reset() as soon as it fails, to release them
+			abandon_segments();
+			m_hash.reset();
+			m_current.clear();
+			m_next_chunk = 0;
+		}
+
+		void update(const unsigned char* data, size_t size) override
+		{
+			while (size)
+			{
+				// like a chunk, a segment is only handed off once we know more input follows
+				if (m_current.size() == SEGMENT_SIZE)
+				{
+					hand_off();
+				}
+				const auto bytes_to_take{ std::min(size, SEGMENT_SIZE - m_current.size()) };
+				m_current.insert(m_current.end(), data, data + bytes_to_take);
+				data += bytes_to_take;
+				size -= bytes_to_take;
+			}
+		}
+
+		void finalize(unsigned char* result) override
+		{
+			while (!m_pending.empty())
+			{
+				complete_oldest();
+			}
+			m_hash.update(m_current.data(), m_current.size());
+			m_current.clear();
+			m_hash.finalize(result);
+		}
+
+	private:
+		enum : int
+		{
+			QUEUED,
+			RUNNING,
+			DONE,
+		};
+
+		struct segment
+		{
+			std::vector<unsigned char> data;
+			uint64_t first_chunk;
+			uint32_t chaining_value[8];
+			bool counts_against_budget;
+			std::atomic<int> state;
+			std::mutex lock;
+			std::condition_variable done;
+		};
+
+		void hand_off()
+		{
+			auto next{ std::make_shared<segment>() };
+			next->data.swap(m_current);
+			next->first_chunk = m_next_chunk;
+			next->counts_against_budget = reserve_budget();
+			next->state = QUEUED;
+			m_next_chunk += SEGMENT_SIZE / blake3::CHUNK_SIZE;
+
+			if (next->counts_against_budget)
+			{
+				m_pool.submit_first([next, &instrumentation = m_instrumentation](size_t)
+					{
+						hash_segment(*next, instrumentation);
+					});
+			}
+			else
+			{
+				hash_segment(*next, m_instrumentation);
+			}
+			m_pending.push_back(std::move(next));
+
+			if (!m_free.empty())
+			{
+				m_current.swap(m_free.back());
+				m_free.pop_back();
+			}
+			m_current.reserve(SEGMENT_SIZE);
+		}
+
+		// whoever gets here first hashes the segment: a worker of the pool, or the reading thread
+		static void hash_segment(segment& work, ngbtools::instrumentation& instrumentation)
+		{
+			int expected{ QUEUED };
+			if (!work.state.compare_exchange_strong(expected, RUNNING))
+				return;
+
+			instrumentation::timer timer{ instrumentation, activity::HASH };
+			blake3::subtree_chaining_value(work.data.data(), work.data.size(), work.first_chunk, work.chaining_value);
+			timer.stop(work.data.size());
+			{
+				std::unique_lock<std::mutex> lock{ work.lock };
+				work.state = DONE;
+			}
+			work.done.notify_all();
+		}
+
+		void complete_oldest()
+		{
+			auto oldest{ std::move(m_pending.front()) };
+			m_pending.pop_front();
+
+			hash_segment(*oldest, m_instrumentation);
+			{
+				std::unique_lock<std::mutex> lock{ oldest->lock };
+				oldest->done.wait(lock, [&oldest]() { return oldest->state == DONE; });
+			}
+			m_hash.add_subtree(oldest->chaining_value, SEGMENT_SIZE);
+			release(*oldest);
+		}
+
+		// segments that nobody has started are dropped, the others must finish before their memory can go
+		void abandon_segments()
+		{
+			while (!m_pending.empty())
+			{
+				auto oldest{ std::move(m_pending.front()) };
+				m_pending.pop_front();
+
+				int expected{ QUEUED };
+				if (!oldest->state.compare_exchange_strong(expected, DONE))
+				{
+					std::unique_lock<std::mutex> lock{ oldest->lock };
+					oldest->done.wait(lock, [&oldest]() { return oldest->state == DONE; });
+				}
+				release(*oldest);
+			}
+		}
+
+		bool reserve_budget()
+		{
+			auto segments_in_use{ m_budget.segments_in_use.load() };
+			do
+			{
+				if (segments_in_use >= m_budget.maximum_segments)
+					return false;
+			} while (!m_budget.segments_in_use.compare_exchange_weak(segments_in_use, segments_in_use + 1));
+			return true;
+		}
+
+		void release(segment& work)
+		{
+			if (work.counts_against_budget)
+			{
+				--m_budget.segments_in_use;
+			}
+
+			// keep a few buffers, so that the next segments need no new memory
+			if (m_free.size() < MAXIMUM_FREE_BUFFERS)
+			{
+				work.data.clear();
+				m_free.push_back(std::move(work.data));
+			}
+		}
+
+	private:
+		static constexpr size_t MAXIMUM_FREE_BUFFERS = 2;
+
+		work_stealing_pool& m_pool;
+		budget& m_budget;
+		ngbtools::instrumentation& m_instrumentation;
+		blake3 m_hash;
+		std::vector<unsigned char> m_current;
+		uint64_t m_next_chunk;
+		std::deque<std::shared_ptr<segment>> m_pending;
+		std::vector<std::vector<unsigned char>> m_free;
+	};
+}
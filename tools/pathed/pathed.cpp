@@ -116,8 +116,8 @@ namespace ngbtools
 				apply_changes = true;
 			}
 			
-			const auto tokens{ string::split(wstring::encode_as_utf8(wstr_env_data).c_str(), ";", false) };
-			for (const auto token : tokens)
+			const auto env_data{ wstring::encode_as_utf8(wstr_env_data) };
+			for (const auto token : string::tokenize(env_data, ";"))
 			{
 				add_individual_path_element(token, index, apply_changes);
 			}